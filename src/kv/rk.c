@@ -77,6 +77,10 @@ server_connect(action_t *action)
     usage("Need to specify hosts with -u or RK_SERVERS.");
   }
   rc = riak_client_init(NULL, action->n_urls);
+  if (action->rate > 0) {
+    /* Bulk commands wait their turn rather than flood the cluster. */
+    riak_limit_config(rc, action->rate, 1, 0, 1);
+  }
   for (i = 0; i < action->n_urls; i++) {
     riak_server_add(rc, action->hosts[i], action->ports[i]);
     if (action->verbose) {
@@ -92,6 +96,9 @@ action_ls(action_t *action, RiakClient *rc)
 {
   int i, j;
   RiakResponse *rv = NULL;
+  RiakKeys *keys;
+  ProtobufCBinaryData key;
+  size_t n_keys;
 
   if (action->ls.n_buckets) {
     for (i = 0; i < action->ls.n_buckets; i++) {
@@ -104,17 +111,26 @@ action_ls(action_t *action, RiakClient *rc)
         if (!rv || !rv->success) {
           usage_rv(rv, "ls: Comms error.");
         }
-        for (j = 0; j < rv->kl.resp->n_keys; j++) {
+        /* Walk the keys end to end rather than through the message,
+         * unless the frame was unpacked the usual way. */
+        keys = &rv->kl.keys;
+        n_keys = keys->off? keys->n: rv->kl.resp->n_keys;
+        for (j = 0; j < n_keys; j++) {
+          if (keys->off) {
+            key.data = keys->data + keys->off[j];
+            key.len = keys->off[j + 1] - keys->off[j];
+          } else {
+            key = rv->kl.resp->keys[j];
+          }
           if (action->ls.hex) {
             int i;
 
-            for (i = 0; i < rv->kl.resp->keys[j].len; i++) {
-              printf("%02hhx", rv->kl.resp->keys[j].data[i]);
+            for (i = 0; i < key.len; i++) {
+              printf("%02hhx", key.data[i]);
             }
             printf("\n");
           } else {
-            printf("%.*s\n", (int)rv->kl.resp->keys[j].len,
-                rv->kl.resp->keys[j].data);
+            printf("%.*s\n", (int)key.len, key.data);
           }
           if (action->ls.verbose) {
             RiakResponse *rv_get = NULL;
@@ -123,7 +139,7 @@ action_ls(action_t *action, RiakClient *rc)
             req.has_head = 1;
             req.head = 1;
             rv_get = riak_fetch_object_full(rc, action->ls.buckets[i],
-                &rv->kl.resp->keys[j], &req);
+                &key, &req);
             if (rv_get && rv_get->g.resp->n_content > 0) {
               int i;
 
@@ -119,9 +119,10 @@ void
 usage(char *message)
 {
   char *u[] = {
-    "USAGE: rk [-v] [-s host:port] <command>",
+    "USAGE: rk [-v] [-s host:port] [-r rate] <command>",
     "    -v - Verbose.",
     "    -s - Add the given server. Can be specified multiple times.",
+    "    -r - Send at most rate requests per second.",
     "    Where command is one of:",
     "    ls   - [bucket1 bucket2 ...]",
     "           List buckets (no buckets given). List keys in buckets.",
@@ -703,6 +704,7 @@ parse_commandline(int argc, char **argv)
   action_t *action;
   struct option options[] = {
     {"server",  required_argument, 0,  's' },
+    {"rate",    required_argument, 0,  'r' },
     {"verbose", no_argument,       0,  'v' },
     {"debug",   no_argument,       0,  'd' },
     {"help",    no_argument,       0,  'h' },
@@ -716,6 +718,7 @@ parse_commandline(int argc, char **argv)
   action->hosts = action->ports = NULL;
   action->verbose = 0;
   action->debug = 0;
+  action->rate = 0;
 
   parse_config_file(action);
   parse_environment(action);
@@ -725,7 +728,7 @@ parse_commandline(int argc, char **argv)
       break;
     }
 
-    c = getopt_long(argc, argv, "s:vdh", options, NULL);
+    c = getopt_long(argc, argv, "s:r:vdh", options, NULL);
     if (c == -1) {
       break;
     }
@@ -744,6 +747,12 @@ parse_commandline(int argc, char **argv)
           usage("Unknown url.");
         }
         break;
+      case 'r':
+        action->rate = atoi(optarg);
+        if (action->rate <= 0) {
+          usage("Rate must be a positive number.");
+        }
+        break;
       case 'v':
         action->verbose = 1;
         break;
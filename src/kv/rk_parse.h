@@ -21,6 +21,7 @@ typedef struct _action_t {
   char **ports;
   int verbose;
   int debug;
+  int rate;
   subcommand_t subcommand;
   union {
     struct {
@@ -47,6 +47,7 @@ extern char *strdup(char *s);
 #include "riak_search.pb-c.h"
 #include "riak_yokozuna.pb-c.h"
 #include "riakccs/api.h"
+#include "riakccs/comms.h"
 #include "riakccs/pb.h"
 #include "riakccs/debug.h"
 
@@ -65,7 +66,7 @@ riak_ping(RiakClient *rc)
   RiakResponse *rv;
 
   /* Send a ping request. */
-  rs = rc->_write(rc, NULL, MC_RpbPingReq, 0, NULL);
+  rs = rc->_write(rc, NULL, MC_RpbPingReq, NULL);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -98,7 +99,7 @@ riak_list_buckets(RiakClient *rc)
   RiakResponse *rv;
 
   /* Make and send a list buckets request. */
-  rs = rc->_write(rc, NULL, MC_RpbListBucketsReq, 0, NULL);
+  rs = rc->_write(rc, NULL, MC_RpbListBucketsReq, NULL);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -131,20 +132,14 @@ riak_list_buckets(RiakClient *rc)
 RiakResponse *
 riak_list_keys(RiakClient *rc, RiakResponse *rv, unsigned char *bucket)
 {
-  uint8_t *pb;
-  size_t len;
+  /* Outlives the first read, which may send it again. */
+  RpbListKeysReq req = RPB_LIST_KEYS_REQ__INIT;
   RiakSession *rs;
 
   if (!rv) {
-    RpbListKeysReq req = RPB_LIST_KEYS_REQ__INIT;
-
     /* Make and send a list keys request. */
     str2pbbd(&req.bucket, bucket);
-    len = rpb_list_keys_req__get_packed_size(&req);
-    pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-    (void)rpb_list_keys_req__pack(&req, pb);
-    rs = rc->_write(rc, NULL, MC_RpbListKeysReq, len, pb);
-    rc->allocator->free(rc->allocator->allocator_data, pb);
+    rs = rc->_write(rc, NULL, MC_RpbListKeysReq, &req.base);
     if (!rs) {
       // TODO: log error.
       return NULL;
@@ -178,19 +173,13 @@ riak_list_keys(RiakClient *rc, RiakResponse *rv, unsigned char *bucket)
 RiakResponse *
 riak_get_bucket_props(RiakClient *rc, unsigned char *bucket)
 {
-  uint8_t *pb;
-  size_t len;
   RpbGetBucketReq req = RPB_GET_BUCKET_REQ__INIT;
   RiakSession *rs;
   RiakResponse *rv;
 
   /* Make and send a get bucket props request. */
   str2pbbd(&req.bucket, bucket);
-  len = rpb_get_bucket_req__get_packed_size(&req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_get_bucket_req__pack(&req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbGetBucketReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = rc->_write(rc, NULL, MC_RpbGetBucketReq, &req.base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -223,8 +212,6 @@ riak_set_bucket_props(RiakClient *rc,
     unsigned char *bucket,
     RpbBucketProps *props)
 {
-  uint8_t *pb;
-  size_t len;
   RpbSetBucketReq req = RPB_SET_BUCKET_REQ__INIT;
   RiakSession *rs;
   RiakResponse *rv;
@@ -232,11 +219,7 @@ riak_set_bucket_props(RiakClient *rc,
   /* Make and send a set bucket props request. */
   str2pbbd(&req.bucket, bucket);
   req.props = props;
-  len = rpb_set_bucket_req__get_packed_size(&req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_set_bucket_req__pack(&req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbSetBucketReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = rc->_write(rc, NULL, MC_RpbSetBucketReq, &req.base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -271,8 +254,6 @@ riak_fetch_object_full(RiakClient *rc,
     ProtobufCBinaryData *key,
     RpbGetReq *req)
 {
-  uint8_t *pb;
-  size_t len;
   RiakSession *rs;
   RiakResponse *rv;
 
@@ -280,11 +261,7 @@ riak_fetch_object_full(RiakClient *rc,
   str2pbbd(&req->bucket, bucket);
   req->key.data = key->data;
   req->key.len = key->len;
-  len = rpb_get_req__get_packed_size(req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_get_req__pack(req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbGetReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = _riak_hedge_req(rc, MC_RpbGetReq, &req->base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -311,18 +288,11 @@ riak_fetch_object_full(RiakClient *rc,
 RiakResponse *
 riak_store_object_full(RiakClient *rc, RpbPutReq *req)
 {
-  uint8_t *pb, mc;
-  int sd, err;
-  size_t len, bytes_tot;
   RiakSession *rs;
   RiakResponse *rv;
 
   /* Send a put request. */
-  len = rpb_put_req__get_packed_size(req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_put_req__pack(req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbPutReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = rc->_write(rc, NULL, MC_RpbPutReq, &req->base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -347,17 +317,11 @@ RiakResponse *
 riak_delete_object_full(RiakClient *rc,
     RpbDelReq *req)
 {
-  uint8_t *pb;
-  size_t len;
   RiakSession *rs;
   RiakResponse *rv;
 
   /* Make and send a del request. */
-  len = rpb_del_req__get_packed_size(req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_del_req__pack(req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbDelReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = rc->_write(rc, NULL, MC_RpbDelReq, &req->base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -391,8 +355,6 @@ RiakResponse *
 riak_map_reduce(RiakClient *rc, RiakResponse *rv,
     unsigned char *request, unsigned char *content_type)
 {
-  uint8_t *pb;
-  size_t len;
   RiakSession *rs;
 
   if (!rv) {
@@ -402,11 +364,7 @@ riak_map_reduce(RiakClient *rc, RiakResponse *rv,
     str2pbbd(&req.request, request);
     /* TODO: Check this for validity.  Or maybe this should be an enum? */
     str2pbbd(&req.content_type, content_type);
-    len = rpb_map_red_req__get_packed_size(&req);
-    pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-    (void)rpb_map_red_req__pack(&req, pb);
-    rs = rc->_write(rc, NULL, MC_RpbMapRedReq, len, pb);
-    rc->allocator->free(rc->allocator->allocator_data, pb);
+    rs = rc->_write(rc, NULL, MC_RpbMapRedReq, &req.base);
     if (!rs) {
       // TODO: log error.
       return NULL;
@@ -443,20 +401,14 @@ riak_map_reduce(RiakClient *rc, RiakResponse *rv,
 RiakResponse *
 riak_secondary_indexes(RiakClient *rc, RiakResponse *rv, RpbIndexReq *req)
 {
-  uint8_t *pb;
-  size_t len;
   RiakSession *rs;
 
   /* Send secondary index request. */
-  len = rpb_index_req__get_packed_size(req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_index_req__pack(req, pb);
   if (rv) {
-    rs = rc->_write(rc, rv, MC_RpbIndexReq, len, pb);
+    rs = rc->_write(rc, rv, MC_RpbIndexReq, &req->base);
   } else {
-    rs = rc->_write(rc, NULL, MC_RpbIndexReq, len, pb);
+    rs = rc->_write(rc, NULL, MC_RpbIndexReq, &req->base);
   }
-  rc->allocator->free(rc->allocator->allocator_data, pb);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -483,17 +435,11 @@ riak_secondary_indexes(RiakClient *rc, RiakResponse *rv, RpbIndexReq *req)
 RiakResponse *
 riak_search(RiakClient *rc, RpbSearchQueryReq *req)
 {
-  uint8_t *pb;
-  size_t len;
   RiakSession *rs;
   RiakResponse *rv;
 
   /* Send a search request. */
-  len = rpb_search_query_req__get_packed_size(req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_search_query_req__pack(req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbSearchQueryReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = rc->_write(rc, NULL, MC_RpbSearchQueryReq, &req->base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -527,7 +473,7 @@ riak_get_client_id(RiakClient *rc)
   RiakResponse *rv;
 
   /* Make and send a get client id request. */
-  rs = rc->_write(rc, NULL, MC_RpbGetClientIdReq, 0, NULL);
+  rs = rc->_write(rc, NULL, MC_RpbGetClientIdReq, NULL);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -556,19 +502,13 @@ riak_get_client_id(RiakClient *rc)
 RiakResponse *
 riak_set_client_id(RiakClient *rc, unsigned char *client_id)
 {
-  uint8_t *pb;
-  size_t len;
   RpbSetClientIdReq req = RPB_SET_CLIENT_ID_REQ__INIT;
   RiakSession *rs;
   RiakResponse *rv;
 
   /* Make and send a set client id request. */
   str2pbbd(&req.client_id, client_id);
-  len = rpb_set_client_id_req__get_packed_size(&req);
-  pb = rc->allocator->alloc(rc->allocator->allocator_data, len);
-  (void)rpb_set_client_id_req__pack(&req, pb);
-  rs = rc->_write(rc, NULL, MC_RpbSetClientIdReq, len, pb);
-  rc->allocator->free(rc->allocator->allocator_data, pb);
+  rs = rc->_write(rc, NULL, MC_RpbSetClientIdReq, &req.base);
   if (!rs) {
     // TODO: log error.
     return NULL;
@@ -601,7 +541,7 @@ riak_get_server_info(RiakClient *rc)
   RiakResponse *rv;
 
   /* Make and send a server info request. */
-  rs = rc->_write(rc, NULL, MC_RpbGetServerInfoReq, 0, NULL);
+  rs = rc->_write(rc, NULL, MC_RpbGetServerInfoReq, NULL);
   if (!rs) {
     // TODO: log error.
     return NULL;
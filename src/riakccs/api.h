@@ -1,6 +1,8 @@
 #ifndef RIAK_API_H
 #define RIAK_API_H
 
+#include <poll.h>
+
 #include "riak.pb-c.h"
 #include "riak_dt.pb-c.h"
 #include "riak_kv.pb-c.h"
@@ -56,29 +58,131 @@ typedef enum _riak_mc_t {
 #define RIAK_ACT_READ_PROC_HDR 3
 #define RIAK_ACT_READ_PB 4
 #define RIAK_ACT_FREE 5
+#define RIAK_ACT_CONNECT 6
+#define RIAK_ACT_TIMEOUT 7
+#define RIAK_ACT_LIMIT 8
+
+/* Lanes for riak_lane_set(). */
+#define RIAK_LANE_AUTO -1
+#define RIAK_LANE_INTERACTIVE 0
+#define RIAK_LANE_BULK 1
+
+/* Transports for riak_client_init_transport(). */
+#define RIAK_TRANSPORT_SOCKET 0
+#define RIAK_TRANSPORT_URING 1
+
+/* Buckets in a server's latency histogram: two per power of two us. */
+#define RIAK_LB_BUCKETS 48
+
+/** \brief Growable byte buffer used for socket I/O.
+ *
+ * Valid data lives between \c head and \c tail.  The memory is kept
+ * between requests so steady state traffic does not allocate.
+ */
+struct _RiakBuf {
+  uint8_t *data;  ///< Buffer memory.
+  size_t size;    ///< Number of bytes allocated for data.
+  size_t head;    ///< Offset of the first unconsumed byte.
+  size_t tail;    ///< Offset one past the last valid byte.
+  int fixed;      ///< Set if data is a registered io_uring buffer.
+  struct _RiakHold *hold;  ///< Set while responses view the data.
+};
+
+/** \brief A connection to a Riak server.
+ *
+ * Requests are framed in \c wbuf (a 5 byte header followed by the
+ * protobuf) and sent with a single write.  Responses are read ahead
+ * into \c rbuf and parsed from there a frame at a time.
+ *
+ * Connections are slots in their server's pool and are checked out
+ * for the length of a request, by a session or by the asynchronous
+ * engine.
+ */
+struct _RiakConn {
+  int sd;                ///< Socket descriptor; -1 if not connected.
+  int server;            ///< Index of the server.
+  struct _RiakBuf wbuf;  ///< Send buffer.
+  struct _RiakBuf rbuf;  ///< Receive buffer.
+  int connecting;        ///< Set while a non-blocking connect is pending.
+  int state;             ///< Pool state, RIAK_CONN_*.
+  int async;             ///< Set while used by the asynchronous engine.
+  uint64_t created;      ///< When the connection was opened (ms).
+  uint64_t used;         ///< When the connection was last checked in (ms).
+  uint64_t pinged;       ///< When a keep-warm ping was last answered (ms).
+  uint32_t events;       ///< Events registered with epoll.
+  struct _RiakOp *ops;   ///< Asynchronous requests awaiting responses.
+  struct _RiakOp *ops_tail;  ///< Last request in \c ops.
+  int n_ops;             ///< Number of requests in \c ops.
+  int n_streams;         ///< Number of streaming requests in \c ops.
+  int n_bulk;            ///< Number of bulk lane requests in \c ops.
+  uint64_t deadline;     ///< When the request in hand times out (ms).
+  uint32_t idle_next;    ///< Slot below this one on the idle stack + 1.
+  struct _RiakConn *link;    ///< Next connection in a private list.
+};
 
 /** \brief Data for a Riak server connection.
  *
  * This is used in the RiakClient and RiakResponse types to track
- * connections to Riak servers.
+ * connections to Riak servers.  Each server has a pool of between
+ * \c pool_min and \c pool_max connections (see riak_pool_config()).
  */
 struct _RiakServer {
   char *host,  ///< Host name the server this client is connected to.
        *port;  ///< Port of the server this client is connected to.
-  int sd;      ///< Socket descriptor of the connection.
-  int inuse;   ///< Set to one if it is being used by a streaming API.
+  struct _RiakConn *conns;  ///< Connection slots.
+  int n_slots;              ///< Number of slots in \c conns.
+  uint64_t idle;            ///< Idle stack: change count << 32 | slot + 1.
+  int n_conns;              ///< Number of open connections.
+  int n_idle;               ///< Number of idle connections.
+  struct _RiakLookup *dns;  ///< Cached addresses; or NULL.
+  struct _RiakLookup *dns_refresh;  ///< Lookup replacing \c dns; or NULL.
+  uint64_t dns_time;        ///< When \c dns was looked up (ms).
+  char dns_lock;            ///< Guards the \c dns fields.
+  uint64_t lat_us;          ///< Moving average of response latency (us).
+  uint64_t lat_time;        ///< When \c lat_us was last updated (ms).
+  uint32_t lat_hist[RIAK_LB_BUCKETS];  ///< Recent latencies, log scale.
+  uint32_t lat_n;           ///< Number of latencies counted.
+  int in_flight;            ///< Number of requests awaiting a response.
+  int fails;                ///< Failures in a row.
+  int ejected;              ///< Set while the circuit breaker is open.
+  uint32_t n_ejects;        ///< Times the circuit breaker has opened.
+  uint64_t probe_time;      ///< When to next probe if ejected (ms).
+  struct _RiakProbe *probe; ///< Health check in progress; or NULL.
+  int backoff_ms;           ///< Current reconnect delay (ms); or 0.
+  uint64_t retry_time;      ///< No connects before this time (ms).
+  uint64_t rate_tat;        ///< Rate limit state, see limit.c.
+  int n_bulk;               ///< Connections held by bulk requests.
+  uint32_t adapt_limit;     ///< Adaptive in flight limit (1/256ths); or 0.
+  uint64_t adapt_lat_us;    ///< Long run average latency (us).
 };
 
 typedef struct _RiakClient RiakClient;
 typedef struct _RiakSession RiakSession;
 typedef struct _RiakResponse RiakResponse;
 
+/** \brief Completion callback for asynchronous requests.
+ *
+ * Called once for each response frame; streaming requests get a call
+ * per frame.  \c rv is NULL if the request failed, otherwise the
+ * callback owns it and must release it with riak_response_free().
+ */
+typedef void (*RiakCallback)(RiakClient *rc, RiakResponse *rv, void *data);
+
+typedef struct _RiakShards RiakShards;
+
+/** \brief Task run on a shard by riak_shards_post().
+ *
+ * \c rc is the shard's own client.
+ */
+typedef void (*RiakTask)(RiakClient *rc, void *data);
+
 /** \brief Keeps state of the Riak client.
  *
  * This structure is used to track connections to Riak servers,
  * how they're used and any errors.
  *
- * Errors are reported via the "last_*" members.
+ * Errors are reported via the "last_*" members, or per thread by
+ * riak_last_error() once riak_client_threadsafe() has been called.
  */
 struct _RiakClient {
   struct _RiakServer *servers;    ///< List of riak servers.
@@ -88,28 +192,85 @@ struct _RiakClient {
   int last_errno;            ///< Last errno value.
   int last_erract;           ///< Last error action.
   ssize_t last_errbytes;     ///< Last value of "bytes" before error.
+  int pool_min;              ///< Connections kept open per server.
+  int pool_max;              ///< Connection limit per server.
+  int pool_idle_ms;          ///< Idle time before surplus connections close.
+  int pool_life_ms;          ///< Age at which connections are replaced.
+  int pool_lazy;             ///< Set to connect only on first use.
+  int dns_ttl_ms;            ///< How long looked up addresses are kept.
+  int breaker_fails;         ///< Failures in a row that eject a server.
+  int breaker_ms;            ///< Time between probes of ejected servers.
+  int retries;               ///< Retries allowed per request.
+  int backoff_ms;            ///< Longest wait between reconnects.
+  int _retry_tokens;         ///< Retry budget, see RIAK_RETRY_COST.
+  int hedge_pct;             ///< Latency percentile to hedge gets at.
+  int timeout_ms;            ///< Default request timeout; 0 for none.
+  int keepalive_ms;          ///< Idle time before a connection is pinged.
+  int limit_rate;            ///< Requests per second; 0 for no limit.
+  int limit_burst;           ///< Requests allowed at once above the rate.
+  int limit_in_flight;       ///< Requests in flight; 0 for no limit.
+  int limit_block;           ///< Set to wait for room under a limit.
+  int node_rate;             ///< Requests per second per server.
+  int node_burst;            ///< Per server burst above \c node_rate.
+  int node_in_flight;        ///< Requests in flight per server.
+  int lane_bulk;             ///< Connections per server for bulk requests.
+  int adapt_min;             ///< Least adaptive requests in flight per server.
+  int adapt_max;             ///< Most adaptive requests in flight; 0 for off.
+  uint64_t _limit_tat;       ///< Rate limit state, see limit.c.
+  int _in_flight;            ///< Admitted requests not yet answered.
+  struct _RiakKeepalive *_keepalive;  ///< Background pinger, if running.
+  int _threaded;             ///< Set by riak_client_threadsafe().
+  RiakSession *_sessions;    ///< Free list of recycled sessions.
+  size_t arena_size;         ///< Bytes per response arena; 0 for none.
+  int arena_keep;            ///< Most freed arenas kept for reuse.
+  struct _RiakArena *_arenas;  ///< Free list of response arenas.
+  int _n_arenas;             ///< Number of arenas in \c _arenas.
+  char _arena_lock;          ///< Guards \c _arenas.
+  size_t view_min;           ///< Smallest get response viewed; 0 for none.
+  struct _RiakAsync *_async; ///< Asynchronous request state.
+  struct _RiakUring *_uring; ///< io_uring transport state.
   RiakSession *(*_write)(RiakClient *,
       RiakResponse *,
       uint8_t,
-      uint32_t,
-      uint8_t *);            ///< Request function.
+      const ProtobufCMessage *);  ///< Request function.
   RiakResponse *(*_read)(RiakSession *);    ///< Response function.
 };
 
 struct _RiakSession {
   RiakClient *_rc;           ///< Associated RiakClient object.
-  int server;                ///< Server index if a server was used.
-                             ///  -1 if dynamic.
-  int sd;                    ///< Socket for this session.
+  struct _RiakConn *conn;    ///< Connection checked out by this session.
   int streaming;             ///< Only for MC_RpbIndexReq/Resp. Sigh.
+  uint64_t _start;           ///< When the request was sent (us); or 0.
+  uint8_t _mc;               ///< Request to retry on failure; or 0.
+  const ProtobufCMessage *_msg;  ///< Body of the request to retry.
+  int _tries;                ///< Number of times the request was retried.
+  uint64_t _deadline;        ///< When the request times out (ms); or 0.
+  int _admitted;             ///< Set while counted by _riak_admit().
+  int _lane;                 ///< RIAK_LANE_INTERACTIVE or RIAK_LANE_BULK.
+  int _bulk;                 ///< Set while counted in the server's n_bulk.
+  RiakSession *_next;        ///< Next session in the free list.
 };
 
+/** \brief Keys of a list keys or index response, end to end.
+ *
+ * Key \c i is the \c off[i+1] - \c off[i] bytes at \c data + \c off[i].
+ * Empty if the response could not be decoded this way; the keys are
+ * always in the response message as well.
+ */
+typedef struct {
+  size_t n;                  ///< Number of keys.
+  uint8_t *data;             ///< The keys.
+  size_t *off;               ///< n + 1 offsets into \c data.
+} RiakKeys;
+
 /** \brief Data for various responses.
  *
  * All responses from riak reqests are stored in this structure.
  */
 struct _RiakResponse {
   RiakSession *_rs;          ///< Associated RiakSession object.
+  struct _RiakArena *_arena; ///< Arena holding the response; or NULL.
+  struct _RiakHold *_hold;   ///< Buffer a view points into; or NULL.
   union {
     struct {
       char *msg;
@@ -129,6 +290,7 @@ struct _RiakResponse {
     } bl;                    ///< Bucket list response.
     struct {
       RpbListKeysResp *resp;
+      RiakKeys keys;
     } kl;                    ///< Key list response.
     struct {
       RpbGetBucketResp *resp;
@@ -144,6 +306,7 @@ struct _RiakResponse {
     } mr;                    ///< Map reduce response.
     struct {
       RpbIndexResp *resp;
+      RiakKeys keys;
     } i;                     ///< Secondary index response.
     struct {
       RpbSearchQueryResp *resp;
@@ -156,13 +319,41 @@ struct _RiakResponse {
 /* Riak API functions. */
 
 /* API Group: Communications. */
+extern ProtobufCAllocator riak_slab_allocator;
 extern RiakClient *riak_client_init(ProtobufCAllocator *allocator,
     int max_servers);
+extern RiakClient *riak_client_init_transport(ProtobufCAllocator *allocator,
+    int max_servers, int transport);
+extern int riak_client_threadsafe(RiakClient *rc);
+extern void riak_last_error(RiakClient *rc, int *err, int *act,
+    ssize_t *bytes);
 extern int riak_server_add(RiakClient *rc, char *host, char *port);
 extern int riak_server_del(RiakClient *rc, char *host, char *port);
 extern int riak_servers_known(RiakClient *rc);
 extern int riak_servers_active(RiakClient *rc);
 extern void riak_servers_disconnect(RiakClient *rc);
+extern void riak_pool_config(RiakClient *rc, int min_conns, int max_conns,
+    int idle_ms, int life_ms);
+extern int riak_pool_maintain(RiakClient *rc);
+extern void riak_pool_lazy(RiakClient *rc, int lazy);
+extern int riak_servers_warmup(RiakClient *rc, int timeout_ms);
+extern void riak_dns_config(RiakClient *rc, int ttl_ms);
+extern void riak_breaker_config(RiakClient *rc, int fails, int retry_ms);
+extern void riak_retry_config(RiakClient *rc, int retries, int backoff_ms);
+extern void riak_hedge_config(RiakClient *rc, int percentile);
+extern void riak_timeout_config(RiakClient *rc, int timeout_ms);
+extern int riak_keepalive_config(RiakClient *rc, int interval_ms,
+    int background);
+extern void riak_limit_config(RiakClient *rc, int rate, int burst,
+    int max_in_flight, int block);
+extern void riak_node_limit_config(RiakClient *rc, int rate, int burst,
+    int max_in_flight);
+extern void riak_node_adapt_config(RiakClient *rc, int min_in_flight,
+    int max_in_flight);
+extern void riak_arena_config(RiakClient *rc, size_t size, int keep);
+extern void riak_view_config(RiakClient *rc, size_t min_bytes);
+extern int riak_lane_set(int lane);
+extern void riak_lane_config(RiakClient *rc, int bulk_conns);
 
 /* All functions below use a RiakResponse type. It holds a response from
  * riak API call. */
@@ -193,6 +384,44 @@ extern RiakResponse *riak_secondary_indexes(RiakClient *rc,
     RiakResponse *rv, RpbIndexReq *req);
 extern RiakResponse *riak_search(RiakClient *rc, RpbSearchQueryReq *req);
 
+/* API Group: Asynchronous Operations. */
+extern int riak_async_init(RiakClient *rc, int max_conns);
+extern int riak_async_pipeline(RiakClient *rc, int depth);
+extern int riak_async_submit(RiakClient *rc, uint8_t mc,
+    const ProtobufCMessage *msg, RiakCallback cb, void *data);
+extern int riak_async_run(RiakClient *rc, int timeout_ms);
+extern int riak_async_pending(RiakClient *rc);
+extern int riak_async_fds(RiakClient *rc, struct pollfd *fds, int max_fds);
+extern int riak_async_process(RiakClient *rc, int fd, int revents);
+extern int riak_async_timeout(RiakClient *rc);
+extern int riak_async_ping(RiakClient *rc, RiakCallback cb, void *data);
+extern int riak_async_list_keys(RiakClient *rc, unsigned char *bucket,
+    RiakCallback cb, void *data);
+extern int riak_async_fetch_object_full(RiakClient *rc,
+    unsigned char *bucket, ProtobufCBinaryData *key, RpbGetReq *req,
+    RiakCallback cb, void *data);
+extern int riak_async_store_object_full(RiakClient *rc, RpbPutReq *req,
+    RiakCallback cb, void *data);
+extern int riak_async_delete_object_full(RiakClient *rc, RpbDelReq *req,
+    RiakCallback cb, void *data);
+
+/* API Group: Sharded Runtime. */
+extern RiakShards *riak_shards_init(RiakClient *rc, int n_shards);
+extern int riak_shards_count(RiakShards *rs);
+extern int riak_shard_current(RiakShards *rs);
+extern int riak_shards_post(RiakShards *rs, int shard, RiakTask fn,
+    void *data);
+extern void riak_shards_free(RiakShards *rs);
+
+/* API Group: Pipelined Bulk Operations. */
+extern int riak_fetch_objects(RiakClient *rc, unsigned char *bucket,
+    ProtobufCBinaryData *keys, size_t n_keys, RpbGetReq *req,
+    RiakResponse **rvs);
+extern int riak_store_objects(RiakClient *rc, RpbPutReq **reqs,
+    size_t n_reqs, RiakResponse **rvs);
+extern int riak_delete_objects(RiakClient *rc, RpbDelReq **reqs,
+    size_t n_reqs, RiakResponse **rvs);
+
 /* API Group: Server Operations */
 extern RiakResponse *riak_ping(RiakClient *rc);
 extern RiakResponse *riak_get_client_id(RiakClient *rc);
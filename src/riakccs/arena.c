@@ -0,0 +1,275 @@
+/** \file
+ *
+ * \brief Response arenas.
+ *
+ * Unpacking a response makes an allocation for every message, string
+ * and byte field in it, and freeing it walks the whole tree again.
+ * After riak_arena_config() each response is unpacked into an arena
+ * instead: a block handed out by bumping an offset, with more blocks
+ * chained on if it fills.  riak_response_free() then gives the whole
+ * arena back at once, and freed arenas are kept on a free list for the
+ * next response.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** \brief A response arena, or a block chained onto one. */
+struct _RiakArena {
+  ProtobufCAllocator pbc;    ///< Allocates from this arena.
+  RiakClient *rc;            ///< Client the arena belongs to.
+  struct _RiakArena *next;   ///< Next arena on the free list.
+  struct _RiakArena *more;   ///< Last block chained on; or NULL.
+  size_t size;               ///< Bytes in \c data.
+  size_t used;               ///< Bytes of \c data handed out.
+  uint8_t data[] __attribute__((aligned(RIAK_ARENA_ALIGN)));
+};
+
+/** \brief Take the client's arena free list lock.
+ *
+ * \param rc RiakClient object.
+ */
+static void
+_arena_lock(RiakClient *rc)
+{
+  while (__atomic_test_and_set(&rc->_arena_lock, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+/** \brief Release the client's arena free list lock.
+ *
+ * \param rc RiakClient object.
+ */
+static void
+_arena_unlock(RiakClient *rc)
+{
+  __atomic_clear(&rc->_arena_lock, __ATOMIC_RELEASE);
+}
+
+/** \brief Allocate from an arena; the ProtobufCAllocator alloc hook.
+ *
+ * Chains on a block of at least the client's arena size when the
+ * current one is full.  Returns NULL if that fails.
+ *
+ * \param data The arena.
+ * \param size Bytes wanted.
+ */
+static void *
+_arena_alloc(void *data, size_t size)
+{
+  struct _RiakArena *arena = data, *block;
+  RiakClient *rc = arena->rc;
+  size_t n;
+  void *p;
+
+  size = (size + RIAK_ARENA_ALIGN - 1) & ~(size_t)(RIAK_ARENA_ALIGN - 1);
+  block = arena->more? arena->more: arena;
+  if (block->size - block->used < size) {
+    n = size > rc->arena_size? size: rc->arena_size;
+    block = rc->allocator->alloc(rc->allocator->allocator_data,
+        sizeof(*block) + n);
+    if (!block) {
+      return NULL;
+    }
+    block->size = n;
+    block->used = 0;
+    block->more = arena->more;
+    arena->more = block;
+  }
+  p = block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+/** \brief Free into an arena; the ProtobufCAllocator free hook.
+ *
+ * Does nothing: the memory goes back with the arena.
+ *
+ * \param data The arena.
+ * \param p Memory from _arena_alloc().
+ */
+static void
+_arena_free(void *data, void *p)
+{
+  (void)data;
+  (void)p;
+}
+
+/** \brief Get an empty arena from the free list or allocate one.
+ *
+ * Returns NULL if arenas are off or on failure.
+ *
+ * \param rc RiakClient object.
+ */
+static struct _RiakArena *
+_arena_get(RiakClient *rc)
+{
+  struct _RiakArena *arena;
+
+  if (rc->arena_size == 0) {
+    return NULL;
+  }
+  _arena_lock(rc);
+  arena = rc->_arenas;
+  if (arena) {
+    rc->_arenas = arena->next;
+    rc->_n_arenas--;
+  }
+  _arena_unlock(rc);
+  if (!arena) {
+    arena = rc->allocator->alloc(rc->allocator->allocator_data,
+        sizeof(*arena) + rc->arena_size);
+    if (!arena) {
+      return NULL;
+    }
+    arena->pbc.alloc = _arena_alloc;
+    arena->pbc.free = _arena_free;
+    arena->pbc.allocator_data = arena;
+    arena->rc = rc;
+    arena->size = rc->arena_size;
+  }
+  arena->used = 0;
+  arena->more = NULL;
+  arena->next = NULL;
+  return arena;
+}
+
+/** \brief Empty an arena and put it on the free list.
+ *
+ * Chained blocks are freed, as is the arena once the free list holds
+ * \c arena_keep, or if the arena size has changed since it was made.
+ *
+ * \param rc RiakClient object.
+ * \param arena The arena.
+ */
+static void
+_arena_put(RiakClient *rc, struct _RiakArena *arena)
+{
+  struct _RiakArena *block;
+
+  while (arena->more) {
+    block = arena->more;
+    arena->more = block->more;
+    rc->allocator->free(rc->allocator->allocator_data, block);
+  }
+  _arena_lock(rc);
+  if (arena->size == rc->arena_size && rc->_n_arenas < rc->arena_keep) {
+    arena->next = rc->_arenas;
+    rc->_arenas = arena;
+    rc->_n_arenas++;
+    arena = NULL;
+  }
+  _arena_unlock(rc);
+  if (arena) {
+    rc->allocator->free(rc->allocator->allocator_data, arena);
+  }
+}
+
+/** \brief Allocate a response, in an arena of its own if enabled.
+ *
+ * Returns NULL on failure.
+ *
+ * \param rc RiakClient object.
+ */
+RiakResponse *
+_riak_response_new(RiakClient *rc)
+{
+  struct _RiakArena *arena;
+  RiakResponse *rv;
+
+  arena = _arena_get(rc);
+  if (arena) {
+    rv = _arena_alloc(arena, sizeof(RiakResponse));
+  } else {
+    rv = rc->allocator->alloc(rc->allocator->allocator_data,
+        sizeof(RiakResponse));
+  }
+  if (!rv) {
+    if (arena) {
+      _arena_put(rc, arena);
+    }
+    return NULL;
+  }
+  rv->_arena = arena;
+  rv->_hold = NULL;
+  return rv;
+}
+
+/** \brief Returns the allocator to unpack a response's messages with.
+ *
+ * \param rc RiakClient object.
+ * \param rv The response.
+ */
+ProtobufCAllocator *
+_riak_response_allocator(RiakClient *rc, RiakResponse *rv)
+{
+  return rv->_arena? &rv->_arena->pbc: rc->allocator;
+}
+
+/** \brief Free a response allocated by _riak_response_new().
+ *
+ * Anything unpacked into the response's arena goes with it; anything
+ * else must already have been freed.
+ *
+ * \param rc RiakClient object.
+ * \param rv The response.
+ */
+void
+_riak_response_del(RiakClient *rc, RiakResponse *rv)
+{
+  if (rv->_arena) {
+    _arena_put(rc, rv->_arena);
+  } else {
+    rc->allocator->free(rc->allocator->allocator_data, rv);
+  }
+}
+
+/** \brief Free every arena on the client's free list.
+ *
+ * \param rc RiakClient object.
+ */
+void
+_riak_arena_free(RiakClient *rc)
+{
+  struct _RiakArena *arena;
+
+  while (rc->_arenas) {
+    arena = rc->_arenas;
+    rc->_arenas = arena->next;
+    rc->allocator->free(rc->allocator->allocator_data, arena);
+  }
+  rc->_n_arenas = 0;
+}
+
+/** \brief Unpack responses into arenas.
+ *
+ * Each response's messages are allocated from an arena of \c size
+ * bytes, with more blocks chained on for large responses, and all
+ * freed at once by riak_response_free().  Up to \c keep freed arenas
+ * are kept for reuse.  Responses already made are unaffected.
+ *
+ * \param rc Riak client object.
+ * \param size Bytes per arena; 0 to allocate each message separately.
+ * \param keep Freed arenas to keep for reuse.
+ */
+void
+riak_arena_config(RiakClient *rc, size_t size, int keep)
+{
+  struct _RiakArena *arena, *next;
+
+  _arena_lock(rc);
+  rc->arena_size = size;
+  rc->arena_keep = keep;
+  /* Arenas of the old size are no use now. */
+  arena = rc->_arenas;
+  rc->_arenas = NULL;
+  rc->_n_arenas = 0;
+  _arena_unlock(rc);
+  for (; arena; arena = next) {
+    next = arena->next;
+    rc->allocator->free(rc->allocator->allocator_data, arena);
+  }
+}
@@ -0,0 +1,1369 @@
+/** \file
+ *
+ * \brief Asynchronous requests.
+ *
+ * Requests are submitted with a completion callback and return
+ * straight away.  riak_async_run() drives an epoll loop over
+ * pooled connections and calls the callbacks as responses
+ * arrive, so one thread can keep many requests in flight across all
+ * the servers in \c rc->servers.
+ *
+ * Connections are checked out of the servers' pools as they are
+ * needed, up to \c max_conns per server, and checked back in once
+ * they have no requests in flight.  Requests that find every
+ * connection busy wait in a queue until one frees up.
+ *
+ * Riak answers the requests on a connection in order, so with a
+ * pipeline depth above one several requests are written to a
+ * connection back to back and their responses matched up first in,
+ * first out.  The bulk operations use this to cost about one round
+ * trip per batch rather than one per key.
+ *
+ * Applications with their own event loop can drive the engine instead
+ * of calling riak_async_run(): riak_async_fds() lists the sockets to
+ * watch, riak_async_process() handles their readiness and
+ * riak_async_timeout() says when to call it regardless.
+ */
+
+#include <assert.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif /* S_SPLINT_S */
+
+#include "riak_dt.pb-c.h"
+#include "riak_kv.pb-c.h"
+#include "riak.pb-c.h"
+#include "riak_search.pb-c.h"
+#include "riak_yokozuna.pb-c.h"
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+#include "riakccs/pb.h"
+
+/** Default connection limit per server. */
+#define RIAK_ASYNC_CONNS 4
+/** Number of epoll events handled per riak_async_run() pass. */
+#define RIAK_ASYNC_EVENTS 64
+
+/** \brief Get a request from the free list or allocate one.
+ *
+ * \param rc RiakClient object.
+ */
+static struct _RiakOp *
+_op_get(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakOp *op;
+
+  if (ra->free_ops) {
+    op = ra->free_ops;
+    ra->free_ops = op->next;
+  } else {
+    op = rc->allocator->alloc(rc->allocator->allocator_data,
+        sizeof(struct _RiakOp));
+    if (!op) {
+      return NULL;
+    }
+    memset(op, 0, sizeof(struct _RiakOp));
+  }
+  op->req.head = op->req.tail = 0;
+  op->next = NULL;
+  return op;
+}
+
+/** \brief Return a request to the free list.
+ *
+ * \param rc RiakClient object.
+ * \param op Request to recycle.
+ */
+static void
+_op_put(RiakClient *rc, struct _RiakOp *op)
+{
+  op->next = rc->_async->free_ops;
+  rc->_async->free_ops = op;
+}
+
+/** \brief Note the deadline of a request being queued or sent.
+ *
+ * \param ra Asynchronous engine.
+ * \param deadline The request's deadline (ms); or 0 for none.
+ */
+static void
+_async_due(struct _RiakAsync *ra, uint64_t deadline)
+{
+  if (deadline && (!ra->due || deadline < ra->due)) {
+    ra->due = deadline;
+  }
+}
+
+/** \brief Update the epoll events a connection is registered for.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection to update.
+ */
+static void
+_conn_want(RiakClient *rc, struct _RiakConn *conn)
+{
+  struct epoll_event ev;
+  uint32_t events = EPOLLIN;
+
+  if (conn->connecting || conn->wbuf.tail > conn->wbuf.head) {
+    events |= EPOLLOUT;
+  }
+  if (events != conn->events) {
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    (void)epoll_ctl(rc->_async->epfd, EPOLL_CTL_MOD, conn->sd, &ev);
+    conn->events = events;
+  }
+}
+
+/** \brief Take a pooled connection into use.
+ *
+ * The connection is registered with epoll until it is released.
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection checked out of a pool.
+ */
+static int
+_conn_adopt(RiakClient *rc, struct _RiakConn *conn)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct epoll_event ev;
+
+  /* A new socket becomes writable once the connect completes. */
+  conn->events = EPOLLIN;
+  if (conn->connecting) {
+    conn->events |= EPOLLOUT;
+  }
+  memset(&ev, 0, sizeof(ev));
+  ev.events = conn->events;
+  ev.data.ptr = conn;
+  if (epoll_ctl(ra->epfd, EPOLL_CTL_ADD, conn->sd, &ev) < 0) {
+    close(conn->sd);
+    conn->sd = -1;
+    _riak_pool_put(rc, conn);
+    return -1;
+  }
+  conn->async = 1;
+  ra->n_conns[conn->server]++;
+  return 0;
+}
+
+/** \brief Return an idle connection to its pool.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection with no requests in flight.
+ */
+static void
+_conn_release(RiakClient *rc, struct _RiakConn *conn)
+{
+  struct _RiakAsync *ra = rc->_async;
+
+  (void)epoll_ctl(ra->epfd, EPOLL_CTL_DEL, conn->sd, NULL);
+  conn->events = 0;
+  conn->async = 0;
+  ra->n_conns[conn->server]--;
+  _riak_pool_put(rc, conn);
+}
+
+/** \brief Find a connection that can take another request.
+ *
+ * Servers are tried starting from the least loaded.  An idle pooled
+ * connection is preferred, then the least loaded connection with room
+ * in its pipeline.  A new connection is opened if neither is found and
+ * the server is under its limits.  Nothing is pipelined behind a
+ * streaming request, and the lanes are not mixed on a connection.
+ * Returns NULL if no connection is available.
+ *
+ * \param rc RiakClient object.
+ * \param streaming Set if the request gets a streaming response.
+ * \param lane The request's lane.
+ */
+static struct _RiakConn *
+_conn_find(RiakClient *rc, int streaming, int lane)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakServer *srv;
+  struct _RiakConn *conn, *best;
+  int i, j, start, server, room, mix;
+
+  start = _riak_lb_pick(rc);
+  for (i = 0; i < rc->n_servers; i++) {
+    server = (start + i) % rc->n_servers;
+    srv = &rc->servers[server];
+    if (!srv->host || !_riak_server_up(rc, server)
+        || _riak_node_full(rc, server)) {
+      /* A full server frees up as its requests complete. */
+      continue;
+    }
+    /* A bulk request needs room in its lane for a connection. */
+    room = ra->n_conns[server] < ra->max_conns
+      && (lane != RIAK_LANE_BULK || _riak_lane_admit(rc, server) == 0);
+    conn = room? _riak_pool_get(rc, server, 0, 0): NULL;
+    if (!conn) {
+      best = NULL;
+      for (j = 0; j < srv->n_slots; j++) {
+        conn = &srv->conns[j];
+        mix = lane == RIAK_LANE_BULK
+          ? conn->n_bulk > 0 && conn->n_bulk == conn->n_ops
+          : conn->n_bulk == 0;
+        if (conn->async && !streaming && conn->n_streams == 0 && mix
+            && conn->n_ops < ra->depth
+            && (!best || conn->n_ops < best->n_ops)) {
+          best = conn;
+        }
+      }
+      conn = best;
+    }
+    if (!conn && room) {
+      conn = _riak_pool_get(rc, server, 2, 0);
+    }
+    if (conn && !conn->async && _conn_adopt(rc, conn) < 0) {
+      conn = NULL;
+    }
+    if (conn) {
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+/** \brief Add a request to the list of those awaiting a response.
+ *
+ * The request must already be framed in the connection's send buffer.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection the request was framed on.
+ * \param op The request.
+ */
+static void
+_conn_push(RiakClient *rc, struct _RiakConn *conn, struct _RiakOp *op)
+{
+  op->next = NULL;
+  op->start = _riak_lb_start(rc, conn->server);
+  if (conn->ops_tail) {
+    conn->ops_tail->next = op;
+  } else {
+    conn->ops = op;
+  }
+  conn->ops_tail = op;
+  conn->n_ops++;
+  if (op->streaming) {
+    conn->n_streams++;
+  }
+  if (op->lane == RIAK_LANE_BULK && conn->n_bulk++ == 0) {
+    (void)__atomic_add_fetch(&rc->servers[conn->server].n_bulk, 1,
+        __ATOMIC_RELAXED);
+  }
+  _async_due(rc->_async, op->deadline);
+  _conn_want(rc, conn);
+}
+
+/** \brief Fail a connection and every request on it.
+ *
+ * The connection is closed and left on the dead list to be checked
+ * back in once the current batch of events has been handled, so its
+ * slot is not reused while events for it may still be pending.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection that failed.
+ * \param err errno value to report.
+ * \param act Error action to report.
+ */
+static int
+_conn_fail(RiakClient *rc, struct _RiakConn *conn, int err, int act)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakOp *op, *ops;
+  RiakCallback cb;
+  void *data;
+  int done = 0;
+
+  if (conn->connecting) {
+    _riak_backoff(rc, conn->server);
+  }
+  close(conn->sd);
+  conn->sd = -1;
+  conn->async = 0;
+  ra->n_conns[conn->server]--;
+  _riak_breaker_fail(rc, conn->server);
+  conn->link = ra->dead;
+  ra->dead = conn;
+
+  ops = conn->ops;
+  ra->n_pending -= conn->n_ops;
+  if (conn->n_bulk > 0) {
+    (void)__atomic_sub_fetch(&rc->servers[conn->server].n_bulk, 1,
+        __ATOMIC_RELAXED);
+  }
+  conn->ops = conn->ops_tail = NULL;
+  conn->n_ops = conn->n_streams = conn->n_bulk = 0;
+  while (ops) {
+    op = ops;
+    ops = op->next;
+    cb = op->cb;
+    data = op->data;
+    if (op->start) {
+      _riak_lb_done(rc, conn->server, op->start, 0);
+    }
+    _op_put(rc, op);
+    _riak_error(rc, err, act, 0);
+    cb(rc, NULL, data);
+    done++;
+  }
+  return done;
+}
+
+/** \brief Write as much of a connection's send buffer as possible.
+ *
+ * Returns 0 on success (including a partial write), -1 on failure.
+ *
+ * \param conn Connection to write.
+ */
+static int
+_conn_send(struct _RiakConn *conn)
+{
+  ssize_t bytes;
+
+  while (conn->wbuf.head < conn->wbuf.tail) {
+    bytes = send(conn->sd, conn->wbuf.data + conn->wbuf.head,
+        conn->wbuf.tail - conn->wbuf.head, MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    } else if (bytes <= 0) {
+      return -1;
+    }
+    conn->wbuf.head += bytes;
+  }
+  conn->wbuf.head = conn->wbuf.tail = 0;
+  return 0;
+}
+
+/** \brief Read what a connection has and complete buffered frames.
+ *
+ * Returns the number of callbacks made.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection to read.
+ */
+static int
+_conn_recv(RiakClient *rc, struct _RiakConn *conn)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakBuf *rbuf = &conn->rbuf;
+  struct _RiakOp *op;
+  RiakResponse *rv;
+  RiakCallback cb;
+  void *data;
+  ssize_t bytes;
+  uint32_t hdr_len;
+  size_t len;
+  int eof = 0, done = 0;
+
+  /* Read what the socket has.  epoll is level triggered so anything
+   * left over is picked up on the next pass. */
+  if (rbuf->size - rbuf->tail < RIAK_RBUF_MIN / 2
+      && _riak_buf_reserve(rc, rbuf,
+        rbuf->tail - rbuf->head + RIAK_RBUF_MIN) < 0) {
+    return _conn_fail(rc, conn, ENOMEM, RIAK_ACT_READ_PB);
+  }
+  bytes = recv(conn->sd, rbuf->data + rbuf->tail, rbuf->size - rbuf->tail,
+      MSG_DONTWAIT);
+  if (bytes > 0) {
+    rbuf->tail += bytes;
+  } else if (bytes == 0
+      || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    eof = 1;
+  }
+
+  /* Complete every whole frame that is buffered. */
+  while (rbuf->tail - rbuf->head >= 5) {
+    memcpy(&hdr_len, rbuf->data + rbuf->head, 4);
+    len = ntohl(hdr_len);
+    if (len == 0 || !conn->ops) {
+      return done + _conn_fail(rc, conn, EPROTO, RIAK_ACT_READ_PROC_HDR);
+    }
+    len -= 1;
+    if (rbuf->tail - rbuf->head < 5 + len) {
+      break;
+    }
+
+    op = conn->ops;
+    rv = _riak_response_new(rc);
+    if (!rv) {
+      return done + _conn_fail(rc, conn, ENOMEM, RIAK_ACT_READ_PB);
+    }
+    rv->_rs = NULL;
+    rv->success = 1;
+    rv->mc = rbuf->data[rbuf->head + 4];
+    cb = op->cb;
+    data = op->data;
+    if (op->start) {
+      /* Time to the first frame is the server's latency. */
+      _riak_lb_done(rc, conn->server, op->start,
+          op->lane == RIAK_LANE_BULK? 2: 1);
+      op->start = 0;
+    }
+    if (_riak_decode(rc, rv, op->streaming, rbuf, len)) {
+      /* Last frame for this request. */
+      conn->ops = op->next;
+      if (!conn->ops) {
+        conn->ops_tail = NULL;
+      }
+      conn->n_ops--;
+      if (op->streaming) {
+        conn->n_streams--;
+      }
+      if (op->lane == RIAK_LANE_BULK && --conn->n_bulk == 0) {
+        (void)__atomic_sub_fetch(&rc->servers[conn->server].n_bulk, 1,
+            __ATOMIC_RELAXED);
+      }
+      ra->n_pending--;
+      _op_put(rc, op);
+    }
+    rbuf->head += 5 + len;
+    if (rbuf->head == rbuf->tail) {
+      _riak_buf_empty(rbuf);
+    }
+    cb(rc, rv, data);
+    done++;
+  }
+
+  if (eof) {
+    done += _conn_fail(rc, conn, bytes < 0? errno: 0, RIAK_ACT_READ_HDR);
+  }
+  return done;
+}
+
+/** \brief Handle epoll events for a connection.
+ *
+ * Returns the number of callbacks made.
+ *
+ * \param rc RiakClient object.
+ * \param conn The connection.
+ * \param events Events reported by epoll.
+ */
+static int
+_conn_event(RiakClient *rc, struct _RiakConn *conn, uint32_t events)
+{
+  int err, done = 0;
+
+  if (conn->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    if ((err = _riak_conn_connected(conn)) != 0) {
+      return _conn_fail(rc, conn, err, RIAK_ACT_WRITE);
+    }
+  }
+  if (!conn->connecting && (events & EPOLLOUT)) {
+    if (_conn_send(conn) < 0) {
+      return _conn_fail(rc, conn, errno, RIAK_ACT_WRITE);
+    }
+  }
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    done = _conn_recv(rc, conn);
+    if (conn->sd < 0) {
+      return done;
+    }
+  }
+  if (conn->n_ops == 0 && conn->wbuf.head == conn->wbuf.tail) {
+    _conn_release(rc, conn);
+  } else {
+    _conn_want(rc, conn);
+  }
+  return done;
+}
+
+/** \brief Add a request to the queue of those waiting for a connection.
+ *
+ * Interactive requests go ahead of bulk ones, and within a lane those
+ * due to time out soonest go first.  Requests are otherwise sent in
+ * the order they were made.
+ *
+ * \param ra Asynchronous engine.
+ * \param op The request.
+ */
+static void
+_queue_add(struct _RiakAsync *ra, struct _RiakOp *op)
+{
+  struct _RiakOp **p = &ra->queue;
+
+  while (*p && ((*p)->lane < op->lane || ((*p)->lane == op->lane
+          && (*p)->deadline && (!op->deadline
+            || (*p)->deadline <= op->deadline)))) {
+    p = &(*p)->next;
+  }
+  op->next = *p;
+  *p = op;
+  if (!op->next) {
+    ra->queue_tail = op;
+  }
+  _async_due(ra, op->deadline);
+}
+
+/** \brief Move queued requests onto connections that can take them.
+ *
+ * If no connection can be had to any server the queued requests fail.
+ * Returns the number of callbacks made.
+ *
+ * \param rc RiakClient object.
+ */
+static int
+_async_dispatch(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakConn *conn;
+  struct _RiakOp *op;
+  size_t len;
+  int i, done = 0;
+
+  while (ra->queue) {
+    conn = _conn_find(rc, ra->queue->streaming, ra->queue->lane);
+    if (!conn) {
+      break;
+    }
+    op = ra->queue;
+    len = op->req.tail - op->req.head;
+    if (_riak_buf_reserve(rc, &conn->wbuf,
+          conn->wbuf.tail - conn->wbuf.head + len) < 0) {
+      break;
+    }
+    memcpy(conn->wbuf.data + conn->wbuf.tail, op->req.data + op->req.head,
+        len);
+    conn->wbuf.tail += len;
+    ra->queue = op->next;
+    if (!ra->queue) {
+      ra->queue_tail = NULL;
+    }
+    _conn_push(rc, conn, op);
+  }
+
+  for (i = 0; ra->queue && i < rc->n_servers; i++) {
+    if (ra->n_conns[i] > 0) {
+      break;
+    }
+  }
+  if (ra->queue && i == rc->n_servers) {
+    /* Nothing is connected and nothing can be. */
+    while (ra->queue) {
+      op = ra->queue;
+      ra->queue = op->next;
+      ra->n_pending--;
+      _riak_error(rc, ECONNREFUSED, RIAK_ACT_WRITE, 0);
+      op->cb(rc, NULL, op->data);
+      _op_put(rc, op);
+      done++;
+    }
+    ra->queue_tail = NULL;
+  }
+  return done;
+}
+
+/** \brief Fail the requests that have run out of time.
+ *
+ * A queued request past its deadline fails on its own.  One that has
+ * been sent fails its connection, and with it any requests pipelined
+ * behind it; that also bounds a connect that never completes.  Either
+ * way the error is ETIMEDOUT with RIAK_ACT_TIMEOUT.  Only looks once
+ * \c ra->due has passed.  Returns the number of callbacks made.
+ *
+ * \param rc RiakClient object.
+ */
+static int
+_async_expire(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakConn *conn;
+  struct _RiakOp *op, **p, *late = NULL, **late_tail = &late;
+  uint64_t now;
+  int i, j, expired, done = 0;
+
+  if (!ra->due || (now = _riak_now_ms()) < ra->due) {
+    return 0;
+  }
+  /* Worked out again from the requests left, and any the callbacks
+   * make. */
+  ra->due = 0;
+  for (p = &ra->queue, ra->queue_tail = NULL; *p; ) {
+    op = *p;
+    if (op->deadline && op->deadline <= now) {
+      /* Called back below, as the callbacks may queue more. */
+      *p = op->next;
+      op->next = NULL;
+      *late_tail = op;
+      late_tail = &op->next;
+      ra->n_pending--;
+    } else {
+      _async_due(ra, op->deadline);
+      ra->queue_tail = op;
+      p = &op->next;
+    }
+  }
+  for (i = 0; i < rc->n_servers; i++) {
+    for (j = 0; j < rc->servers[i].n_slots; j++) {
+      conn = &rc->servers[i].conns[j];
+      expired = 0;
+      for (op = conn->async? conn->ops: NULL; op; op = op->next) {
+        expired |= op->deadline && op->deadline <= now;
+      }
+      if (expired) {
+        done += _conn_fail(rc, conn, ETIMEDOUT, RIAK_ACT_TIMEOUT);
+        continue;
+      }
+      for (op = conn->async? conn->ops: NULL; op; op = op->next) {
+        _async_due(ra, op->deadline);
+      }
+    }
+  }
+  while (late) {
+    op = late;
+    late = op->next;
+    _riak_error(rc, ETIMEDOUT, RIAK_ACT_TIMEOUT, 0);
+    op->cb(rc, NULL, op->data);
+    _op_put(rc, op);
+    done++;
+  }
+  return done;
+}
+
+/** \brief Returns milliseconds until a request may time out.
+ *
+ * 0 if one may have already, -1 if none has a deadline.
+ *
+ * \param rc RiakClient object.
+ */
+int
+_riak_async_due(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  uint64_t now;
+
+  if (!ra || !ra->due || ra->n_pending == 0) {
+    return -1;
+  }
+  now = _riak_now_ms();
+  return ra->due > now? (int)(ra->due - now): 0;
+}
+
+/** \brief Check in connections that failed during event handling.
+ *
+ * \param rc RiakClient object.
+ */
+static void
+_async_reap(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakConn *conn;
+
+  while (ra->dead) {
+    conn = ra->dead;
+    ra->dead = conn->link;
+    _riak_pool_put(rc, conn);
+  }
+}
+
+/** \brief Set up the client for asynchronous requests.
+ *
+ * Called implicitly by the first asynchronous request.  Calling it
+ * again changes the connection limit.  Returns 0 on success, -1 on
+ * failure.
+ *
+ * \param rc Riak client object.
+ * \param max_conns Maximum number of pooled connections to use at once
+ *                  per server; the pool's own limit also applies.
+ */
+int
+riak_async_init(RiakClient *rc, int max_conns)
+{
+  struct _RiakAsync *ra;
+
+  assert(max_conns > 0);
+
+  if (rc->_async) {
+    rc->_async->max_conns = max_conns;
+    return 0;
+  }
+  ra = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(struct _RiakAsync));
+  if (!ra) {
+    _riak_error(rc, ENOMEM, RIAK_ACT_WRITE, 0);
+    return -1;
+  }
+  memset(ra, 0, sizeof(struct _RiakAsync));
+  ra->n_conns = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(int) * rc->n_servers);
+  if (!ra->n_conns) {
+    rc->allocator->free(rc->allocator->allocator_data, ra);
+    _riak_error(rc, ENOMEM, RIAK_ACT_WRITE, 0);
+    return -1;
+  }
+  memset(ra->n_conns, 0, sizeof(int) * rc->n_servers);
+  ra->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (ra->epfd < 0) {
+    _riak_error(rc, errno, RIAK_ACT_WRITE, 0);
+    rc->allocator->free(rc->allocator->allocator_data, ra->n_conns);
+    rc->allocator->free(rc->allocator->allocator_data, ra);
+    return -1;
+  }
+  ra->max_conns = max_conns;
+  ra->depth = 1;
+  rc->_async = ra;
+  return 0;
+}
+
+/** \brief Set how many requests may be in flight on one connection.
+ *
+ * A depth of one (the default) sends a request only once the previous
+ * response on that connection has arrived.  Returns 0 on success, -1
+ * on failure.
+ *
+ * \param rc Riak client object.
+ * \param depth Maximum requests in flight per connection.
+ */
+int
+riak_async_pipeline(RiakClient *rc, int depth)
+{
+  assert(depth > 0);
+
+  if (!rc->_async && riak_async_init(rc, RIAK_ASYNC_CONNS) < 0) {
+    return -1;
+  }
+  rc->_async->depth = depth;
+  return 0;
+}
+
+/** \brief Release the asynchronous request state.
+ *
+ * Outstanding requests are dropped without calling their callbacks.
+ *
+ * \param rc RiakClient object.
+ */
+void
+_riak_async_free(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakConn *conn;
+  struct _RiakOp *op, *lists[2];
+  int i, j;
+
+  _async_reap(rc);
+  for (i = 0; i < rc->n_servers; i++) {
+    for (j = 0; j < rc->servers[i].n_slots; j++) {
+      conn = &rc->servers[i].conns[j];
+      if (!conn->async) {
+        continue;
+      }
+      for (op = conn->ops; op; op = conn->ops) {
+        conn->ops = op->next;
+        if (op->start) {
+          _riak_lb_done(rc, i, op->start, -1);
+        }
+        _op_put(rc, op);
+      }
+      if (conn->n_bulk > 0) {
+        (void)__atomic_sub_fetch(&rc->servers[i].n_bulk, 1,
+            __ATOMIC_RELAXED);
+      }
+      conn->ops_tail = NULL;
+      conn->n_ops = conn->n_streams = conn->n_bulk = 0;
+      close(conn->sd);
+      conn->sd = -1;
+      conn->async = 0;
+      _riak_pool_put(rc, conn);
+    }
+  }
+  lists[0] = ra->queue;
+  lists[1] = ra->free_ops;
+  for (i = 0; i < 2; i++) {
+    while (lists[i]) {
+      op = lists[i];
+      lists[i] = op->next;
+      _riak_buf_free(rc, &op->req);
+      rc->allocator->free(rc->allocator->allocator_data, op);
+    }
+  }
+  close(ra->epfd);
+  rc->allocator->free(rc->allocator->allocator_data, ra->n_conns);
+  rc->allocator->free(rc->allocator->allocator_data, ra);
+  rc->_async = NULL;
+}
+
+/** \brief Submit an asynchronous request.
+ *
+ * The request is framed straight away so \c msg need not outlive the
+ * call.  \c cb is called from riak_async_run() with each response
+ * frame, or with NULL if the request fails.  Returns 0 if the request
+ * was submitted, -1 on failure; see riak_limit_config() for when the
+ * client's limits refuse it.
+ *
+ * \param rc Riak client object.
+ * \param mc The message code to send.
+ * \param msg The protobuf to send; NULL if there is no body.
+ * \param cb Completion callback.
+ * \param data Passed to \c cb.
+ */
+int
+riak_async_submit(RiakClient *rc, uint8_t mc, const ProtobufCMessage *msg,
+    RiakCallback cb, void *data)
+{
+  struct _RiakAsync *ra;
+  struct _RiakConn *conn;
+  struct _RiakOp *op;
+  uint64_t wait;
+  uint32_t timeout;
+
+  if (!rc->_async && riak_async_init(rc, RIAK_ASYNC_CONNS) < 0) {
+    return -1;
+  }
+  ra = rc->_async;
+  if (rc->limit_in_flight > 0
+      && ra->n_pending + __atomic_load_n(&rc->_in_flight, __ATOMIC_RELAXED)
+      >= rc->limit_in_flight) {
+    /* Only riak_async_run() can make room, so never wait. */
+    _riak_error(rc, EAGAIN, RIAK_ACT_LIMIT, 0);
+    return -1;
+  }
+  while ((wait = _riak_limit_rate(rc)) != 0) {
+    if (_riak_limit_wait(rc, wait, 0) < 0) {
+      return -1;
+    }
+  }
+  op = _op_get(rc);
+  if (!op) {
+    _riak_error(rc, ENOMEM, RIAK_ACT_WRITE, 0);
+    return -1;
+  }
+  op->mc = mc;
+  op->streaming = (mc == MC_RpbIndexReq || mc == MC_RpbListKeysReq
+      || mc == MC_RpbMapRedReq);
+  op->cb = cb;
+  op->data = data;
+  op->lane = _riak_lane(mc);
+  timeout = _riak_req_timeout(rc, mc, msg);
+  op->deadline = timeout? _riak_now_ms() + timeout: 0;
+
+  /* Only go past the queue if nothing ahead is in the same lane. */
+  conn = (ra->queue && ra->queue->lane <= op->lane)? NULL
+    : _conn_find(rc, op->streaming, op->lane);
+  if (conn) {
+    if (!_riak_frame(rc, &conn->wbuf, mc, msg)) {
+      _op_put(rc, op);
+      _riak_error(rc, ENOMEM, RIAK_ACT_WRITE, 0);
+      return -1;
+    }
+    _conn_push(rc, conn, op);
+  } else {
+    /* Every connection is busy; hold the request until one frees. */
+    if (!_riak_frame(rc, &op->req, mc, msg)) {
+      _op_put(rc, op);
+      _riak_error(rc, ENOMEM, RIAK_ACT_WRITE, 0);
+      return -1;
+    }
+    _queue_add(ra, op);
+  }
+  ra->n_pending++;
+  return 0;
+}
+
+/** \brief Drive outstanding asynchronous requests.
+ *
+ * Waits up to \c timeout_ms milliseconds (-1 to wait indefinitely)
+ * for I/O and makes the callbacks for any responses that complete.
+ * The wait ends early when a request's deadline is due, and requests
+ * out of time fail.  Returns the number of callbacks made or -1 on
+ * error.  Callbacks may submit further requests but must not call
+ * riak_async_run().
+ *
+ * \param rc Riak client object.
+ * \param timeout_ms Maximum time to wait.
+ */
+int
+riak_async_run(RiakClient *rc, int timeout_ms)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct epoll_event events[RIAK_ASYNC_EVENTS];
+  struct _RiakConn *conn;
+  int i, n, done, due;
+
+  if (!ra || ra->n_pending == 0) {
+    return 0;
+  }
+  done = _async_expire(rc);
+  _async_reap(rc);
+  done += _async_dispatch(rc);
+  if (ra->n_pending == 0) {
+    return done;
+  }
+
+  due = _riak_async_due(rc);
+  if (due >= 0 && (timeout_ms < 0 || due < timeout_ms)) {
+    timeout_ms = due;
+  }
+  n = epoll_wait(ra->epfd, events, RIAK_ASYNC_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return done;
+    }
+    _riak_error(rc, errno, RIAK_ACT_READ_HDR, 0);
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    conn = events[i].data.ptr;
+    if (conn->sd >= 0) {
+      done += _conn_event(rc, conn, events[i].events);
+    }
+  }
+  done += _async_expire(rc);
+  _async_reap(rc);
+  done += _async_dispatch(rc);
+  return done;
+}
+
+/** \brief Returns the number of asynchronous requests not yet completed.
+ *
+ * \param rc Riak client object.
+ */
+int
+riak_async_pending(RiakClient *rc)
+{
+  return rc->_async? rc->_async->n_pending: 0;
+}
+
+/** \brief List the sockets the asynchronous engine is waiting on.
+ *
+ * Fills in up to \c max_fds entries of \c fds with a socket and the
+ * events (POLLIN, POLLOUT) to watch it for.  The set changes as
+ * requests are submitted and completed, so fetch it again after
+ * riak_async_submit() or riak_async_process().  Returns the number of
+ * sockets, which may be more than \c max_fds.
+ *
+ * \param rc Riak client object.
+ * \param fds Array to fill.
+ * \param max_fds Size of \c fds.
+ */
+int
+riak_async_fds(RiakClient *rc, struct pollfd *fds, int max_fds)
+{
+  struct _RiakServer *srv;
+  struct _RiakConn *conn;
+  int i, j, n = 0;
+
+  if (!rc->_async) {
+    return 0;
+  }
+  for (i = 0; i < rc->n_servers; i++) {
+    srv = &rc->servers[i];
+    for (j = 0; j < srv->n_slots; j++) {
+      conn = &srv->conns[j];
+      if (!conn->async || conn->sd < 0) {
+        continue;
+      }
+      if (n < max_fds) {
+        fds[n].fd = conn->sd;
+        fds[n].events = 0;
+        if (conn->events & EPOLLIN) {
+          fds[n].events |= POLLIN;
+        }
+        if (conn->events & EPOLLOUT) {
+          fds[n].events |= POLLOUT;
+        }
+        fds[n].revents = 0;
+      }
+      n++;
+    }
+  }
+  return n;
+}
+
+/** \brief Make progress after the application's event loop fires.
+ *
+ * Call with a socket from riak_async_fds() and the events (POLLIN,
+ * POLLOUT, POLLERR, POLLHUP) reported for it, or with a \c fd of -1
+ * when riak_async_timeout() expires.  Makes the callbacks for any
+ * responses that complete and returns their number.  Callbacks may
+ * submit further requests but must not call riak_async_process().
+ *
+ * \param rc Riak client object.
+ * \param fd Socket that is ready; -1 for none.
+ * \param revents Events reported for \c fd.
+ */
+int
+riak_async_process(RiakClient *rc, int fd, int revents)
+{
+  struct _RiakServer *srv;
+  struct _RiakConn *conn;
+  uint32_t events = 0;
+  int i, j, done = 0;
+
+  if (!rc->_async) {
+    return 0;
+  }
+  if (revents & POLLIN) {
+    events |= EPOLLIN;
+  }
+  if (revents & POLLOUT) {
+    events |= EPOLLOUT;
+  }
+  if (revents & POLLERR) {
+    events |= EPOLLERR;
+  }
+  if (revents & POLLHUP) {
+    events |= EPOLLHUP;
+  }
+  for (i = 0; fd >= 0 && i < rc->n_servers; i++) {
+    srv = &rc->servers[i];
+    for (j = 0; j < srv->n_slots; j++) {
+      conn = &srv->conns[j];
+      if (conn->async && conn->sd == fd) {
+        done += _conn_event(rc, conn, events);
+        i = rc->n_servers;
+        break;
+      }
+    }
+  }
+  done += _async_expire(rc);
+  _async_reap(rc);
+  if (fd < 0) {
+    _riak_pool_reap(rc);
+  }
+  return done + _async_dispatch(rc);
+}
+
+/** \brief Milliseconds until riak_async_process() should be called.
+ *
+ * Returns when, with no socket ready, the client next needs a call to
+ * riak_async_process() with a \c fd of -1: 0 for straight away, -1
+ * for never.  That is the earlier of when a request may time out and
+ * when the pool next needs tending.
+ *
+ * \param rc Riak client object.
+ */
+int
+riak_async_timeout(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  int i, due, pool;
+
+  if (ra && ra->queue) {
+    for (i = 0; i < rc->n_servers; i++) {
+      if (ra->n_conns[i] > 0) {
+        break;
+      }
+    }
+    if (i == rc->n_servers) {
+      /* Nothing will become ready to move the queue along. */
+      return 0;
+    }
+  }
+  due = _riak_async_due(rc);
+  pool = _riak_pool_timeout(rc);
+  return due >= 0 && (pool < 0 || due < pool)? due: pool;
+}
+
+/** \brief Send a ping request asynchronously.
+ *
+ * See riak_ping().
+ *
+ * \param rc Riak client object.
+ * \param cb Completion callback.
+ * \param data Passed to \c cb.
+ */
+int
+riak_async_ping(RiakClient *rc, RiakCallback cb, void *data)
+{
+  return riak_async_submit(rc, MC_RpbPingReq, NULL, cb, data);
+}
+
+/** \brief STREAMING: Retrieve a list of keys in a bucket asynchronously.
+ *
+ * \c cb is called once per MC_RpbListKeysResp frame.  See
+ * riak_list_keys().
+ *
+ * \param rc Riak client object.
+ * \param bucket Bucket to list keys from.
+ * \param cb Completion callback.
+ * \param data Passed to \c cb.
+ */
+int
+riak_async_list_keys(RiakClient *rc, unsigned char *bucket,
+    RiakCallback cb, void *data)
+{
+  RpbListKeysReq req = RPB_LIST_KEYS_REQ__INIT;
+
+  str2pbbd(&req.bucket, bucket);
+  return riak_async_submit(rc, MC_RpbListKeysReq, &req.base, cb, data);
+}
+
+/** \brief Retrieve object from a bucket/key asynchronously.
+ *
+ * See riak_fetch_object_full().
+ *
+ * \param rc Riak client object.
+ * \param bucket Bucket to look for key in.
+ * \param key Key to fetch.
+ * \param req A RpbGetReq protobuf.
+ * \param cb Completion callback.
+ * \param data Passed to \c cb.
+ */
+int
+riak_async_fetch_object_full(RiakClient *rc, unsigned char *bucket,
+    ProtobufCBinaryData *key, RpbGetReq *req, RiakCallback cb, void *data)
+{
+  str2pbbd(&req->bucket, bucket);
+  req->key.data = key->data;
+  req->key.len = key->len;
+  return riak_async_submit(rc, MC_RpbGetReq, &req->base, cb, data);
+}
+
+/** \brief Store an object in riak asynchronously.
+ *
+ * See riak_store_object_full().
+ *
+ * \param rc Riak client object.
+ * \param req Protocol buffer with the object to add.
+ * \param cb Completion callback.
+ * \param data Passed to \c cb.
+ */
+int
+riak_async_store_object_full(RiakClient *rc, RpbPutReq *req,
+    RiakCallback cb, void *data)
+{
+  return riak_async_submit(rc, MC_RpbPutReq, &req->base, cb, data);
+}
+
+/** \brief Delete object based on a bucket and a key asynchronously.
+ *
+ * See riak_delete_object_full().
+ *
+ * \param rc Riak client object.
+ * \param req A RpbDelReq detailing what bucket/key to be deleted.
+ * \param cb Completion callback.
+ * \param data Passed to \c cb.
+ */
+int
+riak_async_delete_object_full(RiakClient *rc, RpbDelReq *req,
+    RiakCallback cb, void *data)
+{
+  return riak_async_submit(rc, MC_RpbDelReq, &req->base, cb, data);
+}
+
+/** \brief Store a bulk operation's response in its slot.
+ *
+ * \param rc Riak client object.
+ * \param rv The response; NULL on failure.
+ * \param data Where to store the response.
+ */
+static void
+_batch_cb(RiakClient *rc, RiakResponse *rv, void *data)
+{
+  *(RiakResponse **)data = rv;
+  rc->_async->batch_left--;
+}
+
+/** \brief Discard the response of an abandoned bulk request.
+ *
+ * \param rc Riak client object.
+ * \param rv The response; NULL on failure.
+ * \param data Unused.
+ */
+static void
+_batch_drop(RiakClient *rc, RiakResponse *rv, void *data)
+{
+  (void)data;
+  if (rv) {
+    riak_response_free(rc, rv);
+  }
+}
+
+/** \brief Fail the outstanding requests of a bulk operation.
+ *
+ * Queued requests are dropped.  Those already sent cannot be taken
+ * back out of the pipeline, so their responses are discarded when
+ * they arrive.  Either way the slots are filled with NULL and no
+ * longer referred to.
+ *
+ * \param rc Riak client object.
+ */
+static void
+_batch_abort(RiakClient *rc)
+{
+  struct _RiakAsync *ra = rc->_async;
+  struct _RiakConn *conn;
+  struct _RiakOp *op, **p;
+  int i, j;
+
+  for (p = &ra->queue, ra->queue_tail = NULL; *p; ) {
+    op = *p;
+    if (op->cb != _batch_cb) {
+      ra->queue_tail = op;
+      p = &op->next;
+      continue;
+    }
+    *p = op->next;
+    ra->n_pending--;
+    _batch_cb(rc, NULL, op->data);
+    _op_put(rc, op);
+  }
+  for (i = 0; i < rc->n_servers; i++) {
+    for (j = 0; j < rc->servers[i].n_slots; j++) {
+      conn = &rc->servers[i].conns[j];
+      for (op = conn->async? conn->ops: NULL; op; op = op->next) {
+        if (op->cb == _batch_cb) {
+          _batch_cb(rc, NULL, op->data);
+          op->cb = _batch_drop;
+          op->data = NULL;
+        }
+      }
+    }
+  }
+  ra->batch_left = 0;
+}
+
+/** \brief Wait for the requests of a bulk operation.
+ *
+ * If the wait fails the requests still outstanding are failed too,
+ * so none outlives the call.  Returns the number of responses
+ * received.
+ *
+ * \param rc Riak client object.
+ * \param rvs Response slots.
+ * \param n Number of slots.
+ */
+static int
+_batch_wait(RiakClient *rc, RiakResponse **rvs, size_t n)
+{
+  size_t i;
+  int got = 0;
+
+  while (rc->_async->batch_left > 0) {
+    if (riak_async_run(rc, -1) < 0) {
+      _batch_abort(rc);
+      break;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (rvs[i]) {
+      got++;
+    }
+  }
+  return got;
+}
+
+/** \brief Start a bulk operation.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param rc Riak client object.
+ * \param rvs Response slots to clear.
+ * \param n Number of slots.
+ */
+static int
+_batch_start(RiakClient *rc, RiakResponse **rvs, size_t n)
+{
+  if (!rc->_async && riak_async_init(rc, RIAK_ASYNC_CONNS) < 0) {
+    return -1;
+  }
+  assert(rc->_async->batch_left == 0);
+  memset(rvs, 0, sizeof(RiakResponse *) * n);
+  return 0;
+}
+
+/** \brief Retrieve several objects from a bucket.
+ *
+ * The requests are pipelined (see riak_async_pipeline()) and the
+ * call returns once every response has arrived.  \c rvs[i] is set to
+ * the response for \c keys[i], or NULL if that request failed; free
+ * each with riak_response_free().  Returns the number of responses
+ * received or -1 on failure.  Must not be called from a callback.
+ *
+ * \param rc Riak client object.
+ * \param bucket Bucket to look for the keys in.
+ * \param keys Keys to fetch.
+ * \param n_keys Number of keys.
+ * \param req A RpbGetReq protobuf used as a template for each key.
+ * \param rvs Array of \c n_keys responses to fill in.
+ */
+int
+riak_fetch_objects(RiakClient *rc, unsigned char *bucket,
+    ProtobufCBinaryData *keys, size_t n_keys, RpbGetReq *req,
+    RiakResponse **rvs)
+{
+  size_t i;
+
+  if (_batch_start(rc, rvs, n_keys) < 0) {
+    return -1;
+  }
+  for (i = 0; i < n_keys; i++) {
+    if (riak_async_fetch_object_full(rc, bucket, &keys[i], req,
+          _batch_cb, &rvs[i]) == 0) {
+      rc->_async->batch_left++;
+    }
+  }
+  return _batch_wait(rc, rvs, n_keys);
+}
+
+/** \brief Store several objects.
+ *
+ * Works like riak_fetch_objects(); \c rvs[i] is the response to
+ * \c reqs[i].
+ *
+ * \param rc Riak client object.
+ * \param reqs Protocol buffers with the objects to add.
+ * \param n_reqs Number of requests.
+ * \param rvs Array of \c n_reqs responses to fill in.
+ */
+int
+riak_store_objects(RiakClient *rc, RpbPutReq **reqs, size_t n_reqs,
+    RiakResponse **rvs)
+{
+  size_t i;
+
+  if (_batch_start(rc, rvs, n_reqs) < 0) {
+    return -1;
+  }
+  for (i = 0; i < n_reqs; i++) {
+    if (riak_async_store_object_full(rc, reqs[i], _batch_cb,
+          &rvs[i]) == 0) {
+      rc->_async->batch_left++;
+    }
+  }
+  return _batch_wait(rc, rvs, n_reqs);
+}
+
+/** \brief Delete several objects.
+ *
+ * Works like riak_fetch_objects(); \c rvs[i] is the response to
+ * \c reqs[i].
+ *
+ * \param rc Riak client object.
+ * \param reqs RpbDelReqs detailing what bucket/keys to delete.
+ * \param n_reqs Number of requests.
+ * \param rvs Array of \c n_reqs responses to fill in.
+ */
+int
+riak_delete_objects(RiakClient *rc, RpbDelReq **reqs, size_t n_reqs,
+    RiakResponse **rvs)
+{
+  size_t i;
+
+  if (_batch_start(rc, rvs, n_reqs) < 0) {
+    return -1;
+  }
+  for (i = 0; i < n_reqs; i++) {
+    if (riak_async_delete_object_full(rc, reqs[i], _batch_cb,
+          &rvs[i]) == 0) {
+      rc->_async->batch_left++;
+    }
+  }
+  return _batch_wait(rc, rvs, n_reqs);
+}
@@ -0,0 +1,513 @@
+/** \file
+ *
+ * \brief Latency aware server selection.
+ *
+ * Every server keeps a moving average of how long requests take to
+ * start answering and a count of requests in flight.  A request goes
+ * to the cheaper of two servers picked at random ("power of two
+ * choices"), where the cost is the average latency scaled by the
+ * queue.  A slow node is shed after a few requests, while picking
+ * from two rather than always the best keeps a burst from piling onto
+ * one server.
+ *
+ * A server that has not answered anything for RIAK_LB_STALE_MS has
+ * its average ignored, so a node that was once slow gets tried again.
+ *
+ * For hedging (see riak_hedge_config()) each server also keeps a
+ * histogram of the same latencies with two buckets per power of two.
+ * The counts are halved every RIAK_LB_HIST_DECAY samples so the
+ * percentiles follow the server's recent behaviour.
+ *
+ * Each server also has a circuit breaker.  After \c rc->breaker_fails
+ * failures in a row the server is ejected: nothing is sent to it, so
+ * callers stop paying for its connect and read failures.  Every
+ * \c rc->breaker_ms a ping is sent to it from a thread of its own, and
+ * the server is put back once one is answered.  Like a DNS refresh,
+ * the probe is reference counted so it may outlive its server.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif /* S_SPLINT_S */
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** Weight of a new sample in the average: 1/2^RIAK_LB_SHIFT. */
+#define RIAK_LB_SHIFT 3
+/** Latency charged for a failed request (us). */
+#define RIAK_LB_PENALTY_US 1000000
+/** Age at which a server's average is ignored (ms). */
+#define RIAK_LB_STALE_MS 5000
+/** Samples between halvings of the latency histograms. */
+#define RIAK_LB_HIST_DECAY 1024
+/** Samples needed before a histogram's percentiles are trusted. */
+#define RIAK_LB_HIST_MIN 32
+
+/** \brief A health check running on its own thread. */
+struct _RiakProbe {
+  char *host;               ///< Host to ping.
+  char *port;               ///< Port to ping.
+  int ok;                   ///< Set if the ping was answered.
+  int done;                 ///< Set once the probe has run.
+  int refs;                 ///< Owners: the server and the thread.
+};
+
+/** \brief Per thread random state. */
+static __thread uint32_t _riak_seed;
+
+/** \brief Returns a pseudo-random number (xorshift32). */
+uint32_t
+_riak_random(void)
+{
+  uint32_t x = _riak_seed;
+
+  if (x == 0) {
+    x = (uint32_t)(uintptr_t)&_riak_seed ^ (uint32_t)_riak_now_us();
+    if (x == 0) {
+      x = 1;
+    }
+  }
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  _riak_seed = x;
+  return x;
+}
+
+/** \brief Count a latency sample in a server's histogram.
+ *
+ * \param srv The server.
+ * \param us The latency (us).
+ */
+static void
+_lb_hist_add(struct _RiakServer *srv, uint64_t us)
+{
+  int i, b = 0;
+
+  if (us > 1) {
+    b = 63 - __builtin_clzll(us);
+    /* Second half of the octave if the next bit down is set. */
+    b = 2 * b + (int)((us >> (b - 1)) & 1);
+    if (b >= RIAK_LB_BUCKETS) {
+      b = RIAK_LB_BUCKETS - 1;
+    }
+  }
+  (void)__atomic_add_fetch(&srv->lat_hist[b], 1, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&srv->lat_n, 1, __ATOMIC_RELAXED)
+      % RIAK_LB_HIST_DECAY == 0) {
+    /* Racing samples may be lost, which the percentiles can spare. */
+    for (i = 0; i < RIAK_LB_BUCKETS; i++) {
+      __atomic_store_n(&srv->lat_hist[i],
+          __atomic_load_n(&srv->lat_hist[i], __ATOMIC_RELAXED) / 2,
+          __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/** \brief Returns what sending another request to a server costs.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param now Current time from _riak_now_ms().
+ */
+static uint64_t
+_lb_cost(RiakClient *rc, int server, uint64_t now)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  uint64_t lat;
+
+  lat = __atomic_load_n(&srv->lat_us, __ATOMIC_RELAXED);
+  if (now - __atomic_load_n(&srv->lat_time, __ATOMIC_RELAXED)
+      >= RIAK_LB_STALE_MS) {
+    lat = 0;
+  }
+  return (lat + 1)
+    * ((uint64_t)__atomic_load_n(&srv->in_flight, __ATOMIC_RELAXED) + 1);
+}
+
+/** \brief Choose the server to try first.
+ *
+ * Returns the cheaper of two servers picked at random.  Callers go on
+ * to the following servers in turn if it cannot take the request.
+ *
+ * \param rc RiakClient object.
+ */
+int
+_riak_lb_pick(RiakClient *rc)
+{
+  int a, b;
+
+  if (rc->n_servers <= 1) {
+    return 0;
+  }
+  a = _riak_random() % rc->n_servers;
+  b = _riak_random() % (rc->n_servers - 1);
+  if (b >= a) {
+    b++;
+  }
+  if (!rc->servers[a].host || !_riak_server_up(rc, a)) {
+    return b;
+  }
+  if (!rc->servers[b].host || !_riak_server_up(rc, b)) {
+    return a;
+  }
+  return _lb_cost(rc, b, _riak_now_ms()) < _lb_cost(rc, a, _riak_now_ms())?
+    b: a;
+}
+
+/** \brief Count a request sent to a server.
+ *
+ * Returns the time to pass to _riak_lb_done().
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+uint64_t
+_riak_lb_start(RiakClient *rc, int server)
+{
+  (void)__atomic_add_fetch(&rc->servers[server].in_flight, 1,
+      __ATOMIC_RELAXED);
+  return _riak_now_us();
+}
+
+/** \brief Fold a latency sample into a server's average.
+ *
+ * \param srv The server.
+ * \param sample The latency (us).
+ */
+static void
+_lb_sample(struct _RiakServer *srv, int64_t sample)
+{
+  int64_t lat;
+
+  /* Racing updates may lose a sample, which an average can spare. */
+  lat = __atomic_load_n(&srv->lat_us, __ATOMIC_RELAXED);
+  if (lat == 0) {
+    lat = sample;
+  } else {
+    lat += (sample - lat) / (1 << RIAK_LB_SHIFT);
+  }
+  __atomic_store_n(&srv->lat_us, (uint64_t)(lat > 0? lat: 1),
+      __ATOMIC_RELAXED);
+  __atomic_store_n(&srv->lat_time, _riak_now_ms(), __ATOMIC_RELAXED);
+}
+
+/** \brief Account for a request a server has answered or failed.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param start Time from _riak_lb_start().
+ * \param ok 1 if the server answered, 0 if the request failed, -1 if
+ *           it was abandoned and says nothing about the server, 2 if
+ *           the server answered a request too big to time fairly.
+ */
+void
+_riak_lb_done(RiakClient *rc, int server, uint64_t start, int ok)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int64_t sample;
+
+  (void)__atomic_sub_fetch(&srv->in_flight, 1, __ATOMIC_RELAXED);
+  if (ok < 0) {
+    return;
+  }
+  if (ok && __atomic_load_n(&srv->fails, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&srv->fails, 0, __ATOMIC_RELAXED);
+  }
+  if (ok && __atomic_load_n(&srv->backoff_ms, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&srv->backoff_ms, 0, __ATOMIC_RELAXED);
+  }
+  if (ok == 2) {
+    /* Alive, but a scan's latency would make the server look slow. */
+    return;
+  }
+  sample = ok? (int64_t)(_riak_now_us() - start): RIAK_LB_PENALTY_US;
+  _lb_sample(srv, sample);
+  if (ok) {
+    _lb_hist_add(srv, (uint64_t)sample);
+  }
+  if (rc->adapt_max > 0) {
+    _riak_adapt(rc, server, ok);
+  }
+}
+
+/** \brief Account for a keep-warm ping's round trip.
+ *
+ * Keeps the latency of a server with no requests from going stale.
+ * Pings are not requests, so the histogram used for hedging is left
+ * alone.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param rtt The round trip (us).
+ */
+void
+_riak_lb_rtt(RiakClient *rc, int server, uint64_t rtt)
+{
+  _lb_sample(&rc->servers[server], (int64_t)rtt);
+}
+
+/** \brief Returns a server's latency at a percentile (us).
+ *
+ * The value is the upper edge of the histogram bucket the percentile
+ * falls in.  Returns 0 if too few requests have been timed.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param pct The percentile, 1 to 99.
+ */
+uint64_t
+_riak_lb_quantile(RiakClient *rc, int server, int pct)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  uint32_t counts[RIAK_LB_BUCKETS];
+  uint64_t total = 0, want, sum = 0;
+  int i;
+
+  for (i = 0; i < RIAK_LB_BUCKETS; i++) {
+    counts[i] = __atomic_load_n(&srv->lat_hist[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (total < RIAK_LB_HIST_MIN) {
+    return 0;
+  }
+  want = (total * pct + 99) / 100;
+  for (i = 0; i < RIAK_LB_BUCKETS - 1; i++) {
+    sum += counts[i];
+    if (sum >= want) {
+      break;
+    }
+  }
+  /* Bucket 2n ends at 1.5 * 2^n, bucket 2n + 1 at 2^(n + 1). */
+  return i & 1? (uint64_t)2 << (i / 2): (uint64_t)3 << (i / 2) >> 1;
+}
+
+/** \brief Drop a reference to a probe, freeing it with the last.
+ *
+ * \param pr The probe.
+ */
+static void
+_probe_unref(struct _RiakProbe *pr)
+{
+  if (__atomic_sub_fetch(&pr->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(pr->host);
+    free(pr->port);
+    free(pr);
+  }
+}
+
+/** \brief Ping a server over a socket of its own.
+ *
+ * Sends the same request as riak_ping() without going through a
+ * session, so it can be used from any thread.  Returns 0 if the
+ * server answered, -1 otherwise.
+ *
+ * \param sd Connected socket with nothing in flight.
+ * \param timeout_ms How long to wait for each part of the answer.
+ */
+int
+_riak_ping_fd(int sd, int timeout_ms)
+{
+  uint8_t ping[5] = { 0, 0, 0, 1, MC_RpbPingReq }, resp[5];
+  struct pollfd pfd;
+  ssize_t bytes;
+  size_t got = 0;
+
+  pfd.fd = sd;
+  pfd.events = POLLIN;
+  /* SIGPIPE would be delivered to whichever thread it hits. */
+  if (send(sd, ping, sizeof(ping), MSG_NOSIGNAL) != sizeof(ping)) {
+    return -1;
+  }
+  while (got < sizeof(resp) && poll(&pfd, 1, timeout_ms) > 0) {
+    bytes = recv(sd, resp + got, sizeof(resp) - got, 0);
+    if (bytes <= 0) {
+      break;
+    }
+    got += bytes;
+  }
+  return got == sizeof(resp) && resp[4] == MC_RpbPingResp? 0: -1;
+}
+
+/** \brief Thread body for a probe.
+ *
+ * Connects and sends a ping on a connection of its own, outside the
+ * pool, so the client's state is not touched from this thread.
+ *
+ * \param arg The probe.
+ */
+static void *
+_probe_main(void *arg)
+{
+  struct _RiakProbe *pr = arg;
+  int sd;
+
+  sd = _riak_connect_host(pr->host, pr->port);
+  if (sd >= 0) {
+    pr->ok = _riak_ping_fd(sd, RIAK_PROBE_TIMEOUT_MS) == 0;
+    close(sd);
+  }
+  __atomic_store_n(&pr->done, 1, __ATOMIC_RELEASE);
+  _probe_unref(pr);
+  return NULL;
+}
+
+/** \brief Start probing a server.
+ *
+ * The probe runs on a detached thread.  If no thread can be started
+ * it is left to count as failed.  Returns NULL if out of memory.
+ *
+ * \param srv The server.
+ */
+static struct _RiakProbe *
+_probe_start(struct _RiakServer *srv)
+{
+  struct _RiakProbe *pr;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int started = 0;
+
+  pr = malloc(sizeof(*pr));
+  if (!pr) {
+    return NULL;
+  }
+  memset(pr, 0, sizeof(*pr));
+  pr->host = strdup(srv->host);
+  pr->port = strdup(srv->port);
+  if (!pr->host || !pr->port) {
+    free(pr->host);
+    free(pr->port);
+    free(pr);
+    return NULL;
+  }
+  pr->refs = 2;
+  if (pthread_attr_init(&attr) == 0) {
+    (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, _probe_main, pr) == 0;
+    pthread_attr_destroy(&attr);
+  }
+  if (!started) {
+    pr->refs = 1;
+    pr->done = 1;
+  }
+  return pr;
+}
+
+/** \brief Check whether a server may be sent requests.
+ *
+ * For an ejected server this picks up a finished probe, putting the
+ * server back if it answered, and starts a probe when one is due.
+ * Returns 1 if the server is in service, 0 if it is ejected.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+int
+_riak_server_up(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakProbe *pr;
+  uint64_t now, due;
+  int ok;
+
+  if (!__atomic_load_n(&srv->ejected, __ATOMIC_ACQUIRE)) {
+    return 1;
+  }
+  now = _riak_now_ms();
+  pr = __atomic_load_n(&srv->probe, __ATOMIC_ACQUIRE);
+  if (pr) {
+    if (__atomic_load_n(&pr->done, __ATOMIC_ACQUIRE)
+        && __atomic_compare_exchange_n(&srv->probe, &pr, NULL, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      ok = pr->ok;
+      _probe_unref(pr);
+      if (ok) {
+        __atomic_store_n(&srv->fails, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&srv->ejected, 0, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    return 0;
+  }
+  /* Whoever moves the due time on starts the probe. */
+  due = __atomic_load_n(&srv->probe_time, __ATOMIC_RELAXED);
+  if (now >= due && srv->host
+      && __atomic_compare_exchange_n(&srv->probe_time, &due,
+        now + rc->breaker_ms, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&srv->probe, _probe_start(srv), __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/** \brief Count a failure against a server, ejecting it if need be.
+ *
+ * Each ejection is counted in the server's \c n_ejects.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+void
+_riak_breaker_fail(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int ejected = 0;
+
+  if (rc->breaker_fails <= 0
+      || __atomic_add_fetch(&srv->fails, 1, __ATOMIC_RELAXED)
+        < rc->breaker_fails
+      || __atomic_load_n(&srv->ejected, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&srv->probe_time, _riak_now_ms() + rc->breaker_ms,
+      __ATOMIC_RELAXED);
+  /* Only the thread that opens the breaker counts it. */
+  if (__atomic_compare_exchange_n(&srv->ejected, &ejected, 1, 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    (void)__atomic_add_fetch(&srv->n_ejects, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/** \brief Reset a server's circuit breaker.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+void
+_riak_breaker_drop(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakProbe *pr;
+
+  pr = __atomic_exchange_n(&srv->probe, NULL, __ATOMIC_ACQ_REL);
+  if (pr) {
+    _probe_unref(pr);
+  }
+  srv->fails = 0;
+  srv->ejected = 0;
+  srv->probe_time = 0;
+}
+
+/** \brief Configure the circuit breakers.
+ *
+ * A server is ejected after \c fails connects or requests in a row
+ * have failed, and pinged every \c retry_ms until it answers.
+ *
+ * \param rc Riak client object.
+ * \param fails Failures that eject a server; 0 never ejects.
+ * \param retry_ms Time between pings to an ejected server.
+ */
+void
+riak_breaker_config(RiakClient *rc, int fails, int retry_ms)
+{
+  rc->breaker_fails = fails;
+  rc->breaker_ms = retry_ms;
+}
@@ -4,6 +4,9 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -24,6 +27,7 @@ extern char *strdup(char *s);
 #include "riak_search.pb-c.h"
 #include "riak_yokozuna.pb-c.h"
 #include "riakccs/api.h"
+#include "riakccs/comms.h"
 #include "riakccs/pb.h"
 #include "riakccs/debug.h"
 
@@ -81,256 +85,957 @@ riak_mc2str(uint8_t mc)
 /** \brief Return a string for an unknown message code.
  *
  * \param rc RiakClient object - for the allocator.
+ * \param rv Response with the unknown message code.
  */
 void
-unknown_mc(RiakResponse *rv)
+unknown_mc(RiakClient *rc, RiakResponse *rv)
 {
   char *msgfmt = "Unknown or unexpected mc (%s)";
   char *msg;
   const char *mc_str = riak_mc2str(rv->mc);
+  ProtobufCAllocator *pa = _riak_response_allocator(rc, rv);
 
-  msg = rv->_rs->_rc->allocator->alloc(
-      rv->_rs->_rc->allocator->allocator_data,
-      strlen(msgfmt) + strlen(mc_str) + 1);
+  msg = pa->alloc(pa->allocator_data, strlen(msgfmt) + strlen(mc_str) + 1);
   snprintf(msg, strlen(msgfmt) + strlen(mc_str), msgfmt, mc_str);
   rv->liberr.msg = msg;
   rv->liberr.mc = rv->mc;
   rv->mc = MC_RpbLibError;
 }
 
-/** \brief Connect to a tcp/ip port.
+/** \brief Error state of the calling thread for threadsafe clients. */
+static __thread struct {
+  RiakClient *rc;          ///< Client the error is for.
+  int err;                 ///< errno value.
+  int act;                 ///< Error action.
+  ssize_t bytes;           ///< Value of "bytes" before the error.
+} _riak_thread_error;
+
+/** \brief Record an error.
  *
- * \param host Host to connect to.
- * \param port Port to connect to.
+ * Threadsafe clients keep the error per thread; see riak_last_error().
+ *
+ * \param rc RiakClient object.
+ * \param err errno value.
+ * \param act Error action.
+ * \param bytes Value of "bytes" before the error.
+ */
+void
+_riak_error(RiakClient *rc, int err, int act, ssize_t bytes)
+{
+  if (rc->_threaded) {
+    _riak_thread_error.rc = rc;
+    _riak_thread_error.err = err;
+    _riak_thread_error.act = act;
+    _riak_thread_error.bytes = bytes;
+  } else {
+    rc->last_errno = err;
+    rc->last_erract = act;
+    rc->last_errbytes = bytes;
+  }
+}
+
+/** \brief Get the last error.
+ *
+ * For a threadsafe client this is the last error the calling thread
+ * had with it; otherwise it is the client's "last_*" members.  Any of
+ * the pointers may be NULL.
+ *
+ * \param rc Riak client object.
+ * \param err Set to the errno value.
+ * \param act Set to the error action (RIAK_ACT_*).
+ * \param bytes Set to the value of "bytes" before the error.
+ */
+void
+riak_last_error(RiakClient *rc, int *err, int *act, ssize_t *bytes)
+{
+  int e = rc->last_errno, a = rc->last_erract;
+  ssize_t b = rc->last_errbytes;
+
+  if (rc->_threaded) {
+    if (_riak_thread_error.rc == rc) {
+      e = _riak_thread_error.err;
+      a = _riak_thread_error.act;
+      b = _riak_thread_error.bytes;
+    } else {
+      e = a = 0;
+      b = 0;
+    }
+  }
+  if (err) {
+    *err = e;
+  }
+  if (act) {
+    *act = a;
+  }
+  if (bytes) {
+    *bytes = b;
+  }
+}
+
+/** \brief Drop a buffer's hold if no response still views it.
+ *
+ * Returns 1 if the buffer is still held.
+ *
+ * \param buf The buffer.
  */
 static int
-connect_to_host(char *host, char *port)
-{
-  int sd = -1, lookup_err;
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = 0;
-  hints.ai_protocol = 0;
-
-  lookup_err = getaddrinfo(host, port, &hints, &result);
-  if (lookup_err != 0) {
-    // TODO: Log connection failure.
-    fprintf(stderr, "Failed to look up %s:%s (%s)",
-        host, port, gai_strerror(lookup_err));
-    return -1;
+_buf_held(struct _RiakBuf *buf)
+{
+  struct _RiakHold *hold = buf->hold;
+
+  if (hold && __atomic_load_n(&hold->refs, __ATOMIC_ACQUIRE) == 1) {
+    hold->allocator->free(hold->allocator->allocator_data, hold);
+    buf->hold = NULL;
   }
+  return buf->hold != NULL;
+}
 
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-      // TODO: Log connection failure.
-      fprintf(stderr, "Couldn't create socket");
+/** \brief Make sure a buffer can hold \c len bytes past \c head.
+ *
+ * Returns 0 on success, -1 if memory could not be allocated.  Unread
+ * data is moved to the front of the buffer, or to a new one if
+ * responses still view the old.
+ *
+ * \param rc RiakClient object - for the allocator.
+ * \param buf Buffer to grow.
+ * \param len Number of bytes needed.
+ */
+int
+_riak_buf_reserve(RiakClient *rc, struct _RiakBuf *buf, size_t len)
+{
+  uint8_t *data;
+  size_t size, used = buf->tail - buf->head;
+
+  if (buf->head + len <= buf->size) {
+    return 0;
+  }
+  if (len <= buf->size && !_buf_held(buf)) {
+    /* Enough room once consumed bytes are dropped. */
+    memmove(buf->data, buf->data + buf->head, used);
+  } else {
+    for (size = buf->size ? buf->size : 256; size < len; size *= 2)
+      ;
+    data = rc->allocator->alloc(rc->allocator->allocator_data, size);
+    if (!data) {
       return -1;
-    } else {
-      if (connect(sd, rp->ai_addr, rp->ai_addrlen) != -1) {
-        break;
-      } else {
-        close(sd);
-        sd = -1;
+    }
+    if (used) {
+      memcpy(data, buf->data + buf->head, used);
+    }
+    if (buf->fixed) {
+      _riak_uring_put_buf(rc, buf);
+    } else if (buf->hold) {
+      _riak_hold_put(buf->hold);
+      buf->hold = NULL;
+    } else if (buf->data) {
+      rc->allocator->free(rc->allocator->allocator_data, buf->data);
+    }
+    buf->data = data;
+    buf->size = size;
+    buf->fixed = 0;
+  }
+  buf->head = 0;
+  buf->tail = used;
+  return 0;
+}
+
+/** \brief Release the memory held by a buffer.
+ *
+ * \param rc RiakClient object - for the allocator.
+ * \param buf Buffer to release.
+ */
+void
+_riak_buf_free(RiakClient *rc, struct _RiakBuf *buf)
+{
+  if (buf->fixed) {
+    _riak_uring_put_buf(rc, buf);
+  } else if (buf->hold) {
+    _riak_hold_put(buf->hold);
+  } else if (buf->data) {
+    rc->allocator->free(rc->allocator->allocator_data, buf->data);
+  }
+  memset(buf, 0, sizeof(struct _RiakBuf));
+}
+
+/** \brief Discard a buffer's contents.
+ *
+ * Reading starts again at the front unless responses still view the
+ * buffer, in which case it carries on from the end.
+ *
+ * \param buf Buffer to empty.
+ */
+void
+_riak_buf_empty(struct _RiakBuf *buf)
+{
+  buf->head = buf->tail = _buf_held(buf)? buf->tail: 0;
+}
+
+/** \brief Write the connection's send buffer to its socket.
+ *
+ * With a deadline set the socket is not left to block, so a write
+ * that stalls can time out.  Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object - for error reporting.
+ * \param conn Connection to flush.
+ */
+static int
+_conn_flush(RiakClient *rc, struct _RiakConn *conn)
+{
+  ssize_t bytes;
+
+  while (conn->wbuf.head < conn->wbuf.tail) {
+    bytes = send(conn->sd, conn->wbuf.data + conn->wbuf.head,
+        conn->wbuf.tail - conn->wbuf.head,
+        conn->deadline? MSG_DONTWAIT: 0);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+          || errno == EINTR)) {
+      if (_riak_conn_wait(rc, conn, POLLOUT, RIAK_ACT_WRITE) < 0) {
+        return -1;
+      }
+      continue;
+    } else if (bytes <= 0) {
+      _riak_error(rc, errno, RIAK_ACT_WRITE, bytes);
+      return -1;
+    }
+    conn->wbuf.head += bytes;
+  }
+  conn->wbuf.head = conn->wbuf.tail = 0;
+  return 0;
+}
+
+/** \brief Read from a connection until \c want bytes are buffered.
+ *
+ * Reads as much as the socket has available, so later frames of a
+ * streaming response are usually buffered by the time they are
+ * needed.  A request still in the send buffer, as left by a retry, is
+ * sent first.  With a deadline set each read waits for the socket to
+ * be readable first, so a silent server times out rather than blocking
+ * the read forever.  Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object - for the allocator and error reporting.
+ * \param conn Connection to read from.
+ * \param want Number of unconsumed bytes needed in the buffer.
+ * \param act Error action to report on failure.
+ */
+static int
+_conn_fill(RiakClient *rc, struct _RiakConn *conn, size_t want, int act)
+{
+  struct _RiakBuf *buf = &conn->rbuf;
+  ssize_t bytes;
+
+  if (conn->wbuf.head < conn->wbuf.tail && _conn_flush(rc, conn) < 0) {
+    return -1;
+  }
+  if (buf->head + want > buf->size
+      && _riak_buf_reserve(rc, buf,
+        want < RIAK_RBUF_MIN? RIAK_RBUF_MIN: want) < 0) {
+    _riak_error(rc, ENOMEM, act, 0);
+    return -1;
+  }
+  while (buf->tail - buf->head < want) {
+    if (conn->deadline && _riak_conn_wait(rc, conn, POLLIN, act) < 0) {
+      return -1;
+    }
+    bytes = read(conn->sd, buf->data + buf->tail, buf->size - buf->tail);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+          || errno == EINTR)) {
+      if (_riak_conn_wait(rc, conn, POLLIN, act) < 0) {
+        return -1;
       }
+      continue;
+    } else if (bytes <= 0) {
+      _riak_error(rc, bytes < 0? errno: 0, act, bytes);
+      return -1;
     }
+    buf->tail += bytes;
   }
+  return 0;
+}
 
-  if (rp == NULL) {
-    // TODO: Log connection failure.
+/** \brief Get a session from the free list or allocate one.
+ *
+ * \param rc RiakClient object.
+ */
+static RiakSession *
+_session_get(RiakClient *rc)
+{
+  RiakSession *rs;
+
+  if (rc->_sessions && !rc->_threaded) {
+    rs = rc->_sessions;
+    rc->_sessions = rs->_next;
+  } else {
+    rs = rc->allocator->alloc(rc->allocator->allocator_data,
+        sizeof(RiakSession));
+    if (!rs) {
+      return NULL;
+    }
   }
+  rs->_rc = rc;
+  rs->conn = NULL;
+  rs->streaming = 0;
+  rs->_start = 0;
+  rs->_mc = 0;
+  rs->_msg = NULL;
+  rs->_tries = 0;
+  rs->_deadline = 0;
+  rs->_admitted = 0;
+  rs->_lane = RIAK_LANE_INTERACTIVE;
+  rs->_bulk = 0;
+  rs->_next = NULL;
+  return rs;
+}
 
-  freeaddrinfo(result);
-  return sd;
+/** \brief Stop counting a session's connection as held by bulk.
+ *
+ * \param rc RiakClient object.
+ * \param rs The session, still holding its connection.
+ */
+static void
+_session_unbulk(RiakClient *rc, RiakSession *rs)
+{
+  if (rs->_bulk) {
+    (void)__atomic_sub_fetch(&rc->servers[rs->conn->server].n_bulk, 1,
+        __ATOMIC_RELAXED);
+    rs->_bulk = 0;
+  }
 }
 
-/** \brief Write a request to the Riak server.
+/** \brief Close the connection a session holds.
+ *
+ * The connection is in the middle of a response, so it is closed
+ * rather than returned to the pool.
+ *
+ * \param rc RiakClient object.
+ * \param rs The session.
+ */
+static void
+_session_drop(RiakClient *rc, RiakSession *rs)
+{
+  if (rs->_start) {
+    /* The request failed before any answer came. */
+    _riak_lb_done(rc, rs->conn->server, rs->_start, 0);
+    _riak_breaker_fail(rc, rs->conn->server);
+    rs->_start = 0;
+  }
+  _session_unbulk(rc, rs);
+  close(rs->conn->sd);
+  rs->conn->sd = -1;
+  _riak_pool_put(rc, rs->conn);
+  rs->conn = NULL;
+}
+
+/** \brief Return a session to the free list.
+ *
+ * A connection still held by the session is closed.
+ *
+ * \param rc RiakClient object.
+ * \param rs Session to recycle.
+ */
+void
+_riak_session_put(RiakClient *rc, RiakSession *rs)
+{
+  if (rs->conn) {
+    _session_drop(rc, rs);
+  }
+  if (rs->_admitted) {
+    _riak_admit_done(rc);
+    rs->_admitted = 0;
+  }
+  if (rc->_threaded) {
+    rc->allocator->free(rc->allocator->allocator_data, rs);
+  } else {
+    rs->_next = rc->_sessions;
+    rc->_sessions = rs;
+  }
+}
+
+/** \brief Wait for a connection's socket to become ready.
  *
- * Updates \c bytes_tot with the total number of bytes written (including
- * header) and returns RiakSession on success or NULL on failure.
+ * Returns 0 once the socket is ready (or has an error pending for the
+ * following read or write to report), -1 on failure.  Waiting past
+ * the connection's deadline fails with ETIMEDOUT and RIAK_ACT_TIMEOUT.
+ *
+ * \param rc RiakClient object - for error reporting.
+ * \param conn Connection to wait for.
+ * \param events POLLIN or POLLOUT.
+ * \param act Error action to report on failure.
+ */
+int
+_riak_conn_wait(RiakClient *rc, struct _RiakConn *conn, short events,
+    int act)
+{
+  struct pollfd pfd;
+  int64_t left = -1;
+  int n;
+
+  pfd.fd = conn->sd;
+  pfd.events = events;
+  pfd.revents = 0;
+  do {
+    if (conn->deadline) {
+      left = (int64_t)(conn->deadline - _riak_now_ms());
+      if (left < 0) {
+        left = 0;
+      }
+    }
+    n = poll(&pfd, 1, (int)left);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    _riak_error(rc, errno, act, 0);
+    return -1;
+  } else if (n == 0) {
+    _riak_error(rc, ETIMEDOUT, RIAK_ACT_TIMEOUT, 0);
+    return -1;
+  }
+  return 0;
+}
+
+/** \brief A request copied to carry the client's default timeout. */
+union _RiakTimeoutReq {
+  RpbGetReq get;           ///< Get request.
+  RpbPutReq put;           ///< Put request.
+  RpbDelReq del;           ///< Delete request.
+  RpbListKeysReq lk;       ///< List keys request.
+  RpbIndexReq idx;         ///< Secondary index request.
+};
 
+/** \brief Give a request the client's default timeout for the server.
+ *
+ * Requests with a \c timeout field that the caller left unset are
+ * copied into \c copy with it filled in from riak_timeout_config(),
+ * so the server gives up when the client does.  The caller's request
+ * is left alone.  Returns the request to send.
+ *
  * \param rc RiakClient object.
+ * \param mc The message code of the request.
+ * \param msg The request; NULL if it has no body.
+ * \param copy Room for the copy.
+ */
+static const ProtobufCMessage *
+_frame_timeout(RiakClient *rc, uint8_t mc, const ProtobufCMessage *msg,
+    union _RiakTimeoutReq *copy)
+{
+  if (!msg || rc->timeout_ms <= 0) {
+    return msg;
+  }
+  switch (mc) {
+    case MC_RpbGetReq:
+      if (((const RpbGetReq *)msg)->has_timeout) {
+        return msg;
+      }
+      copy->get = *(const RpbGetReq *)msg;
+      copy->get.has_timeout = 1;
+      copy->get.timeout = rc->timeout_ms;
+      return &copy->get.base;
+    case MC_RpbPutReq:
+      if (((const RpbPutReq *)msg)->has_timeout) {
+        return msg;
+      }
+      copy->put = *(const RpbPutReq *)msg;
+      copy->put.has_timeout = 1;
+      copy->put.timeout = rc->timeout_ms;
+      return &copy->put.base;
+    case MC_RpbDelReq:
+      if (((const RpbDelReq *)msg)->has_timeout) {
+        return msg;
+      }
+      copy->del = *(const RpbDelReq *)msg;
+      copy->del.has_timeout = 1;
+      copy->del.timeout = rc->timeout_ms;
+      return &copy->del.base;
+    case MC_RpbListKeysReq:
+      if (((const RpbListKeysReq *)msg)->has_timeout) {
+        return msg;
+      }
+      copy->lk = *(const RpbListKeysReq *)msg;
+      copy->lk.has_timeout = 1;
+      copy->lk.timeout = rc->timeout_ms;
+      return &copy->lk.base;
+    case MC_RpbIndexReq:
+      if (((const RpbIndexReq *)msg)->has_timeout) {
+        return msg;
+      }
+      copy->idx = *(const RpbIndexReq *)msg;
+      copy->idx.has_timeout = 1;
+      copy->idx.timeout = rc->timeout_ms;
+      return &copy->idx.base;
+    default:
+      return msg;
+  }
+}
+
+/** \brief Append a framed request to a buffer.
+ *
+ * The protobuf is packed directly after its 5 byte header so the
+ * whole request can be sent with one write; see encode.c.  A request
+ * without a timeout of its own carries the client's default; see
+ * _frame_timeout().  Returns the number of bytes appended or 0 on
+ * allocation failure.
+ *
+ * \param rc RiakClient object - for the allocator.
+ * \param buf Buffer to append the request to.
  * \param mc The message code to send.
- * \param len Length of the data to send.
- * \param pb The serialised protobuf data.
- * \param bytes_tot Number of bytes written.
+ * \param msg The protobuf to send; NULL if there is no body.
  */
-static RiakSession *
-_write_req(RiakClient *rc,
+size_t
+_riak_frame(RiakClient *rc, struct _RiakBuf *buf, uint8_t mc,
+    const ProtobufCMessage *msg)
+{
+  union _RiakTimeoutReq copy;
+  uint32_t hdr_len;
+  uint8_t *hdr;
+  size_t len = 0, aux = 0;
+
+  msg = _frame_timeout(rc, mc, msg, &copy);
+  if (msg) {
+    len = _riak_pack_size(mc, msg, &aux);
+  }
+  if (_riak_buf_reserve(rc, buf, buf->tail - buf->head + 5 + len) < 0) {
+    return 0;
+  }
+  hdr = buf->data + buf->tail;
+  if (msg) {
+    (void)_riak_pack(mc, msg, aux, hdr + 5);
+  }
+
+  /* Create header block. */
+  hdr_len = htonl(len + 1);
+  memcpy(hdr, &hdr_len, 4);
+  hdr[4] = mc;
+  buf->tail += 5 + len;
+  return 5 + len;
+}
+
+/** \brief Check a connection out for a session.
+ *
+ * Servers are tried starting from the least loaded, with \c avoid
+ * tried last.  Servers over their limits (see riak_node_limit_config())
+ * are passed over; if every server is, the session waits for room
+ * when \c wait is set and the client blocks.  Returns 0 on success,
+ * -1 on failure.
+ *
+ * \param rc RiakClient object.
+ * \param rs The session.
+ * \param avoid Index of a server that has just failed; or -1.
+ * \param wait Set to allow waiting for room under a limit.
+ */
+static int
+_session_conn(RiakClient *rc, RiakSession *rs, int avoid, int wait)
+{
+  unsigned int start;
+  int i, server, full, up, limited;
+  uint64_t room, soonest;
+
+  do {
+    full = 1;
+    up = limited = 0;
+    soonest = RIAK_LIMIT_NEVER;
+    start = _riak_lb_pick(rc);
+    for (i = 0; i <= rc->n_servers && !rs->conn; i++) {
+      server = i < rc->n_servers? (int)((start + i) % rc->n_servers): avoid;
+      if (server < 0 || (i < rc->n_servers && server == avoid)
+          || !rc->servers[server].host || !_riak_server_up(rc, server)) {
+        continue;
+      }
+      up++;
+      if ((rs->_lane == RIAK_LANE_BULK
+            && (room = _riak_lane_admit(rc, server)) != 0)
+          || (room = _riak_node_admit(rc, server)) != 0) {
+        limited++;
+        soonest = room < soonest? room: soonest;
+        continue;
+      }
+      if (__atomic_load_n(&rc->servers[server].n_conns, __ATOMIC_RELAXED)
+          < rc->pool_max) {
+        full = 0;
+      }
+      rs->conn = _riak_pool_get(rc, server, 1, rs->_deadline);
+      if (!rs->conn && rs->_deadline && _riak_now_ms() >= rs->_deadline) {
+        /* Out of time; the error is set. */
+        return -1;
+      }
+    }
+    if (!rs->conn && up > 0 && limited == up
+        && _riak_limit_wait(rc, wait? soonest: RIAK_LIMIT_NEVER,
+          rs->_deadline) < 0) {
+      /* Every server is at its limits; the error is set. */
+      return -1;
+    }
+  } while (!rs->conn && up > 0 && limited == up);
+  if (rs->conn) {
+    rs->conn->deadline = rs->_deadline;
+    if (rs->_lane == RIAK_LANE_BULK) {
+      (void)__atomic_add_fetch(&rc->servers[rs->conn->server].n_bulk, 1,
+          __ATOMIC_RELAXED);
+      rs->_bulk = 1;
+    }
+  } else {
+    /* TODO: Log error - no available servers. */
+    if (up == 0) {
+      /* Every server has been ejected. */
+      _riak_error(rc, EHOSTDOWN, RIAK_ACT_CONNECT, 0);
+    } else if (full) {
+      /* Every connection is checked out. */
+      _riak_error(rc, EAGAIN, RIAK_ACT_CONNECT, 0);
+    }
+  }
+  return rs->conn? 0: -1;
+}
+
+/** \brief Returns how long a request may take (ms); 0 for no limit.
+ *
+ * That is the timeout the request carries for the server, or else
+ * the client's default.
+ *
+ * \param rc RiakClient object.
+ * \param mc The message code of the request.
+ * \param msg The request; NULL if it has no body.
+ */
+uint32_t
+_riak_req_timeout(RiakClient *rc, uint8_t mc, const ProtobufCMessage *msg)
+{
+  const RpbGetReq *get = (const RpbGetReq *)msg;
+  const RpbPutReq *put = (const RpbPutReq *)msg;
+  const RpbDelReq *del = (const RpbDelReq *)msg;
+  const RpbListKeysReq *lk = (const RpbListKeysReq *)msg;
+  const RpbIndexReq *idx = (const RpbIndexReq *)msg;
+
+  if (!msg) {
+    return rc->timeout_ms;
+  }
+  switch (mc) {
+    case MC_RpbGetReq:
+      return get->has_timeout? get->timeout: rc->timeout_ms;
+    case MC_RpbPutReq:
+      return put->has_timeout? put->timeout: rc->timeout_ms;
+    case MC_RpbDelReq:
+      return del->has_timeout? del->timeout: rc->timeout_ms;
+    case MC_RpbListKeysReq:
+      return lk->has_timeout? lk->timeout: rc->timeout_ms;
+    case MC_RpbIndexReq:
+      return idx->has_timeout? idx->timeout: rc->timeout_ms;
+    default:
+      return rc->timeout_ms;
+  }
+}
+
+/** \brief Check whether a request may safely be sent twice.
+ *
+ * \param mc The message code of the request.
+ */
+static int
+_retryable(uint8_t mc)
+{
+  switch (mc) {
+    case MC_RpbPingReq:
+    case MC_RpbGetClientIdReq:
+    case MC_RpbGetServerInfoReq:
+    case MC_RpbGetReq:
+    case MC_RpbListBucketsReq:
+    case MC_RpbListKeysReq:
+    case MC_RpbGetBucketReq:
+    case MC_RpbIndexReq:
+    case MC_RpbSearchQueryReq:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/** \brief Take a retry from the client's retry budget.
+ *
+ * Each retry costs RIAK_RETRY_COST tokens and each answered request
+ * earns one, so retries cannot add more than a tenth to the load on a
+ * struggling cluster.  Returns 1 if the retry may go ahead.
+ *
+ * \param rc RiakClient object.
+ */
+static int
+_retry_take(RiakClient *rc)
+{
+  int tokens;
+
+  tokens = __atomic_load_n(&rc->_retry_tokens, __ATOMIC_RELAXED);
+  do {
+    if (tokens < RIAK_RETRY_COST) {
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(&rc->_retry_tokens, &tokens,
+        tokens - RIAK_RETRY_COST, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+/** \brief Send a request again after its connection failed.
+ *
+ * Only requests that are safe to repeat and have had no part of their
+ * response are retried, on a new connection to another server if
+ * possible.  Returns 0 once the request is framed on the new
+ * connection, -1 if it is not retried.
+ *
+ * \param rc RiakClient object.
+ * \param rs The session.
+ */
+static int
+_session_retry(RiakClient *rc, RiakSession *rs)
+{
+  int server = rs->conn->server;
+
+  if (!rs->_mc || rs->_tries >= rc->retries
+      || (rs->_deadline && _riak_now_ms() >= rs->_deadline)
+      || !_retry_take(rc)) {
+    return -1;
+  }
+  _session_drop(rc, rs);
+  /* The server has likely restarted; its idle connections are dead. */
+  _riak_pool_close(rc, server, 0);
+  rs->_tries++;
+  if (_session_conn(rc, rs, server, 1) < 0) {
+    return -1;
+  }
+  rs->conn->wbuf.head = rs->conn->wbuf.tail = 0;
+  if (!_riak_frame(rc, &rs->conn->wbuf, rs->_mc, rs->_msg)) {
+    return -1;
+  }
+  rs->_start = _riak_lb_start(rc, rs->conn->server);
+  return 0;
+}
+
+/** \brief Start a request to the Riak server.
+ *
+ * Checks out a connection for the session and frames the request in
+ * its send buffer, ready for the transport to send.  Returns
+ * RiakSession on success or NULL on failure.
+ *
+ * \param rc RiakClient object.
+ * \param rv Previous response for streaming requests; NULL otherwise.
+ * \param mc The message code to send.
+ * \param msg The protobuf to send; NULL if there is no body.
+ */
+RiakSession *
+_riak_session_open(RiakClient *rc,
     RiakResponse *rv,
     uint8_t mc,
-    uint32_t len,
-    uint8_t *pb)
+    const ProtobufCMessage *msg)
 {
   RiakSession *rs;
-  int server;
-  uint8_t hdr[5];
-  uint32_t *hdr_len;
-  ssize_t bytes = 0;
-  size_t bytes_tot;
+  uint32_t timeout;
 
   if (!rv) {
-    rs = malloc(sizeof(RiakSession));
-    rs->_rc = rc;
+    rs = _session_get(rc);
+    if (!rs) {
+      return NULL;
+    }
     if (mc != MC_RpbIndexReq) {
       rs->streaming = 0;
     } else {
       rs->streaming = 1;
     }
-
-    /* Try to find an available server. */
-    assert(rc->current < rc->n_servers);
-    server = rc->current;
-    do {
-      server++;
-      if (server >= rc->n_servers) {
-        server = 0;
-      }
-    } while (server != rc->current
-        && rc->servers[server].inuse
-        && rc->servers[server].sd < 0);
-
-    /* If server is available, assign it to session and mark it inuse.
-     * Otherwise make a new connection. */
-    if (rc->servers[server].host
-        && rc->servers[server].sd >= 0
-        && !rc->servers[server].inuse) {
-      rc->servers[server].inuse = 1;
-      rs->server = server;
-      rs->sd = rc->servers[server].sd;
-    } else {
-      rs->server = -1;
-      server = rc->current;
-      /* Find first valid host in server list after rc->current. */
-      do {
-        server++;
-        if (server >= rc->n_servers) {
-          server = 0;
-        }
-      } while (server != rc->current
-          && !rc->servers[server].host);
-      if (rc->servers[server].host) {
-        rs->sd = connect_to_host(rc->servers[server].host,
-            rc->servers[server].port);
-      } else {
-        /* TODO: Log error - no available servers. */
-        free(rs);
-        return NULL;
-      }
-    }
-
-    /* Increment rc->current to next server */
-    rc->current++;
-    if (rc->current == rc->n_servers) {
-      rc->current = 0;
-    }
   } else {
     rs = rv->_rs;
     riak_response_only_free(rc, rv);
   }
+  timeout = _riak_req_timeout(rc, mc, msg);
+  rs->_deadline = timeout? _riak_now_ms() + timeout: 0;
+  if (rs->conn) {
+    rs->conn->deadline = rs->_deadline;
+  }
 
+  if (!rv) {
+    if (_riak_admit(rc, rs->_deadline) < 0) {
+      _riak_session_put(rc, rs);
+      return NULL;
+    }
+    rs->_admitted = 1;
+    rs->_lane = _riak_lane(mc);
+  }
 
-  /* Create header block. */
-  hdr_len = (uint32_t *)hdr;
-  *hdr_len = htonl(len + 1);
-  hdr[4] = mc;
+  if (!rs->conn && _session_conn(rc, rs, -1, 1) < 0) {
+    _riak_session_put(rc, rs);
+    return NULL;
+  }
+
+  rs->conn->wbuf.head = rs->conn->wbuf.tail = 0;
+  if (!_riak_frame(rc, &rs->conn->wbuf, mc, msg)) {
+    _riak_session_put(rc, rs);
+    return NULL;
+  }
+  if (!rs->_start) {
+    rs->_start = _riak_lb_start(rc, rs->conn->server);
+  }
+  /* Kept until the first frame in case the request is retried. */
+  rs->_mc = _retryable(mc)? mc: 0;
+  rs->_msg = msg;
+  rs->_tries = 0;
 
-  /* Write header. */
-  bytes_tot = 0;
-  while (bytes_tot < 5) {
-    bytes = write(rs->sd, hdr + bytes_tot, 5 - bytes_tot);
-    if (bytes <= 0) {
-      // TODO: Log error; error out server.
-      free(rs);
+  return rs;
+}
+
+/** \brief Write a request to the Riak server.
+ *
+ * Returns RiakSession on success or NULL on failure.
+
+ * \param rc RiakClient object.
+ * \param rv Previous response for streaming requests; NULL otherwise.
+ * \param mc The message code to send.
+ * \param msg The protobuf to send; NULL if there is no body.
+ */
+static RiakSession *
+_write_req(RiakClient *rc,
+    RiakResponse *rv,
+    uint8_t mc,
+    const ProtobufCMessage *msg)
+{
+  RiakSession *rs;
+
+  rs = _riak_session_open(rc, rv, mc, msg);
+  while (rs && _conn_flush(rc, rs->conn) < 0) {
+    if (_session_retry(rc, rs) < 0) {
+      // TODO: Log error.
+      _riak_session_put(rc, rs);
       return NULL;
     }
-    bytes_tot += bytes;
-  }
-
-  /* Write body (if it exists). */
-  bytes_tot = 0;
-  if (len) {
-    while (bytes_tot < len) {
-      bytes = write(rs->sd, pb + bytes_tot, len - bytes_tot);
-      if (bytes <= 0) {
-        // TODO: Log error; error out server.
-        free(rs);
-        return NULL;
-      }
-      bytes_tot += bytes;
-    }
   }
 
   return rs;
 }
 
-/** \brief Read a response from the Riak server.
+/** \brief Give up on a request whose answer is no longer wanted.
  *
- * Returns a RiakResponse object on success or NULL on failure.
+ * The connection is closed rather than left to be drained, so nothing
+ * waits on the slow server.  The server is not held to blame.
  *
- * \param rs RiakSession object.
+ * \param rc RiakClient object.
+ * \param rs The session.
  */
-static RiakResponse *
-_read_resp(RiakSession *rs)
+static void
+_session_cancel(RiakClient *rc, RiakSession *rs)
 {
-  RiakResponse *rv;
-  uint8_t hdr[5], *pb;
-  ssize_t bytes = 0;
-  size_t bytes_tot = 0, len;
-  uint32_t *hdr_len;
-  int release_socket = 1;  /* Default to release. */
+  if (rs->_start) {
+    _riak_lb_done(rc, rs->conn->server, rs->_start, -1);
+    rs->_start = 0;
+  }
+  _riak_session_put(rc, rs);
+}
 
-  rv = rs->_rc->allocator->alloc(rs->_rc->allocator->allocator_data,
-      sizeof(RiakResponse));
-  rv->success = 1;
-  rv->_rs = rs;
+/** \brief Write a request, sending it to a second server if slow.
+ *
+ * If the first server has not started to answer by the time
+ * \c rc->hedge_pct percent of its recent requests had, the request is
+ * sent to another server as well.  The session that starts to answer
+ * first is returned and the other cancelled.  Only for requests that
+ * are safe to send twice.  Returns NULL on failure.
+ *
+ * \param rc RiakClient object.
+ * \param mc The message code to send.
+ * \param msg The protobuf to send.
+ */
+RiakSession *
+_riak_hedge_req(RiakClient *rc, uint8_t mc, const ProtobufCMessage *msg)
+{
+  RiakSession *rs, *hedge;
+  struct pollfd pfd[2];
+  uint64_t delay, until;
+  int64_t left;
+  int r, server;
 
-  /* Read header. */
-  while (bytes_tot < 5) {
-    bytes = read(rs->sd, hdr + bytes_tot, 5 - bytes_tot);
-    if (bytes <= 0) {
-      // TODO: Log out error; error out server.
-      rs->_rc->allocator->free(rs->_rc->allocator->allocator_data, rv);
-      rs->_rc->last_erract = RIAK_ACT_READ_HDR;
-      rs->_rc->last_errbytes = bytes;
-      return NULL;
-    }
-    bytes_tot += bytes;
+  rs = rc->_write(rc, NULL, mc, msg);
+  if (!rs || rc->hedge_pct <= 0 || rc->_write != &_write_req
+      || rc->n_servers < 2 || rs->_lane == RIAK_LANE_BULK) {
+    /* The io_uring transport only sends when it reads, and bulk
+     * requests are in no hurry. */
+    return rs;
+  }
+  server = rs->conn->server;
+  delay = _riak_lb_quantile(rc, server, rc->hedge_pct);
+  if (delay == 0) {
+    return rs;
+  }
+  /* Wait out the delay, but no further than the deadline. */
+  until = _riak_now_ms() + (delay + 999) / 1000;
+  if (rs->_deadline && rs->_deadline < until) {
+    until = rs->_deadline;
+  }
+  pfd[0].fd = rs->conn->sd;
+  pfd[0].events = POLLIN;
+  do {
+    left = (int64_t)(until - _riak_now_ms());
+    r = poll(pfd, 1, left < 0? 0: (int)left);
+  } while (r < 0 && errno == EINTR);
+  if (rs->_deadline && _riak_now_ms() >= rs->_deadline) {
+    /* Leave the read to report the timeout. */
+    return rs;
+  }
+  if (r != 0 || rs->conn->rbuf.head != rs->conn->rbuf.tail) {
+    return rs;
   }
 
-  /* Process header. */
-  hdr_len = (uint32_t *)hdr;
-  len = ntohl(*hdr_len);
-  if (len == 0) {
-    rs->_rc->last_erract = RIAK_ACT_READ_PROC_HDR;
-    rs->_rc->last_errbytes = bytes;
-    rs->_rc->allocator->free(rs->_rc->allocator->allocator_data, rv);
-    return NULL;
+  /* Too slow; ask another server too. */
+  hedge = _session_get(rc);
+  if (!hedge) {
+    return rs;
   }
-  len -= 1;
-  rv->mc = hdr[4];
-
-  /* Read body (if it exists). */
-  pb = NULL;  /* pb is NULL unless something is allocated. */
-  if (len) {
-    pb = rs->_rc->allocator->alloc(rs->_rc->allocator->allocator_data, (len));
-    bytes_tot = 0;
-    while (bytes_tot < len) {
-      bytes = read(rs->sd, pb + bytes_tot, len - bytes_tot);
-      if (bytes <= 0) {
-        rs->_rc->allocator->free(rs->_rc->allocator->allocator_data, pb);
-        pb = NULL;
-        rs->_rc->allocator->free(rs->_rc->allocator->allocator_data, rv);
-        rs->_rc->last_erract = RIAK_ACT_READ_PB;
-        rs->_rc->last_errbytes = bytes;
-        return NULL;
-      }
-      bytes_tot += bytes;
-    }
+  hedge->streaming = rs->streaming;
+  hedge->_deadline = rs->_deadline;
+  if (_session_conn(rc, hedge, server, 0) < 0) {
+    _riak_session_put(rc, hedge);
+    return rs;
+  } else if (hedge->conn->server == server) {
+    /* No other server to ask. */
+    _riak_pool_put(rc, hedge->conn);
+    hedge->conn = NULL;
+    _riak_session_put(rc, hedge);
+    return rs;
+  }
+  hedge->conn->wbuf.head = hedge->conn->wbuf.tail = 0;
+  if (!_riak_frame(rc, &hedge->conn->wbuf, mc, msg)
+      || _conn_flush(rc, hedge->conn) < 0) {
+    _riak_session_put(rc, hedge);
+    return rs;
+  }
+  hedge->_start = _riak_lb_start(rc, hedge->conn->server);
+  hedge->_mc = _retryable(mc)? mc: 0;
+  hedge->_msg = msg;
+
+  pfd[1].fd = hedge->conn->sd;
+  pfd[1].events = POLLIN;
+  do {
+    left = rs->_deadline? (int64_t)(rs->_deadline - _riak_now_ms()): -1;
+    r = poll(pfd, 2, rs->_deadline && left < 0? 0: (int)left);
+  } while (r < 0 && errno == EINTR);
+  if (r > 0 && !pfd[0].revents && pfd[1].revents) {
+    /* The admission goes with the request. */
+    hedge->_admitted = rs->_admitted;
+    rs->_admitted = 0;
+    _session_cancel(rc, rs);
+    return hedge;
   }
+  _session_cancel(rc, hedge);
+  return rs;
+}
+
+/** \brief Unpack the protobuf of a response frame.
+ *
+ * Fills in \c rv from the frame's body.  Returns 1 if this is the
+ * last frame of the response, 0 if a streaming response has more
+ * frames to come.
+ *
+ * Large get responses are viewed in place after riak_view_config(),
+ * which holds the receive buffer.
+ *
+ * \param rc RiakClient object - for the allocator.
+ * \param rv Response with \c mc already set from the frame header.
+ * \param streaming Set if a MC_RpbIndexResp is streamed.
+ * \param buf Receive buffer with the frame at \c head.
+ * \param len Length of the protobuf.
+ */
+int
+_riak_decode(RiakClient *rc, RiakResponse *rv, int streaming,
+    struct _RiakBuf *buf, size_t len)
+{
+  ProtobufCAllocator *pa = _riak_response_allocator(rc, rv);
+  uint8_t *pb = buf->data + buf->head + 5;
+  int final = 1;
 
   switch (rv->mc) {
     case MC_RpbPingResp:
@@ -339,78 +1044,236 @@ _read_resp(RiakSession *rs)
     case MC_RpbSetClientIdResp:
       break;
     case MC_RpbErrorResp:
-      rv->err.resp = rpb_error_resp__unpack(rs->_rc->allocator, len, pb);
+      rv->err.resp = rpb_error_resp__unpack(pa, len, pb);
       break;
     case MC_RpbListBucketsResp:
-      rv->bl.resp = rpb_list_buckets_resp__unpack(rs->_rc->allocator,
-          len, pb);
+      rv->bl.resp = rpb_list_buckets_resp__unpack(pa, len, pb);
       break;
     case MC_RpbListKeysResp:
-      rv->kl.resp = rpb_list_keys_resp__unpack(rs->_rc->allocator,
-          len, pb);
+      rv->kl.resp = _riak_keys_list(pa, len, pb, &rv->kl.keys);
+      if (!rv->kl.resp) {
+        rv->kl.resp = rpb_list_keys_resp__unpack(pa, len, pb);
+      }
       if (!rv->kl.resp->has_done
           || (rv->kl.resp->has_done && !rv->kl.resp->done)) {
-        release_socket = 0;
+        final = 0;
       }
       break;
     case MC_RpbGetBucketResp:
-      rv->bp.resp = rpb_get_bucket_resp__unpack(rs->_rc->allocator,
-          len, pb);
+      rv->bp.resp = rpb_get_bucket_resp__unpack(pa, len, pb);
       break;
     case MC_RpbGetResp:
-      rv->g.resp = rpb_get_resp__unpack(rs->_rc->allocator, len, pb);
+      if (rc->view_min && len >= rc->view_min && !buf->fixed) {
+        rv->_hold = _riak_hold_get(rc, buf);
+        rv->g.resp = rv->_hold? _riak_view_get_resp(pa, len, pb): NULL;
+        if (rv->_hold && !rv->g.resp) {
+          _riak_hold_put(rv->_hold);
+          rv->_hold = NULL;
+        }
+      }
+      if (!rv->_hold) {
+        rv->g.resp = rpb_get_resp__unpack(pa, len, pb);
+      }
       break;
     case MC_RpbPutResp:
-      rv->p.resp = rpb_put_resp__unpack(rs->_rc->allocator, len, pb);
+      rv->p.resp = rpb_put_resp__unpack(pa, len, pb);
       break;
     case MC_RpbMapRedResp:
-      rv->mr.resp = rpb_map_red_resp__unpack(rs->_rc->allocator, len, pb);
+      rv->mr.resp = rpb_map_red_resp__unpack(pa, len, pb);
       if (!rv->mr.resp->has_done
           || (rv->mr.resp->has_done && !rv->mr.resp->done)) {
-        release_socket = 0;
+        final = 0;
       }
       break;
     case MC_RpbIndexResp:
-      rv->i.resp = rpb_index_resp__unpack(rs->_rc->allocator, len, pb);
-      if (rs->streaming
+      rv->i.resp = _riak_keys_index(pa, len, pb, &rv->i.keys);
+      if (!rv->i.resp) {
+        rv->i.resp = rpb_index_resp__unpack(pa, len, pb);
+      }
+      if (streaming
           && (!rv->i.resp->has_done
             || (rv->i.resp->has_done && !rv->i.resp->done))) {
-        release_socket = 0;
+        final = 0;
       }
       break;
     case MC_RpbSearchQueryResp:
-      rv->s.resp = rpb_search_query_resp__unpack(rs->_rc->allocator,
-          len, pb);
+      rv->s.resp = rpb_search_query_resp__unpack(pa, len, pb);
       break;
     case MC_RpbGetClientIdResp:
-      rv->gc.resp = rpb_get_client_id_resp__unpack(rs->_rc->allocator,
-          len, pb);
+      rv->gc.resp = rpb_get_client_id_resp__unpack(pa, len, pb);
       break;
     case MC_RpbGetServerInfoResp:
-      rv->si.resp = rpb_get_server_info_resp__unpack(rs->_rc->allocator,
-          len, pb);
+      rv->si.resp = rpb_get_server_info_resp__unpack(pa, len, pb);
       break;
     default:
       rv->success = 0;
-      unknown_mc(rv);
+      unknown_mc(rc, rv);
       break;
   }
 
-  if (release_socket) {
-    if (rs->server < 0) {
-      /* Dynamically allocated server. */
-      close(rs->sd);
-    } else {
-      rs->_rc->servers[rs->server].inuse = 0;
+  return final;
+}
+
+/** \brief Read a response frame using a transport's fill function.
+ *
+ * \c fill must buffer at least the given number of bytes in the
+ * connection's receive buffer, sending anything left in its send
+ * buffer first.  Returns a RiakResponse object on success or NULL on
+ * failure.
+ *
+ * \param rs RiakSession object.
+ * \param fill The transport's fill function.
+ */
+RiakResponse *
+_riak_read_resp(RiakSession *rs,
+    int (*fill)(RiakClient *, struct _RiakConn *, size_t, int))
+{
+  RiakClient *rc = rs->_rc;
+  struct _RiakBuf *rbuf;
+  RiakResponse *rv;
+  size_t len;
+  uint32_t hdr_len;
+  int release_socket = 1;  /* Default to release. */
+
+  rv = _riak_response_new(rc);
+  if (!rv) {
+    _riak_session_put(rc, rs);
+    return NULL;
+  }
+  rv->success = 1;
+  rv->_rs = rs;
+
+  /* Read header. */
+  while (fill(rc, rs->conn, 5, RIAK_ACT_READ_HDR) < 0) {
+    if (_session_retry(rc, rs) < 0) {
+      // TODO: Log out error.
+      _riak_response_del(rc, rv);
+      _riak_session_put(rc, rs);
+      return NULL;
+    }
+  }
+  rbuf = &rs->conn->rbuf;
+  if (rs->_start) {
+    /* Time to the first frame is the server's latency. */
+    _riak_lb_done(rc, rs->conn->server, rs->_start,
+        rs->_lane == RIAK_LANE_BULK? 2: 1);
+    rs->_start = 0;
+  }
+  if (rs->_mc) {
+    rs->_mc = 0;
+    if (__atomic_load_n(&rc->_retry_tokens, __ATOMIC_RELAXED)
+        < RIAK_RETRY_BUDGET) {
+      (void)__atomic_add_fetch(&rc->_retry_tokens, 1, __ATOMIC_RELAXED);
     }
   }
 
-  if (pb) {
-    rs->_rc->allocator->free(rs->_rc->allocator->allocator_data, pb);
+  /* Process header. */
+  memcpy(&hdr_len, rbuf->data + rbuf->head, 4);
+  len = ntohl(hdr_len);
+  if (len == 0) {
+    _riak_error(rc, EPROTO, RIAK_ACT_READ_PROC_HDR, 0);
+    _riak_response_del(rc, rv);
+    _riak_session_put(rc, rs);
+    return NULL;
   }
+  len -= 1;
+  rv->mc = rbuf->data[rbuf->head + 4];
+
+  /* Read body (if it exists).  The frame stays in the receive buffer
+   * while it is unpacked. */
+  if (fill(rc, rs->conn, 5 + len, RIAK_ACT_READ_PB) < 0) {
+    _riak_response_del(rc, rv);
+    _riak_session_put(rc, rs);
+    return NULL;
+  }
+
+  release_socket = _riak_decode(rc, rv, rs->streaming, rbuf, len);
+
+  /* Consume the frame. */
+  rbuf->head += 5 + len;
+  if (rbuf->head == rbuf->tail) {
+    _riak_buf_empty(rbuf);
+  }
+
+  if (release_socket) {
+    _session_unbulk(rc, rs);
+    _riak_pool_put(rc, rs->conn);
+    rs->conn = NULL;
+    if (rs->_admitted) {
+      /* Answered; it no longer counts against the limits. */
+      _riak_admit_done(rc);
+      rs->_admitted = 0;
+    }
+  }
+
   return rv;
 }
 
+/** \brief Read a response from the Riak server.
+ *
+ * Returns a RiakResponse object on success or NULL on failure.
+ *
+ * \param rs RiakSession object.
+ */
+static RiakResponse *
+_read_resp(RiakSession *rs)
+{
+  return _riak_read_resp(rs, &_conn_fill);
+}
+
+
+/** \brief Configure retries and reconnects.
+ *
+ * Requests that are safe to repeat (gets, lists, pings and the like)
+ * are retried up to \c retries times if their connection fails before
+ * any of the response arrives, on another server where there is one.
+ * Retries are also limited to about a tenth of the requests answered.
+ * After a failed connect a server is not reconnected to for a while,
+ * doubling each time up to \c backoff_ms.
+ *
+ * \param rc Riak client object.
+ * \param retries Retries per request; 0 for none.
+ * \param backoff_ms Longest wait before reconnecting to a server.
+ */
+void
+riak_retry_config(RiakClient *rc, int retries, int backoff_ms)
+{
+  rc->retries = retries;
+  rc->backoff_ms = backoff_ms;
+}
+
+/** \brief Configure hedged gets.
+ *
+ * A get that a server has not started to answer by the time
+ * \c percentile percent of its recent requests had is sent to a second
+ * server too, and the first answer used.  This trades a few percent
+ * more requests for less of a tail.  Only for the socket transport.
+ *
+ * \param rc Riak client object.
+ * \param percentile Percentile to hedge at, such as 95; 0 to not hedge.
+ */
+void
+riak_hedge_config(RiakClient *rc, int percentile)
+{
+  rc->hedge_pct = percentile < 100? percentile: 99;
+}
+
+/** \brief Set the default request timeout.
+ *
+ * Applies to requests that do not carry a \c timeout of their own.
+ * Get, put, delete, list keys and index requests send it to the
+ * server too, so it stops work the client has given up on.  A
+ * request out of time fails with ETIMEDOUT and RIAK_ACT_TIMEOUT, and
+ * its connection is closed.
+ *
+ * \param rc Riak client object.
+ * \param timeout_ms Time allowed per request; 0 for no limit.
+ */
+void
+riak_timeout_config(RiakClient *rc, int timeout_ms)
+{
+  rc->timeout_ms = timeout_ms;
+}
 
 /** \brief Create RiakClient object.
  *
@@ -426,7 +1289,6 @@ RiakClient *
 riak_client_init(ProtobufCAllocator *allocator, int max_servers)
 {
   RiakClient *rc;
-  int i;
 
   assert(max_servers > 0);
 
@@ -449,9 +1311,6 @@ riak_client_init(ProtobufCAllocator *allocator, int max_servers)
   }
   memset(rc->servers, 0, sizeof(struct _RiakServer) * max_servers);
   rc->n_servers = max_servers;
-  for (i = 0; i < rc->n_servers; i++) {
-    rc->servers[i].sd = -1;
-  }
 
   /* Assign functions. */
   rc->_write = &_write_req;
@@ -459,18 +1318,106 @@ riak_client_init(ProtobufCAllocator *allocator, int max_servers)
 
   /* Assign initial accounting data. */
   rc->current = -1;
-  rc->last_errno = 0;
-  rc->last_erract = 0;
-  rc->last_errbytes = 0;
+  rc->_threaded = 0;
+  _riak_error(rc, 0, 0, 0);
+  rc->pool_min = RIAK_POOL_MIN;
+  rc->pool_max = RIAK_POOL_MAX;
+  rc->pool_idle_ms = RIAK_POOL_IDLE_MS;
+  rc->pool_life_ms = RIAK_POOL_LIFE_MS;
+  rc->pool_lazy = 0;
+  rc->dns_ttl_ms = RIAK_DNS_TTL_MS;
+  rc->breaker_fails = RIAK_BREAKER_FAILS;
+  rc->breaker_ms = RIAK_BREAKER_MS;
+  rc->retries = RIAK_RETRIES;
+  rc->backoff_ms = RIAK_BACKOFF_MAX_MS;
+  rc->_retry_tokens = RIAK_RETRY_BUDGET;
+  rc->hedge_pct = 0;
+  rc->timeout_ms = 0;
+  rc->keepalive_ms = 0;
+  rc->limit_rate = rc->limit_burst = rc->limit_in_flight = 0;
+  rc->limit_block = 0;
+  rc->node_rate = rc->node_burst = rc->node_in_flight = 0;
+  rc->lane_bulk = 0;
+  rc->adapt_min = rc->adapt_max = 0;
+  rc->_limit_tat = 0;
+  rc->_in_flight = 0;
+  rc->_keepalive = NULL;
+  rc->_sessions = NULL;
+  rc->arena_size = 0;
+  rc->arena_keep = 0;
+  rc->_arenas = NULL;
+  rc->_n_arenas = 0;
+  rc->_arena_lock = 0;
+  rc->view_min = 0;
+  rc->_async = NULL;
+  rc->_uring = NULL;
 
   return rc;
 }
 
+/** \brief Allow a client to be shared between threads.
+ *
+ * Afterwards the synchronous API may be called from any number of
+ * threads at once.  Connections are checked out of the pools without
+ * locks and errors are kept per thread, so read them with
+ * riak_last_error() rather than the "last_*" members.  Servers and
+ * pool settings must be configured first, the allocator must be
+ * thread safe, and the asynchronous engine may still be driven by
+ * only one thread.  The io_uring transport cannot be shared.
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param rc Riak client object.
+ */
+int
+riak_client_threadsafe(RiakClient *rc)
+{
+  RiakSession *rs;
+
+  if (rc->_uring) {
+    _riak_error(rc, EINVAL, RIAK_ACT_CONNECT, 0);
+    return -1;
+  }
+  while (rc->_sessions) {
+    rs = rc->_sessions;
+    rc->_sessions = rs->_next;
+    rc->allocator->free(rc->allocator->allocator_data, rs);
+  }
+  rc->_threaded = 1;
+  return 0;
+}
+
+/** \brief Create RiakClient object with a given transport.
+ *
+ * RIAK_TRANSPORT_SOCKET gives the same client as riak_client_init().
+ * RIAK_TRANSPORT_URING does the synchronous API's I/O with io_uring;
+ * see uring.c.  Returns NULL if the transport cannot be set up, for
+ * instance on kernels without io_uring.
+ *
+ * \param allocator An allocator. If set to NULL, uses the default
+ *                  allocator.
+ * \param max_servers Maximum number of Riak servers to add.
+ * \param transport RIAK_TRANSPORT_SOCKET or RIAK_TRANSPORT_URING.
+ */
+RiakClient *
+riak_client_init_transport(ProtobufCAllocator *allocator, int max_servers,
+    int transport)
+{
+  RiakClient *rc;
+
+  rc = riak_client_init(allocator, max_servers);
+  if (rc && transport == RIAK_TRANSPORT_URING && _riak_uring_init(rc) < 0) {
+    riak_servers_disconnect(rc);
+    return NULL;
+  }
+  return rc;
+}
+
 
 /** \brief Add and connect to a server given by host/port.
  *
- * Returns number of servers added.  It would be 1 for success, 0 for
- * failure.
+ * Opens the server's minimum number of pooled connections (see
+ * riak_pool_config()), unless riak_pool_lazy() is set.  Returns number
+ * of servers added.  It would be 1 for success, 0 for failure.
  *
  * \param rc Riak client structure. This is also freed.
  * \param host Host to connect to.
@@ -479,10 +1426,12 @@ riak_client_init(ProtobufCAllocator *allocator, int max_servers)
 int
 riak_server_add(RiakClient *rc, char *host, char *port)
 {
-  int i;
+  int i, warm, added = 0;
 
-  for (i = 0; i < rc->n_servers; i++) {
-    if (!rc->servers[i].host) {
+  /* The keep-warm thread must not see a half set up server. */
+  warm = _riak_keepalive_stop(rc);
+  for (i = 0; i < rc->n_servers && !added; i++) {
+    if (!rc->servers[i].host && rc->servers[i].n_conns == 0) {
       rc->servers[i].host = strdup(host);
       rc->servers[i].port = strdup(port);
       if (!rc->servers[i].host || !rc->servers[i].port) {
@@ -490,16 +1439,31 @@ riak_server_add(RiakClient *rc, char *host, char *port)
         free(rc->servers[i].port);
         rc->servers[i].host = NULL;
         rc->servers[i].port = NULL;
+      } else if (_riak_pool_init(rc, i) < 0) {
+        free(rc->servers[i].host);
+        free(rc->servers[i].port);
+        rc->servers[i].host = NULL;
+        rc->servers[i].port = NULL;
       } else {
-        rc->servers[i].sd = connect_to_host(host, port);
-        rc->servers[i].inuse = 0;
+        rc->servers[i].lat_us = 0;
+        rc->servers[i].lat_time = 0;
+        memset(rc->servers[i].lat_hist, 0, sizeof(rc->servers[i].lat_hist));
+        rc->servers[i].adapt_limit = 0;
+        rc->servers[i].adapt_lat_us = 0;
+        _riak_breaker_drop(rc, i);
+        if (!rc->pool_lazy) {
+          (void)_riak_pool_fill(rc, i);
+        }
         rc->current = i;
-        return 1;
+        added = 1;
       }
     }
   }
+  if (warm) {
+    (void)_riak_keepalive_start(rc);
+  }
 
-  return 0;
+  return added;
 }
 
 
@@ -515,9 +1479,10 @@ riak_server_add(RiakClient *rc, char *host, char *port)
 int
 riak_server_del(RiakClient *rc, char *host, char *port)
 {
-  int i, j;
+  int i, j, warm, deleted = 0;
 
-  for (i = 0; i < rc->n_servers; i++) {
+  warm = _riak_keepalive_stop(rc);
+  for (i = 0; i < rc->n_servers && !deleted; i++) {
     if (rc->servers[i].host) {
       if ((strcmp(host, rc->servers[i].host) == 0)
           && (strcmp(port, rc->servers[i].port) == 0)) {
@@ -526,14 +1491,19 @@ riak_server_del(RiakClient *rc, char *host, char *port)
         free(rc->servers[i].port);
         rc->servers[i].host = NULL;
         rc->servers[i].port = NULL;
-        rc->servers[i].sd = -1;
-        rc->servers[i].inuse = 0;
-        return 1;
+        /* Connections in use are closed as they are checked in. */
+        _riak_pool_close(rc, i, 0);
+        _riak_dns_drop(rc, i);
+        _riak_breaker_drop(rc, i);
+        deleted = 1;
       }
     }
   }
+  if (warm) {
+    (void)_riak_keepalive_start(rc);
+  }
 
-  return 0;
+  return deleted;
 }
 
 /** \brief Returns the number of currently known servers.
@@ -563,7 +1533,7 @@ riak_servers_active(RiakClient *rc)
   int i, server_ct = 0;
 
   for (i = 0; i < rc->n_servers; i++) {
-    if (rc->servers[i].sd >= 0) {
+    if (rc->servers[i].n_conns > 0) {
       server_ct++;
     }
   }
@@ -578,17 +1548,32 @@ void
 riak_servers_disconnect(RiakClient *rc)
 {
   int i;
+  RiakSession *rs;
 
+  (void)_riak_keepalive_stop(rc);
+  if (rc->_async) {
+    _riak_async_free(rc);
+  }
   for (i = 0; i < rc->n_servers; i++) {
     if (rc->servers[i].host) {
       /* This is not a deleted server - delete it. */
-      rc->allocator->free(rc->allocator->allocator_data, rc->servers[i].host);
-      rc->allocator->free(rc->allocator->allocator_data, rc->servers[i].port);
-      if (rc->servers[i].sd >= 0) {
-        close(rc->servers[i].sd);
-      }
+      free(rc->servers[i].host);
+      free(rc->servers[i].port);
     }
+    _riak_pool_close(rc, i, 1);
+    _riak_dns_drop(rc, i);
+    _riak_breaker_drop(rc, i);
   }
+  if (rc->_uring) {
+    _riak_uring_free(rc);
+  }
+  while (rc->_sessions) {
+    rs = rc->_sessions;
+    rc->_sessions = rs->_next;
+    rc->allocator->free(rc->allocator->allocator_data, rs);
+  }
+  _riak_arena_free(rc);
+  rc->allocator->free(rc->allocator->allocator_data, rc->servers);
   rc->allocator->free(rc->allocator->allocator_data, rc);
 }
 
@@ -605,13 +1590,32 @@ riak_servers_disconnect(RiakClient *rc)
 void
 riak_response_only_free(RiakClient *rc, RiakResponse *rv)
 {
-  rc->last_errno = 0;
+  _riak_error(rc, 0, 0, 0);
+  if (rv->_hold) {
+    /* A view; its bytes belong to the receive buffer. */
+    if (!rv->_arena) {
+      _riak_view_free(rc->allocator, rv->g.resp);
+    }
+    _riak_hold_put(rv->_hold);
+    _riak_response_del(rc, rv);
+    return;
+  }
+  if (rv->_arena) {
+    /* Everything unpacked went into the arena. */
+    _riak_response_del(rc, rv);
+    return;
+  }
   switch (rv->mc) {
     case MC_RpbListBucketsResp:
       rpb_list_buckets_resp__free_unpacked(rv->bl.resp, rc->allocator);
       break;
     case MC_RpbListKeysResp:
-      rpb_list_keys_resp__free_unpacked(rv->kl.resp, rc->allocator);
+      if (rv->kl.keys.off) {
+        /* Decoded into one block; see keys.c. */
+        rc->allocator->free(rc->allocator->allocator_data, rv->kl.resp);
+      } else {
+        rpb_list_keys_resp__free_unpacked(rv->kl.resp, rc->allocator);
+      }
       break;
     case MC_RpbGetClientIdResp:
       rpb_get_client_id_resp__free_unpacked(rv->gc.resp, rc->allocator);
@@ -635,7 +1639,11 @@ riak_response_only_free(RiakClient *rc, RiakResponse *rv)
       rpb_map_red_resp__free_unpacked(rv->mr.resp, rc->allocator);
       break;
     case MC_RpbIndexResp:
-      rpb_index_resp__free_unpacked(rv->i.resp, rc->allocator);
+      if (rv->i.keys.off) {
+        rc->allocator->free(rc->allocator->allocator_data, rv->i.resp);
+      } else {
+        rpb_index_resp__free_unpacked(rv->i.resp, rc->allocator);
+      }
       break;
     case MC_RpbSearchQueryResp:
       rpb_search_query_resp__free_unpacked(rv->s.resp, rc->allocator);
@@ -650,11 +1658,10 @@ riak_response_only_free(RiakClient *rc, RiakResponse *rv)
       /* Nothing to free here. */
       break;
     default:
-      rc->last_errno = -1;
-      rc->last_erract = RIAK_ACT_FREE;
+      _riak_error(rc, -1, RIAK_ACT_FREE, 0);
       break;
   }
-  rc->allocator->free(rc->allocator->allocator_data, rv);
+  _riak_response_del(rc, rv);
 }
 
 /** \brief Frees the memory allocated for the RiakResponse.
@@ -669,6 +1676,8 @@ void
 riak_response_free(RiakClient *rc, RiakResponse *rv)
 {
   // TODO: Make sure session is finished here.
-  rc->allocator->free(rc->allocator->allocator_data, rv->_rs);
+  if (rv->_rs) {
+    _riak_session_put(rc, rv->_rs);
+  }
   riak_response_only_free(rc, rv);
 }
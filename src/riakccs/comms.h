@@ -0,0 +1,198 @@
+#ifndef RIAK_COMMS_H
+#define RIAK_COMMS_H
+
+#include "riakccs/api.h"
+
+/* Transport internals shared between the library's modules. */
+
+/** Initial size of a connection's receive buffer. */
+#define RIAK_RBUF_MIN 16384
+
+/* States of a pool slot. */
+#define RIAK_CONN_FREE 0
+#define RIAK_CONN_IDLE 1
+#define RIAK_CONN_BUSY 2
+
+/** Default time looked up addresses are kept (ms). */
+#define RIAK_DNS_TTL_MS 60000
+/** Default failures in a row that eject a server. */
+#define RIAK_BREAKER_FAILS 5
+/** Default time between probes of an ejected server (ms). */
+#define RIAK_BREAKER_MS 1000
+/** How long a probe or keep-warm ping waits for an answer (ms). */
+#define RIAK_PROBE_TIMEOUT_MS 1000
+/** Default retries per idempotent request. */
+#define RIAK_RETRIES 2
+/** Retry budget tokens a retry costs; answered requests earn one. */
+#define RIAK_RETRY_COST 10
+/** Most retry budget tokens saved up. */
+#define RIAK_RETRY_BUDGET 100
+/** First wait before reconnecting to a server (ms). */
+#define RIAK_BACKOFF_MIN_MS 50
+/** Default longest wait before reconnecting to a server (ms). */
+#define RIAK_BACKOFF_MAX_MS 5000
+/** How long to wait before looking again for room in flight (us). */
+#define RIAK_LIMIT_WAIT_US 1000
+/** Passed to _riak_limit_wait() when waiting would not make room. */
+#define RIAK_LIMIT_NEVER UINT64_MAX
+/** Alignment of allocations from a response arena. */
+#define RIAK_ARENA_ALIGN 16
+/** Weight of a sample in the long run latency: 1/2^RIAK_ADAPT_SHIFT. */
+#define RIAK_ADAPT_SHIFT 7
+/** Latency rise, in quarters, tolerated before the limit comes down. */
+#define RIAK_ADAPT_TOLERANCE 6
+/* Protobuf wire types. */
+#define RIAK_WIRE_VARINT 0
+#define RIAK_WIRE_64BIT 1
+#define RIAK_WIRE_BYTES 2
+#define RIAK_WIRE_32BIT 5
+/** Default number of connections kept open per server. */
+#define RIAK_POOL_MIN 1
+/** Default connection limit per server. */
+#define RIAK_POOL_MAX 8
+/** Default idle time (ms) before surplus connections are closed. */
+#define RIAK_POOL_IDLE_MS 60000
+/** Default connection lifetime (ms); 0 for no limit. */
+#define RIAK_POOL_LIFE_MS 0
+
+/** \brief An asynchronous request.
+ *
+ * While no connection is free the framed request is kept in \c req.
+ */
+struct _RiakOp {
+  uint8_t mc;              ///< Message code of the request.
+  int streaming;           ///< Set if the response may span frames.
+  RiakCallback cb;         ///< Completion callback.
+  void *data;              ///< Callback data.
+  uint64_t start;          ///< When the request was sent (us); or 0.
+  int lane;                ///< RIAK_LANE_INTERACTIVE or RIAK_LANE_BULK.
+  uint64_t deadline;       ///< When the request times out (ms); or 0.
+  struct _RiakBuf req;     ///< Framed request while queued.
+  struct _RiakOp *next;    ///< Next request in a list.
+};
+
+/** \brief State of the asynchronous request engine. */
+struct _RiakAsync {
+  int epfd;                ///< The epoll descriptor.
+  int max_conns;           ///< Connection limit per server.
+  int depth;               ///< Requests allowed in flight per connection.
+  int batch_left;          ///< Outstanding requests of a bulk operation.
+  uint64_t due;            ///< No request times out before this (ms); or 0.
+  int *n_conns;            ///< Connections in use per server.
+  int n_pending;           ///< Submitted requests not yet completed.
+  struct _RiakConn *dead;  ///< Failed connections to be freed.
+  struct _RiakOp *queue;   ///< Requests waiting for a connection.
+  struct _RiakOp *queue_tail;  ///< Last request in \c queue.
+  struct _RiakOp *free_ops;    ///< Recycled requests.
+};
+
+/** \brief A protobuf field read off the wire. */
+struct _RiakField {
+  uint32_t id;             ///< Field number.
+  int type;                ///< Wire type.
+  uint64_t v;              ///< Value of a varint field.
+  ProtobufCBinaryData bytes;  ///< Value of a length delimited field.
+};
+
+/** \brief A receive buffer shared with the responses viewing it.
+ *
+ * Counts the responses pointing into \c data, plus one while the
+ * connection still reads into it.
+ */
+struct _RiakHold {
+  int refs;                ///< References to the buffer.
+  uint8_t *data;           ///< The buffer memory.
+  ProtobufCAllocator *allocator;  ///< Allocator the memory came from.
+};
+
+extern void _riak_error(RiakClient *rc, int err, int act, ssize_t bytes);
+extern int _riak_buf_reserve(RiakClient *rc, struct _RiakBuf *buf,
+    size_t len);
+extern void _riak_buf_free(RiakClient *rc, struct _RiakBuf *buf);
+extern void _riak_buf_empty(struct _RiakBuf *buf);
+extern int _riak_connect_server(RiakClient *rc, int server, int wait,
+    uint64_t deadline);
+extern void _riak_dns_drop(RiakClient *rc, int server);
+extern int _riak_connect_host(char *host, char *port);
+extern int _riak_conn_wait(RiakClient *rc, struct _RiakConn *conn,
+    short events, int act);
+extern size_t _riak_frame(RiakClient *rc, struct _RiakBuf *buf,
+    uint8_t mc, const ProtobufCMessage *msg);
+extern size_t _riak_pack_size(uint8_t mc, const ProtobufCMessage *msg,
+    size_t *aux);
+extern size_t _riak_pack(uint8_t mc, const ProtobufCMessage *msg,
+    size_t aux, uint8_t *out);
+extern RiakSession *_riak_session_open(RiakClient *rc, RiakResponse *rv,
+    uint8_t mc, const ProtobufCMessage *msg);
+extern void _riak_session_put(RiakClient *rc, RiakSession *rs);
+extern RiakSession *_riak_hedge_req(RiakClient *rc, uint8_t mc,
+    const ProtobufCMessage *msg);
+extern RiakResponse *_riak_read_resp(RiakSession *rs,
+    int (*fill)(RiakClient *, struct _RiakConn *, size_t, int));
+extern int _riak_decode(RiakClient *rc, RiakResponse *rv, int streaming,
+    struct _RiakBuf *buf, size_t len);
+extern void _riak_async_free(RiakClient *rc);
+extern int _riak_async_due(RiakClient *rc);
+
+extern int _riak_uring_init(RiakClient *rc);
+extern void _riak_uring_put_buf(RiakClient *rc, struct _RiakBuf *buf);
+extern void _riak_uring_free(RiakClient *rc);
+
+extern uint64_t _riak_now_ms(void);
+extern uint64_t _riak_now_us(void);
+extern uint32_t _riak_random(void);
+extern void _riak_backoff(RiakClient *rc, int server);
+extern int _riak_lb_pick(RiakClient *rc);
+extern uint64_t _riak_lb_start(RiakClient *rc, int server);
+extern void _riak_lb_done(RiakClient *rc, int server, uint64_t start,
+    int ok);
+extern uint64_t _riak_lb_quantile(RiakClient *rc, int server, int pct);
+extern void _riak_lb_rtt(RiakClient *rc, int server, uint64_t rtt);
+extern int _riak_ping_fd(int sd, int timeout_ms);
+extern int _riak_server_up(RiakClient *rc, int server);
+extern void _riak_breaker_fail(RiakClient *rc, int server);
+extern void _riak_breaker_drop(RiakClient *rc, int server);
+extern struct _RiakConn *_riak_pool_get(RiakClient *rc, int server,
+    int open, uint64_t deadline);
+extern void _riak_pool_put(RiakClient *rc, struct _RiakConn *conn);
+extern struct _RiakConn *_riak_pool_claim(RiakClient *rc, int server);
+extern int _riak_pool_init(RiakClient *rc, int server);
+extern int _riak_pool_fill(RiakClient *rc, int server);
+extern int _riak_keepalive_stop(RiakClient *rc);
+extern int _riak_limit_wait(RiakClient *rc, uint64_t wait,
+    uint64_t deadline);
+extern int _riak_admit(RiakClient *rc, uint64_t deadline);
+extern uint64_t _riak_limit_rate(RiakClient *rc);
+extern void _riak_admit_done(RiakClient *rc);
+extern uint64_t _riak_node_admit(RiakClient *rc, int server);
+extern int _riak_node_full(RiakClient *rc, int server);
+extern void _riak_adapt(RiakClient *rc, int server, int ok);
+extern int _riak_lane(uint8_t mc);
+extern uint64_t _riak_lane_admit(RiakClient *rc, int server);
+extern uint32_t _riak_req_timeout(RiakClient *rc, uint8_t mc,
+    const ProtobufCMessage *msg);
+extern int _riak_keepalive_start(RiakClient *rc);
+extern RiakResponse *_riak_response_new(RiakClient *rc);
+extern ProtobufCAllocator *_riak_response_allocator(RiakClient *rc,
+    RiakResponse *rv);
+extern void _riak_response_del(RiakClient *rc, RiakResponse *rv);
+extern void _riak_arena_free(RiakClient *rc);
+extern RpbGetResp *_riak_view_get_resp(ProtobufCAllocator *pa, size_t len,
+    uint8_t *pb);
+extern void _riak_view_free(ProtobufCAllocator *pa, RpbGetResp *resp);
+extern int _riak_wire_field(const uint8_t **p, const uint8_t *end,
+    struct _RiakField *f);
+extern int _riak_wire_pair(ProtobufCBinaryData *msg, RpbPair *pair);
+extern RpbListKeysResp *_riak_keys_list(ProtobufCAllocator *pa, size_t len,
+    const uint8_t *pb, RiakKeys *keys);
+extern RpbIndexResp *_riak_keys_index(ProtobufCAllocator *pa, size_t len,
+    const uint8_t *pb, RiakKeys *keys);
+extern struct _RiakHold *_riak_hold_get(RiakClient *rc,
+    struct _RiakBuf *buf);
+extern void _riak_hold_put(struct _RiakHold *hold);
+extern void _riak_pool_reap(RiakClient *rc);
+extern int _riak_pool_timeout(RiakClient *rc);
+extern void _riak_pool_close(RiakClient *rc, int server, int all);
+extern int _riak_conn_connected(struct _RiakConn *conn);
+
+#endif /* RIAK_COMMS_H */
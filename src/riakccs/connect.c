@@ -0,0 +1,775 @@
+/** \file
+ *
+ * \brief Name resolution and connection setup.
+ *
+ * Each server's addresses are cached for \c rc->dns_ttl_ms.  Once the
+ * time is up the cached addresses go on being used while a fresh
+ * lookup runs in the background, so only a server's first connection
+ * waits for DNS.
+ *
+ * Connects race the addresses Happy Eyeballs style (RFC 8305): the
+ * families are interleaved and the next address is tried alongside
+ * the earlier ones whenever a connect fails or has not completed
+ * within RIAK_EYEBALLS_DELAY_MS.  The first to complete wins.
+ *
+ * riak_servers_warmup() opens every server's pooled connections at
+ * once rather than one server after another.  Name lookups block, so
+ * each runs on a short lived thread of its own; connects are
+ * non-blocking and share one poll().  Everything is bounded by a
+ * single deadline.  Servers that are not ready by then are left to
+ * connect on first use.
+ *
+ * A lookup that outlives the deadline is abandoned rather than
+ * cancelled: it is reference counted and freed by whichever of the
+ * warm-up and its thread finishes with it last.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif /* S_SPLINT_S */
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** How often to look for finished lookups while some are running (ms). */
+#define RIAK_WARMUP_SLICE_MS 5
+/** Head start each address gets before the next is tried (ms). */
+#define RIAK_EYEBALLS_DELAY_MS 250
+/** Most addresses raced per connect. */
+#define RIAK_EYEBALLS_MAX 8
+
+/** \brief A name lookup running on its own thread. */
+struct _RiakLookup {
+  char *host;               ///< Host to look up.
+  char *port;               ///< Port to look up.
+  struct addrinfo *result;  ///< Addresses found.
+  int err;                  ///< getaddrinfo() result.
+  int done;                 ///< Set once the lookup has run.
+  int refs;                 ///< Owners: the warm-up and the thread.
+};
+
+/** \brief A connection being opened. */
+struct _RiakAttempt {
+  struct _RiakConn *conn;   ///< Slot being connected; NULL once done.
+  struct addrinfo *addr;    ///< Address being tried.
+};
+
+/** \brief Drop a reference to a lookup, freeing it with the last.
+ *
+ * \param lu The lookup.
+ */
+static void
+_lookup_unref(struct _RiakLookup *lu)
+{
+  if (__atomic_sub_fetch(&lu->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (lu->result) {
+      freeaddrinfo(lu->result);
+    }
+    free(lu->host);
+    free(lu->port);
+    free(lu);
+  }
+}
+
+/** \brief Make a lookup that has not been run.
+ *
+ * Returns NULL if out of memory.
+ *
+ * \param host Host to look up.
+ * \param port Port to look up.
+ */
+static struct _RiakLookup *
+_lookup_new(char *host, char *port)
+{
+  struct _RiakLookup *lu;
+
+  lu = malloc(sizeof(*lu));
+  if (!lu) {
+    return NULL;
+  }
+  memset(lu, 0, sizeof(*lu));
+  lu->host = strdup(host);
+  lu->port = strdup(port);
+  if (!lu->host || !lu->port) {
+    free(lu->host);
+    free(lu->port);
+    free(lu);
+    return NULL;
+  }
+  lu->refs = 1;
+  return lu;
+}
+
+/** \brief Run a lookup.
+ *
+ * \param lu The lookup.
+ */
+static void
+_lookup_run(struct _RiakLookup *lu)
+{
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  lu->err = getaddrinfo(lu->host, lu->port, &hints, &lu->result);
+  if (lu->err != 0) {
+    lu->result = NULL;
+  }
+  __atomic_store_n(&lu->done, 1, __ATOMIC_RELEASE);
+}
+
+/** \brief Thread body for a lookup.
+ *
+ * \param arg The lookup.
+ */
+static void *
+_lookup_main(void *arg)
+{
+  struct _RiakLookup *lu = arg;
+
+  _lookup_run(lu);
+  _lookup_unref(lu);
+  return NULL;
+}
+
+/** \brief Start looking up a server's address.
+ *
+ * The lookup runs on a detached thread, or inline if no thread can be
+ * started.  Returns NULL if out of memory.
+ *
+ * \param host Host to look up.
+ * \param port Port to look up.
+ */
+static struct _RiakLookup *
+_lookup_start(char *host, char *port)
+{
+  struct _RiakLookup *lu;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int started = 0;
+
+  lu = _lookup_new(host, port);
+  if (!lu) {
+    return NULL;
+  }
+  lu->refs = 2;
+  if (pthread_attr_init(&attr) == 0) {
+    (void)pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, _lookup_main, lu) == 0;
+    pthread_attr_destroy(&attr);
+  }
+  if (!started) {
+    (void)_lookup_main(lu);
+  }
+  return lu;
+}
+
+/** \brief Take a server's address cache lock.
+ *
+ * Only held to swap the cache entries, never across a lookup.
+ *
+ * \param srv The server.
+ */
+static void
+_dns_lock(struct _RiakServer *srv)
+{
+  while (__atomic_test_and_set(&srv->dns_lock, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+/** \brief Release a server's address cache lock.
+ *
+ * \param srv The server.
+ */
+static void
+_dns_unlock(struct _RiakServer *srv)
+{
+  __atomic_clear(&srv->dns_lock, __ATOMIC_RELEASE);
+}
+
+/** \brief Get a server's cached addresses.
+ *
+ * Picks up a finished background refresh, and starts one if the
+ * addresses are older than the TTL.  Returns a reference to the
+ * addresses, to be dropped with _lookup_unref(), or NULL if none are
+ * cached.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+static struct _RiakLookup *
+_dns_get(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakLookup *lu, *old = NULL;
+  uint64_t now = _riak_now_ms();
+
+  _dns_lock(srv);
+  if (srv->dns_refresh
+      && __atomic_load_n(&srv->dns_refresh->done, __ATOMIC_ACQUIRE)) {
+    if (srv->dns_refresh->err == 0) {
+      old = srv->dns;
+      srv->dns = srv->dns_refresh;
+    } else {
+      /* Keep the old addresses; try again after another TTL. */
+      old = srv->dns_refresh;
+    }
+    srv->dns_refresh = NULL;
+    srv->dns_time = now;
+  }
+  lu = srv->dns;
+  if (lu && !srv->dns_refresh
+      && now - srv->dns_time >= (uint64_t)rc->dns_ttl_ms) {
+    srv->dns_refresh = _lookup_start(srv->host, srv->port);
+  }
+  if (lu) {
+    (void)__atomic_add_fetch(&lu->refs, 1, __ATOMIC_RELAXED);
+  }
+  _dns_unlock(srv);
+  if (old) {
+    _lookup_unref(old);
+  }
+  return lu;
+}
+
+/** \brief Cache a server's addresses.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param lu A successful lookup for the server.
+ */
+static void
+_dns_put(RiakClient *rc, int server, struct _RiakLookup *lu)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakLookup *old = NULL;
+
+  if (rc->dns_ttl_ms <= 0) {
+    return;
+  }
+  _dns_lock(srv);
+  if (srv->dns != lu) {
+    old = srv->dns;
+    (void)__atomic_add_fetch(&lu->refs, 1, __ATOMIC_RELAXED);
+    srv->dns = lu;
+    srv->dns_time = _riak_now_ms();
+  }
+  _dns_unlock(srv);
+  if (old) {
+    _lookup_unref(old);
+  }
+}
+
+/** \brief Forget a server's cached addresses.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+void
+_riak_dns_drop(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+
+  _dns_lock(srv);
+  if (srv->dns) {
+    _lookup_unref(srv->dns);
+  }
+  if (srv->dns_refresh) {
+    _lookup_unref(srv->dns_refresh);
+  }
+  srv->dns = srv->dns_refresh = NULL;
+  _dns_unlock(srv);
+}
+
+/** \brief Start a non-blocking connect to an address.
+ *
+ * Returns the socket, or -1 with errno set if the connect failed
+ * outright.
+ *
+ * \param ai The address.
+ */
+static int
+_addr_connect(struct addrinfo *ai)
+{
+  int sd, err, one = 1;
+
+  sd = socket(ai->ai_family, SOCK_STREAM, 0);
+  if (sd < 0) {
+    return -1;
+  }
+  (void)fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+  if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0
+      || errno == EINPROGRESS) {
+    /* Requests go out in one write, so don't let Nagle hold them. */
+    (void)setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sd;
+  }
+  err = errno;
+  close(sd);
+  errno = err;
+  return -1;
+}
+
+/** \brief Order addresses for racing.
+ *
+ * Alternates address families, starting with the resolver's first
+ * choice.  Returns the number of addresses put in \c addrs.
+ *
+ * \param list Addresses from getaddrinfo().
+ * \param addrs Filled with the addresses in the order to try them.
+ * \param max Size of \c addrs.
+ */
+static int
+_eyeballs_order(struct addrinfo *list, struct addrinfo **addrs, int max)
+{
+  struct addrinfo *first = list, *other = list;
+  int n = 0;
+
+  if (!list) {
+    return 0;
+  }
+  while (n < max && (first || other)) {
+    while (first && first->ai_family != list->ai_family) {
+      first = first->ai_next;
+    }
+    if (first && n < max) {
+      addrs[n++] = first;
+      first = first->ai_next;
+    }
+    while (other && other->ai_family == list->ai_family) {
+      other = other->ai_next;
+    }
+    if (other && n < max) {
+      addrs[n++] = other;
+      other = other->ai_next;
+    }
+  }
+  return n;
+}
+
+/** \brief Connect to the first of a set of addresses to answer.
+ *
+ * Returns a connected, non-blocking socket, or -1 with errno set
+ * (ETIMEDOUT once the deadline has passed).
+ *
+ * \param list Addresses from getaddrinfo().
+ * \param deadline When to give up (ms); 0 to never.
+ */
+static int
+_eyeballs(struct addrinfo *list, uint64_t deadline)
+{
+  struct addrinfo *addrs[RIAK_EYEBALLS_MAX];
+  struct pollfd pfd[RIAK_EYEBALLS_MAX];
+  socklen_t len;
+  int i, n, r, wait, next = 0, live = 0, start = 1, sd = -1;
+  int err = EHOSTUNREACH, soerr;
+  int64_t left;
+
+  n = _eyeballs_order(list, addrs, RIAK_EYEBALLS_MAX);
+  while (sd < 0) {
+    while (start && next < n) {
+      pfd[live].fd = _addr_connect(addrs[next++]);
+      if (pfd[live].fd >= 0) {
+        pfd[live].events = POLLOUT;
+        pfd[live].revents = 0;
+        live++;
+        break;
+      }
+      err = errno;
+    }
+    if (live == 0) {
+      break;
+    }
+    wait = next < n? RIAK_EYEBALLS_DELAY_MS: -1;
+    if (deadline) {
+      left = (int64_t)(deadline - _riak_now_ms());
+      if (left <= 0) {
+        err = ETIMEDOUT;
+        break;
+      } else if (wait < 0 || left < wait) {
+        wait = (int)left;
+      }
+    }
+    r = poll(pfd, live, wait);
+    if (r < 0 && errno != EINTR) {
+      err = errno;
+      break;
+    }
+    /* Give the next address a go if nothing has answered yet. */
+    start = r == 0;
+    for (i = 0; r > 0 && i < live; i++) {
+      if (!pfd[i].revents) {
+        continue;
+      }
+      len = sizeof(soerr);
+      if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == 0
+          && soerr == 0) {
+        sd = pfd[i].fd;
+        pfd[i].fd = -1;
+        break;
+      }
+      err = soerr? soerr: errno;
+      close(pfd[i].fd);
+      pfd[i--] = pfd[--live];
+      start = 1;
+    }
+  }
+  for (i = 0; i < live; i++) {
+    if (pfd[i].fd >= 0) {
+      close(pfd[i].fd);
+    }
+  }
+  if (sd < 0) {
+    errno = err;
+  }
+  return sd;
+}
+
+/** \brief Connect to a server.
+ *
+ * Uses the server's cached addresses, looking them up only if none
+ * are cached.  With \c wait set the addresses are raced and a
+ * connected, blocking socket is returned.  Otherwise the socket is
+ * non-blocking and the connect to the first address that accepts one
+ * may still be in progress.  Returns -1 with errno set on failure.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param wait Set to wait for the connect to complete.
+ * \param deadline When to stop waiting (ms); 0 to never.
+ */
+int
+_riak_connect_server(RiakClient *rc, int server, int wait,
+    uint64_t deadline)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct addrinfo *addrs[RIAK_EYEBALLS_MAX];
+  struct _RiakLookup *lu;
+  int i, n, sd = -1, err = EHOSTUNREACH;
+
+  lu = _dns_get(rc, server);
+  if (!lu) {
+    lu = _lookup_new(srv->host, srv->port);
+    if (!lu) {
+      errno = ENOMEM;
+      return -1;
+    }
+    _lookup_run(lu);
+    if (lu->err == 0) {
+      _dns_put(rc, server, lu);
+    }
+  }
+
+  if (wait) {
+    sd = _eyeballs(lu->result, deadline);
+    err = errno;
+    if (sd >= 0) {
+      (void)fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) & ~O_NONBLOCK);
+    }
+  } else {
+    n = _eyeballs_order(lu->result, addrs, RIAK_EYEBALLS_MAX);
+    for (i = 0; i < n && sd < 0; i++) {
+      sd = _addr_connect(addrs[i]);
+      err = errno;
+    }
+  }
+  if (sd < 0 && lu->err == 0) {
+    /* The addresses may have moved; refresh them on the next try. */
+    _dns_lock(srv);
+    if (srv->dns == lu) {
+      srv->dns_time = 0;
+    }
+    _dns_unlock(srv);
+  }
+  _lookup_unref(lu);
+  if (sd < 0) {
+    errno = err;
+  }
+  return sd;
+}
+
+/** \brief Connect to a host without using the address cache.
+ *
+ * For use off the client's thread.  Returns a connected, non-blocking
+ * socket, or -1 with errno set.
+ *
+ * \param host Host to connect to.
+ * \param port Port to connect to.
+ */
+int
+_riak_connect_host(char *host, char *port)
+{
+  struct _RiakLookup *lu;
+  int sd, err;
+
+  lu = _lookup_new(host, port);
+  if (!lu) {
+    errno = ENOMEM;
+    return -1;
+  }
+  _lookup_run(lu);
+  sd = _eyeballs(lu->result, 0);
+  err = errno;
+  _lookup_unref(lu);
+  errno = err;
+  return sd;
+}
+
+/** \brief Configure the address cache.
+ *
+ * Servers' addresses are looked up once and reused for \c ttl_ms,
+ * then refreshed in the background.  0 looks them up for every
+ * connection.
+ *
+ * \param rc Riak client object.
+ * \param ttl_ms How long to trust looked up addresses.
+ */
+void
+riak_dns_config(RiakClient *rc, int ttl_ms)
+{
+  rc->dns_ttl_ms = ttl_ms;
+}
+
+/** \brief Start a non-blocking connect.
+ *
+ * Tries \c at->addr and the addresses after it until a connect is
+ * under way.  Returns 0 if one is, -1 if every address failed.
+ *
+ * \param at The attempt.
+ */
+static int
+_attempt_start(struct _RiakAttempt *at)
+{
+  struct _RiakConn *conn = at->conn;
+
+  for (; at->addr; at->addr = at->addr->ai_next) {
+    conn->sd = _addr_connect(at->addr);
+    if (conn->sd >= 0) {
+      conn->connecting = 1;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** \brief Finish an attempt, pooling the connection if it is open.
+ *
+ * \param rc RiakClient object.
+ * \param at The attempt.
+ */
+static void
+_attempt_finish(RiakClient *rc, struct _RiakAttempt *at)
+{
+  struct _RiakConn *conn = at->conn;
+
+  if (conn->connecting && conn->sd >= 0) {
+    close(conn->sd);
+    conn->sd = -1;
+  }
+  conn->connecting = 0;
+  conn->created = conn->used = _riak_now_ms();
+  /* A slot without a socket is freed rather than pooled. */
+  _riak_pool_put(rc, conn);
+  at->conn = NULL;
+}
+
+/** \brief Start connects to a server whose lookup has finished.
+ *
+ * Claims up to \c want pool slots and starts a connect in each,
+ * adding them to \c attempts.  Returns the number of attempts added;
+ * sets \c err if a connect could not be started.  The lookup must
+ * outlive the attempts.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param lu The server's finished lookup.
+ * \param want Number of connections to open.
+ * \param attempts Where to add the attempts.
+ * \param err Set to the errno value of a failure.
+ */
+static int
+_warmup_server(RiakClient *rc, int server, struct _RiakLookup *lu,
+    int want, struct _RiakAttempt *attempts, int *err)
+{
+  struct _RiakConn *conn;
+  int n = 0;
+
+  if (lu->err != 0) {
+    *err = EHOSTUNREACH;
+    return 0;
+  }
+  _dns_put(rc, server, lu);
+  for (; want > 0; want--) {
+    conn = _riak_pool_claim(rc, server);
+    if (!conn) {
+      break;
+    }
+    attempts[n].conn = conn;
+    attempts[n].addr = lu->result;
+    if (_attempt_start(&attempts[n]) < 0) {
+      *err = errno;
+      _attempt_finish(rc, &attempts[n]);
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+/** \brief Handle a connect that poll() reported on.
+ *
+ * On failure the server's next address is tried.
+ *
+ * \param rc RiakClient object.
+ * \param at The attempt.
+ * \param err Set to the errno value of a failure.
+ */
+static void
+_warmup_ready(RiakClient *rc, struct _RiakAttempt *at, int *err)
+{
+  struct _RiakConn *conn = at->conn;
+  int e;
+
+  if ((e = _riak_conn_connected(conn)) == 0) {
+    _attempt_finish(rc, at);
+    return;
+  }
+  *err = e;
+  close(conn->sd);
+  conn->sd = -1;
+  at->addr = at->addr->ai_next;
+  if (_attempt_start(at) < 0) {
+    _attempt_finish(rc, at);
+  }
+}
+
+/** \brief Connect to every server in parallel.
+ *
+ * Looks up and connects to all servers at once, opening each one's
+ * minimum number of pooled connections (at least one), and gives up
+ * on whatever is not done within \c timeout_ms.  Servers that were not
+ * reached stay configured and are connected to on first use.  Use
+ * with riak_pool_lazy() to keep riak_server_add() from connecting one
+ * server at a time first.  Returns the number of servers with an open
+ * connection, or -1 if out of memory.
+ *
+ * \param rc Riak client object.
+ * \param timeout_ms Time allowed for the whole warm-up.
+ */
+int
+riak_servers_warmup(RiakClient *rc, int timeout_ms)
+{
+  struct _RiakLookup **lookups;
+  struct _RiakAttempt *attempts, **polled;
+  struct pollfd *pfds;
+  char *started;
+  uint64_t now, deadline;
+  size_t max;
+  int i, n, per, running, wait, n_attempts = 0, known = 0, ready = 0;
+  int err = ETIMEDOUT;
+
+  per = rc->pool_min > 1? rc->pool_min: 1;
+  max = (size_t)rc->n_servers * per;
+  lookups = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(*lookups) * rc->n_servers + (sizeof(*attempts)
+        + sizeof(*polled) + sizeof(*pfds)) * max + rc->n_servers);
+  if (!lookups) {
+    _riak_error(rc, ENOMEM, RIAK_ACT_CONNECT, 0);
+    return -1;
+  }
+  attempts = (struct _RiakAttempt *)(lookups + rc->n_servers);
+  polled = (struct _RiakAttempt **)(attempts + max);
+  pfds = (struct pollfd *)(polled + max);
+  started = (char *)(pfds + max);
+
+  for (i = 0; i < rc->n_servers; i++) {
+    lookups[i] = NULL;
+    started[i] = 0;
+    if (rc->servers[i].host && rc->servers[i].n_conns < per) {
+      lookups[i] = _dns_get(rc, i);
+      if (!lookups[i]) {
+        lookups[i] = _lookup_start(rc->servers[i].host,
+            rc->servers[i].port);
+      }
+    }
+  }
+  deadline = _riak_now_ms() + timeout_ms;
+
+  for (;;) {
+    /* Start connects for servers whose lookups have finished. */
+    running = 0;
+    for (i = 0; i < rc->n_servers; i++) {
+      if (!lookups[i] || started[i]) {
+        continue;
+      } else if (!__atomic_load_n(&lookups[i]->done, __ATOMIC_ACQUIRE)) {
+        running++;
+      } else {
+        started[i] = 1;
+        n_attempts += _warmup_server(rc, i, lookups[i],
+            per - rc->servers[i].n_conns, attempts + n_attempts, &err);
+      }
+    }
+
+    n = 0;
+    for (i = 0; i < n_attempts; i++) {
+      if (attempts[i].conn) {
+        pfds[n].fd = attempts[i].conn->sd;
+        pfds[n].events = POLLOUT;
+        pfds[n].revents = 0;
+        polled[n++] = &attempts[i];
+      }
+    }
+    now = _riak_now_ms();
+    if ((n == 0 && running == 0) || now >= deadline) {
+      break;
+    }
+    wait = (int)(deadline - now);
+    if (running > 0 && wait > RIAK_WARMUP_SLICE_MS) {
+      wait = RIAK_WARMUP_SLICE_MS;
+    }
+    if (poll(pfds, n, wait) < 0 && errno != EINTR) {
+      err = errno;
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      if (pfds[i].revents) {
+        _warmup_ready(rc, polled[i], &err);
+      }
+    }
+  }
+
+  /* Whatever is still connecting is left for first use. */
+  for (i = 0; i < n_attempts; i++) {
+    if (attempts[i].conn) {
+      _attempt_finish(rc, &attempts[i]);
+    }
+  }
+  for (i = 0; i < rc->n_servers; i++) {
+    if (lookups[i]) {
+      _lookup_unref(lookups[i]);
+    }
+    if (rc->servers[i].host) {
+      known++;
+      ready += rc->servers[i].n_conns > 0;
+    }
+  }
+  rc->allocator->free(rc->allocator->allocator_data, lookups);
+
+  if (ready < known) {
+    _riak_error(rc, err, RIAK_ACT_CONNECT, 0);
+  }
+  return ready;
+}
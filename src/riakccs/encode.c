@@ -0,0 +1,487 @@
+/** \file
+ *
+ * \brief Request encoders.
+ *
+ * protobuf-c packs a message by walking its descriptor a field at a
+ * time, and framing a request walks it twice: once to size it and
+ * once to pack it.  Get, put and delete requests are the bulk of the
+ * traffic, so they are encoded here with the fields written out in
+ * order.  Sizes are worked out from the lengths alone, and the bytes
+ * are written once, straight into the send buffer.  The output is the
+ * same as protobuf-c's.
+ *
+ * Other requests, and any carrying unknown fields at any depth, go to
+ * protobuf-c.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** \brief Returns the size of a varint.
+ *
+ * \param v The value.
+ */
+static size_t
+_enc_varint_size(uint64_t v)
+{
+  size_t n = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/** \brief Write a varint.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param v The value.
+ */
+static uint8_t *
+_enc_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+/** \brief Returns the size of a length delimited field.
+ *
+ * \param id Field number.
+ * \param len Length of the field's body.
+ */
+static size_t
+_enc_len_size(uint32_t id, size_t len)
+{
+  return _enc_varint_size(id << 3) + _enc_varint_size(len) + len;
+}
+
+/** \brief Returns the size of a varint field.
+ *
+ * \param id Field number.
+ * \param v The value.
+ */
+static size_t
+_enc_uint_size(uint32_t id, uint32_t v)
+{
+  return _enc_varint_size(id << 3) + _enc_varint_size(v);
+}
+
+/** \brief Write the key and length of a length delimited field.
+ *
+ * Returns the byte after them, where the body goes.
+ *
+ * \param p Where to write.
+ * \param id Field number.
+ * \param len Length of the field's body.
+ */
+static uint8_t *
+_enc_len(uint8_t *p, uint32_t id, size_t len)
+{
+  p = _enc_varint(p, id << 3 | RIAK_WIRE_BYTES);
+  return _enc_varint(p, len);
+}
+
+/** \brief Write a bytes field.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param id Field number.
+ * \param b The bytes.
+ */
+static uint8_t *
+_enc_bytes(uint8_t *p, uint32_t id, const ProtobufCBinaryData *b)
+{
+  p = _enc_len(p, id, b->len);
+  if (b->len) {
+    memcpy(p, b->data, b->len);
+  }
+  return p + b->len;
+}
+
+/** \brief Write a uint32 or bool field.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param id Field number.
+ * \param v The value.
+ */
+static uint8_t *
+_enc_uint(uint8_t *p, uint32_t id, uint32_t v)
+{
+  p = _enc_varint(p, id << 3 | RIAK_WIRE_VARINT);
+  return _enc_varint(p, v);
+}
+
+/* Add or write optional fields, if they are set. */
+#define ENC_BYTES_SIZE(n, id, has, b) \
+  do { if (has) { (n) += _enc_len_size(id, (b).len); } } while (0)
+#define ENC_UINT_SIZE(n, id, has, v) \
+  do { if (has) { (n) += _enc_uint_size(id, v); } } while (0)
+#define ENC_BOOL_SIZE(n, id, has) \
+  do { if (has) { (n) += _enc_uint_size(id, 0); } } while (0)
+#define ENC_BYTES(p, id, has, b) \
+  do { if (has) { (p) = _enc_bytes(p, id, &(b)); } } while (0)
+#define ENC_UINT(p, id, has, v) \
+  do { if (has) { (p) = _enc_uint(p, id, v); } } while (0)
+#define ENC_BOOL(p, id, has, v) \
+  do { if (has) { (p) = _enc_uint(p, id, (v)? 1: 0); } } while (0)
+
+/** \brief Returns the size of a link's body.
+ *
+ * \param link The link.
+ */
+static size_t
+_enc_link_size(const RpbLink *link)
+{
+  size_t n = 0;
+
+  ENC_BYTES_SIZE(n, 1, link->has_bucket, link->bucket);
+  ENC_BYTES_SIZE(n, 2, link->has_key, link->key);
+  ENC_BYTES_SIZE(n, 3, link->has_tag, link->tag);
+  return n;
+}
+
+/** \brief Returns the size of a pair's body.
+ *
+ * \param pair The pair.
+ */
+static size_t
+_enc_pair_size(const RpbPair *pair)
+{
+  size_t n = _enc_len_size(1, pair->key.len);
+
+  ENC_BYTES_SIZE(n, 2, pair->has_value, pair->value);
+  return n;
+}
+
+/** \brief Returns the size of a content's body.
+ *
+ * \param c The content.
+ */
+static size_t
+_enc_content_size(const RpbContent *c)
+{
+  size_t n = _enc_len_size(1, c->value.len), i;
+
+  ENC_BYTES_SIZE(n, 2, c->has_content_type, c->content_type);
+  ENC_BYTES_SIZE(n, 3, c->has_charset, c->charset);
+  ENC_BYTES_SIZE(n, 4, c->has_content_encoding, c->content_encoding);
+  ENC_BYTES_SIZE(n, 5, c->has_vtag, c->vtag);
+  for (i = 0; i < c->n_links; i++) {
+    n += _enc_len_size(6, _enc_link_size(c->links[i]));
+  }
+  ENC_UINT_SIZE(n, 7, c->has_last_mod, c->last_mod);
+  ENC_UINT_SIZE(n, 8, c->has_last_mod_usecs, c->last_mod_usecs);
+  for (i = 0; i < c->n_usermeta; i++) {
+    n += _enc_len_size(9, _enc_pair_size(c->usermeta[i]));
+  }
+  for (i = 0; i < c->n_indexes; i++) {
+    n += _enc_len_size(10, _enc_pair_size(c->indexes[i]));
+  }
+  ENC_BOOL_SIZE(n, 11, c->has_deleted);
+  return n;
+}
+
+/** \brief Write a pair field.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param id Field number.
+ * \param pair The pair.
+ */
+static uint8_t *
+_enc_pair(uint8_t *p, uint32_t id, const RpbPair *pair)
+{
+  p = _enc_len(p, id, _enc_pair_size(pair));
+  p = _enc_bytes(p, 1, &pair->key);
+  ENC_BYTES(p, 2, pair->has_value, pair->value);
+  return p;
+}
+
+/** \brief Write a content's body.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param c The content.
+ */
+static uint8_t *
+_enc_content(uint8_t *p, const RpbContent *c)
+{
+  const RpbLink *link;
+  size_t i;
+
+  p = _enc_bytes(p, 1, &c->value);
+  ENC_BYTES(p, 2, c->has_content_type, c->content_type);
+  ENC_BYTES(p, 3, c->has_charset, c->charset);
+  ENC_BYTES(p, 4, c->has_content_encoding, c->content_encoding);
+  ENC_BYTES(p, 5, c->has_vtag, c->vtag);
+  for (i = 0; i < c->n_links; i++) {
+    link = c->links[i];
+    p = _enc_len(p, 6, _enc_link_size(link));
+    ENC_BYTES(p, 1, link->has_bucket, link->bucket);
+    ENC_BYTES(p, 2, link->has_key, link->key);
+    ENC_BYTES(p, 3, link->has_tag, link->tag);
+  }
+  ENC_UINT(p, 7, c->has_last_mod, c->last_mod);
+  ENC_UINT(p, 8, c->has_last_mod_usecs, c->last_mod_usecs);
+  for (i = 0; i < c->n_usermeta; i++) {
+    p = _enc_pair(p, 9, c->usermeta[i]);
+  }
+  for (i = 0; i < c->n_indexes; i++) {
+    p = _enc_pair(p, 10, c->indexes[i]);
+  }
+  ENC_BOOL(p, 11, c->has_deleted, c->deleted);
+  return p;
+}
+
+/** \brief Returns the packed size of a get request.
+ *
+ * \param req The request.
+ */
+static size_t
+_enc_get_req_size(const RpbGetReq *req)
+{
+  size_t n = _enc_len_size(1, req->bucket.len)
+    + _enc_len_size(2, req->key.len);
+
+  ENC_UINT_SIZE(n, 3, req->has_r, req->r);
+  ENC_UINT_SIZE(n, 4, req->has_pr, req->pr);
+  ENC_BOOL_SIZE(n, 5, req->has_basic_quorum);
+  ENC_BOOL_SIZE(n, 6, req->has_notfound_ok);
+  ENC_BYTES_SIZE(n, 7, req->has_if_modified, req->if_modified);
+  ENC_BOOL_SIZE(n, 8, req->has_head);
+  ENC_BOOL_SIZE(n, 9, req->has_deletedvclock);
+  ENC_UINT_SIZE(n, 10, req->has_timeout, req->timeout);
+  ENC_BOOL_SIZE(n, 11, req->has_sloppy_quorum);
+  ENC_UINT_SIZE(n, 12, req->has_n_val, req->n_val);
+  ENC_BYTES_SIZE(n, 13, req->has_type, req->type);
+  return n;
+}
+
+/** \brief Pack a get request.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param req The request.
+ */
+static uint8_t *
+_enc_get_req(uint8_t *p, const RpbGetReq *req)
+{
+  p = _enc_bytes(p, 1, &req->bucket);
+  p = _enc_bytes(p, 2, &req->key);
+  ENC_UINT(p, 3, req->has_r, req->r);
+  ENC_UINT(p, 4, req->has_pr, req->pr);
+  ENC_BOOL(p, 5, req->has_basic_quorum, req->basic_quorum);
+  ENC_BOOL(p, 6, req->has_notfound_ok, req->notfound_ok);
+  ENC_BYTES(p, 7, req->has_if_modified, req->if_modified);
+  ENC_BOOL(p, 8, req->has_head, req->head);
+  ENC_BOOL(p, 9, req->has_deletedvclock, req->deletedvclock);
+  ENC_UINT(p, 10, req->has_timeout, req->timeout);
+  ENC_BOOL(p, 11, req->has_sloppy_quorum, req->sloppy_quorum);
+  ENC_UINT(p, 12, req->has_n_val, req->n_val);
+  ENC_BYTES(p, 13, req->has_type, req->type);
+  return p;
+}
+
+/** \brief Returns the packed size of a put request.
+ *
+ * \param req The request.
+ * \param content_len Size of the content's body.
+ */
+static size_t
+_enc_put_req_size(const RpbPutReq *req, size_t content_len)
+{
+  size_t n = _enc_len_size(1, req->bucket.len);
+
+  ENC_BYTES_SIZE(n, 2, req->has_key, req->key);
+  ENC_BYTES_SIZE(n, 3, req->has_vclock, req->vclock);
+  n += _enc_len_size(4, content_len);
+  ENC_UINT_SIZE(n, 5, req->has_w, req->w);
+  ENC_UINT_SIZE(n, 6, req->has_dw, req->dw);
+  ENC_BOOL_SIZE(n, 7, req->has_return_body);
+  ENC_UINT_SIZE(n, 8, req->has_pw, req->pw);
+  ENC_BOOL_SIZE(n, 9, req->has_if_not_modified);
+  ENC_BOOL_SIZE(n, 10, req->has_if_none_match);
+  ENC_BOOL_SIZE(n, 11, req->has_return_head);
+  ENC_UINT_SIZE(n, 12, req->has_timeout, req->timeout);
+  ENC_BOOL_SIZE(n, 13, req->has_asis);
+  ENC_BOOL_SIZE(n, 14, req->has_sloppy_quorum);
+  ENC_UINT_SIZE(n, 15, req->has_n_val, req->n_val);
+  ENC_BYTES_SIZE(n, 16, req->has_type, req->type);
+  return n;
+}
+
+/** \brief Pack a put request.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param req The request.
+ * \param content_len Size of the content's body.
+ */
+static uint8_t *
+_enc_put_req(uint8_t *p, const RpbPutReq *req, size_t content_len)
+{
+  p = _enc_bytes(p, 1, &req->bucket);
+  ENC_BYTES(p, 2, req->has_key, req->key);
+  ENC_BYTES(p, 3, req->has_vclock, req->vclock);
+  p = _enc_len(p, 4, content_len);
+  p = _enc_content(p, req->content);
+  ENC_UINT(p, 5, req->has_w, req->w);
+  ENC_UINT(p, 6, req->has_dw, req->dw);
+  ENC_BOOL(p, 7, req->has_return_body, req->return_body);
+  ENC_UINT(p, 8, req->has_pw, req->pw);
+  ENC_BOOL(p, 9, req->has_if_not_modified, req->if_not_modified);
+  ENC_BOOL(p, 10, req->has_if_none_match, req->if_none_match);
+  ENC_BOOL(p, 11, req->has_return_head, req->return_head);
+  ENC_UINT(p, 12, req->has_timeout, req->timeout);
+  ENC_BOOL(p, 13, req->has_asis, req->asis);
+  ENC_BOOL(p, 14, req->has_sloppy_quorum, req->sloppy_quorum);
+  ENC_UINT(p, 15, req->has_n_val, req->n_val);
+  ENC_BYTES(p, 16, req->has_type, req->type);
+  return p;
+}
+
+/** \brief Returns the packed size of a delete request.
+ *
+ * \param req The request.
+ */
+static size_t
+_enc_del_req_size(const RpbDelReq *req)
+{
+  size_t n = _enc_len_size(1, req->bucket.len)
+    + _enc_len_size(2, req->key.len);
+
+  ENC_UINT_SIZE(n, 3, req->has_rw, req->rw);
+  ENC_BYTES_SIZE(n, 4, req->has_vclock, req->vclock);
+  ENC_UINT_SIZE(n, 5, req->has_r, req->r);
+  ENC_UINT_SIZE(n, 6, req->has_w, req->w);
+  ENC_UINT_SIZE(n, 7, req->has_pr, req->pr);
+  ENC_UINT_SIZE(n, 8, req->has_pw, req->pw);
+  ENC_UINT_SIZE(n, 9, req->has_dw, req->dw);
+  ENC_UINT_SIZE(n, 10, req->has_timeout, req->timeout);
+  ENC_BOOL_SIZE(n, 11, req->has_sloppy_quorum);
+  ENC_UINT_SIZE(n, 12, req->has_n_val, req->n_val);
+  ENC_BYTES_SIZE(n, 13, req->has_type, req->type);
+  return n;
+}
+
+/** \brief Pack a delete request.  Returns the byte after it.
+ *
+ * \param p Where to write.
+ * \param req The request.
+ */
+static uint8_t *
+_enc_del_req(uint8_t *p, const RpbDelReq *req)
+{
+  p = _enc_bytes(p, 1, &req->bucket);
+  p = _enc_bytes(p, 2, &req->key);
+  ENC_UINT(p, 3, req->has_rw, req->rw);
+  ENC_BYTES(p, 4, req->has_vclock, req->vclock);
+  ENC_UINT(p, 5, req->has_r, req->r);
+  ENC_UINT(p, 6, req->has_w, req->w);
+  ENC_UINT(p, 7, req->has_pr, req->pr);
+  ENC_UINT(p, 8, req->has_pw, req->pw);
+  ENC_UINT(p, 9, req->has_dw, req->dw);
+  ENC_UINT(p, 10, req->has_timeout, req->timeout);
+  ENC_BOOL(p, 11, req->has_sloppy_quorum, req->sloppy_quorum);
+  ENC_UINT(p, 12, req->has_n_val, req->n_val);
+  ENC_BYTES(p, 13, req->has_type, req->type);
+  return p;
+}
+
+/** \brief Check a request has no unknown fields, nested ones included.
+ *
+ * Those are left to protobuf-c, which packs them back as it found
+ * them.  A put's content is often one unpacked from a get, so its
+ * links and pairs are looked at too.
+ *
+ * \param mc Message code of the request.
+ * \param msg The protobuf.
+ */
+static int
+_enc_known(uint8_t mc, const ProtobufCMessage *msg)
+{
+  const RpbContent *c;
+  size_t i;
+
+  if (msg->n_unknown_fields != 0) {
+    return 0;
+  } else if (mc != MC_RpbPutReq) {
+    return 1;
+  }
+  c = ((const RpbPutReq *)msg)->content;
+  if (c->base.n_unknown_fields != 0) {
+    return 0;
+  }
+  for (i = 0; i < c->n_links; i++) {
+    if (c->links[i]->base.n_unknown_fields != 0) {
+      return 0;
+    }
+  }
+  for (i = 0; i < c->n_usermeta; i++) {
+    if (c->usermeta[i]->base.n_unknown_fields != 0) {
+      return 0;
+    }
+  }
+  for (i = 0; i < c->n_indexes; i++) {
+    if (c->indexes[i]->base.n_unknown_fields != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** \brief Returns the packed size of a request's protobuf.
+ *
+ * For a put request \c aux is set to the size of its content, to be
+ * passed on to _riak_pack().
+ *
+ * \param mc Message code of the request.
+ * \param msg The protobuf.
+ * \param aux Set for _riak_pack().
+ */
+size_t
+_riak_pack_size(uint8_t mc, const ProtobufCMessage *msg, size_t *aux)
+{
+  if (_enc_known(mc, msg)) {
+    switch (mc) {
+      case MC_RpbGetReq:
+        return _enc_get_req_size((const RpbGetReq *)msg);
+      case MC_RpbPutReq:
+        *aux = _enc_content_size(((const RpbPutReq *)msg)->content);
+        return _enc_put_req_size((const RpbPutReq *)msg, *aux);
+      case MC_RpbDelReq:
+        return _enc_del_req_size((const RpbDelReq *)msg);
+    }
+  }
+  return protobuf_c_message_get_packed_size(msg);
+}
+
+/** \brief Pack a request's protobuf.
+ *
+ * Returns the number of bytes written, which is what _riak_pack_size()
+ * returned.
+ *
+ * \param mc Message code of the request.
+ * \param msg The protobuf.
+ * \param aux As set by _riak_pack_size().
+ * \param out Where to write.
+ */
+size_t
+_riak_pack(uint8_t mc, const ProtobufCMessage *msg, size_t aux,
+    uint8_t *out)
+{
+  if (_enc_known(mc, msg)) {
+    switch (mc) {
+      case MC_RpbGetReq:
+        return _enc_get_req(out, (const RpbGetReq *)msg) - out;
+      case MC_RpbPutReq:
+        return _enc_put_req(out, (const RpbPutReq *)msg, aux) - out;
+      case MC_RpbDelReq:
+        return _enc_del_req(out, (const RpbDelReq *)msg) - out;
+    }
+  }
+  return protobuf_c_message_pack(msg, out);
+}
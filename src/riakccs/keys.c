@@ -0,0 +1,305 @@
+/** \file
+ *
+ * \brief Key list decoding.
+ *
+ * protobuf-c unpacks each key of a list keys or index response into
+ * an allocation of its own, which for a large bucket is millions of
+ * them.  The responses are decoded here instead into a single block
+ * per frame: the message, its key array, a RiakKeys offset array and
+ * one blob holding every key end to end, so a frame costs one
+ * allocation and its keys can be walked in order through memory.
+ *
+ * Keys are almost always under 128 bytes, so the scan checks for a
+ * one byte key tag and length before falling back to the general
+ * field reader.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** Key of a keys field with a one byte length: field 1, bytes. */
+#define RIAK_KEY_TAG (1 << 3 | RIAK_WIRE_BYTES)
+
+/** \brief Read the next field of a key list.
+ *
+ * Like _riak_wire_field(), with a fast path for short keys.  Returns
+ * 0 on success, -1 if the message is malformed.
+ *
+ * \param p Where to read; advanced past the field.
+ * \param end End of the message.
+ * \param f Set to the field.
+ */
+static int
+_keys_field(const uint8_t **p, const uint8_t *end, struct _RiakField *f)
+{
+  const uint8_t *q = *p;
+
+  if (end - q >= 2 && q[0] == RIAK_KEY_TAG && q[1] < 0x80
+      && q[1] <= end - q - 2) {
+    f->id = 1;
+    f->type = RIAK_WIRE_BYTES;
+    f->bytes.len = q[1];
+    f->bytes.data = (uint8_t *)q + 2;
+    *p = q + 2 + q[1];
+    return 0;
+  }
+  return _riak_wire_field(p, end, f);
+}
+
+/** \brief Count the keys and results of a key list.
+ *
+ * Returns 0 on success, -1 if the message is malformed.
+ *
+ * \param len Length of the protobuf.
+ * \param pb The serialised protobuf.
+ * \param n_keys Set to the number of keys.
+ * \param key_bytes Set to the length of all the keys together.
+ * \param n_results Set to the number of results.
+ */
+static int
+_keys_count(size_t len, const uint8_t *pb, size_t *n_keys,
+    size_t *key_bytes, size_t *n_results)
+{
+  const uint8_t *p = pb, *end = pb + len;
+  struct _RiakField f;
+
+  *n_keys = *key_bytes = *n_results = 0;
+  while (p < end) {
+    if (_keys_field(&p, end, &f) < 0) {
+      return -1;
+    }
+    if (f.type == RIAK_WIRE_BYTES) {
+      if (f.id == 1) {
+        (*n_keys)++;
+        *key_bytes += f.bytes.len;
+      } else if (f.id == 2) {
+        (*n_results)++;
+      }
+    }
+  }
+  return 0;
+}
+
+/** \brief Copy bytes onto the end of a blob and point at the copy.
+ *
+ * \param blob The blob.
+ * \param used Bytes of the blob used; advanced past the copy.
+ * \param b Bytes to copy; left pointing into the blob.
+ */
+static void
+_keys_copy(uint8_t *blob, size_t *used, ProtobufCBinaryData *b)
+{
+  if (b->len) {
+    memcpy(blob + *used, b->data, b->len);
+  }
+  b->data = blob + *used;
+  *used += b->len;
+}
+
+/** \brief Allocate a block for a decoded key list.
+ *
+ * Lays out \c size bytes for the message, then the key array, the
+ * offsets, the result pointers and results, and \c len bytes of blob,
+ * which is room for every byte of the frame.  Sets up \c keys.
+ * Returns the block or NULL on failure.
+ *
+ * \param pa Allocator.
+ * \param size Size of the message.
+ * \param len Length of the protobuf.
+ * \param n_keys Number of keys.
+ * \param n_results Number of results.
+ * \param key_array Set to the key array.
+ * \param results Set to the result pointers, set up to point at the
+ *                results; or NULL if there are none.
+ * \param keys Set up with the offsets and blob.
+ */
+static void *
+_keys_block(ProtobufCAllocator *pa, size_t size, size_t len, size_t n_keys,
+    size_t n_results, ProtobufCBinaryData **key_array, RpbPair ***results,
+    RiakKeys *keys)
+{
+  uint8_t *block, *p;
+  size_t i;
+
+  block = pa->alloc(pa->allocator_data, size
+      + n_keys * sizeof(ProtobufCBinaryData)
+      + (n_keys + 1) * sizeof(size_t)
+      + n_results * (sizeof(RpbPair *) + sizeof(RpbPair)) + len);
+  if (!block) {
+    return NULL;
+  }
+  p = block + size;
+  *key_array = (ProtobufCBinaryData *)p;
+  p += n_keys * sizeof(ProtobufCBinaryData);
+  keys->off = (size_t *)p;
+  p += (n_keys + 1) * sizeof(size_t);
+  if (results) {
+    *results = n_results? (RpbPair **)p: NULL;
+    for (i = 0; i < n_results; i++) {
+      (*results)[i] = (RpbPair *)(p + n_results * sizeof(RpbPair *))
+        + i;
+    }
+    p += n_results * (sizeof(RpbPair *) + sizeof(RpbPair));
+  }
+  keys->data = p;
+  keys->n = n_keys;
+  keys->off[0] = 0;
+  return block;
+}
+
+/** \brief Add a key to a decoded key list.
+ *
+ * \param keys The keys.
+ * \param key_array The message's key array.
+ * \param i Index of the key.
+ * \param key The key in the frame.
+ */
+static void
+_keys_add(RiakKeys *keys, ProtobufCBinaryData *key_array, size_t i,
+    ProtobufCBinaryData *key)
+{
+  size_t used = keys->off[i];
+
+  key_array[i] = *key;
+  _keys_copy(keys->data, &used, &key_array[i]);
+  keys->off[i + 1] = used;
+}
+
+/** \brief Decode a list keys response into one block.
+ *
+ * Returns the response, to be freed as a single allocation, or NULL
+ * if it is malformed or memory runs out, for the caller to unpack it
+ * the usual way.  \c keys is zeroed if so.
+ *
+ * \param pa Allocator.
+ * \param len Length of the protobuf.
+ * \param pb The serialised protobuf.
+ * \param keys Set to the keys.
+ */
+RpbListKeysResp *
+_riak_keys_list(ProtobufCAllocator *pa, size_t len, const uint8_t *pb,
+    RiakKeys *keys)
+{
+  static const RpbListKeysResp init = RPB_LIST_KEYS_RESP__INIT;
+  const uint8_t *p = pb, *end = pb + len;
+  ProtobufCBinaryData *key_array;
+  struct _RiakField f;
+  RpbListKeysResp *resp;
+  size_t n_keys, key_bytes, n_results, i = 0;
+
+  memset(keys, 0, sizeof(*keys));
+  if (_keys_count(len, pb, &n_keys, &key_bytes, &n_results) < 0) {
+    return NULL;
+  }
+  resp = _keys_block(pa, sizeof(*resp), len, n_keys, 0, &key_array, NULL,
+      keys);
+  if (!resp) {
+    memset(keys, 0, sizeof(*keys));
+    return NULL;
+  }
+  *resp = init;
+  resp->n_keys = n_keys;
+  resp->keys = n_keys? key_array: NULL;
+  while (p < end) {
+    (void)_keys_field(&p, end, &f);
+    if (f.id == 1 && f.type == RIAK_WIRE_BYTES) {
+      _keys_add(keys, key_array, i++, &f.bytes);
+    } else if (f.id == 1 || (f.id == 2 && f.type != RIAK_WIRE_VARINT)) {
+      break;
+    } else if (f.id == 2) {
+      resp->has_done = 1;
+      resp->done = f.v != 0;
+    }
+  }
+  if (p < end) {
+    pa->free(pa->allocator_data, resp);
+    memset(keys, 0, sizeof(*keys));
+    return NULL;
+  }
+  return resp;
+}
+
+/** \brief Decode an index response into one block.
+ *
+ * The results' keys and values and the continuation go into the blob
+ * after the keys.  Returns as _riak_keys_list() does.
+ *
+ * \param pa Allocator.
+ * \param len Length of the protobuf.
+ * \param pb The serialised protobuf.
+ * \param keys Set to the keys.
+ */
+RpbIndexResp *
+_riak_keys_index(ProtobufCAllocator *pa, size_t len, const uint8_t *pb,
+    RiakKeys *keys)
+{
+  static const RpbIndexResp init = RPB_INDEX_RESP__INIT;
+  const uint8_t *p = pb, *end = pb + len;
+  ProtobufCBinaryData *key_array;
+  struct _RiakField f;
+  RpbIndexResp *resp;
+  RpbPair **results;
+  size_t n_keys, key_bytes, n_results, i = 0, r = 0, used;
+  int ok = 1;
+
+  memset(keys, 0, sizeof(*keys));
+  if (_keys_count(len, pb, &n_keys, &key_bytes, &n_results) < 0) {
+    return NULL;
+  }
+  resp = _keys_block(pa, sizeof(*resp), len, n_keys, n_results, &key_array,
+      &results, keys);
+  if (!resp) {
+    memset(keys, 0, sizeof(*keys));
+    return NULL;
+  }
+  *resp = init;
+  resp->n_keys = n_keys;
+  resp->keys = n_keys? key_array: NULL;
+  resp->n_results = n_results;
+  resp->results = results;
+  /* Results and the continuation follow the keys in the blob. */
+  used = key_bytes;
+  while (ok && p < end) {
+    (void)_keys_field(&p, end, &f);
+    if (f.id > 4) {
+      continue;
+    }
+    if (f.type != (f.id < 4? RIAK_WIRE_BYTES: RIAK_WIRE_VARINT)) {
+      ok = 0;
+      break;
+    }
+    switch (f.id) {
+      case 1:
+        _keys_add(keys, key_array, i++, &f.bytes);
+        break;
+      case 2:
+        ok = _riak_wire_pair(&f.bytes, results[r]) == 0;
+        if (ok) {
+          _keys_copy(keys->data, &used, &results[r]->key);
+          if (results[r]->has_value) {
+            _keys_copy(keys->data, &used, &results[r]->value);
+          }
+          r++;
+        }
+        break;
+      case 3:
+        resp->has_continuation = 1;
+        resp->continuation = f.bytes;
+        _keys_copy(keys->data, &used, &resp->continuation);
+        break;
+      case 4:
+        resp->has_done = 1;
+        resp->done = f.v != 0;
+        break;
+    }
+  }
+  if (!ok) {
+    pa->free(pa->allocator_data, resp);
+    memset(keys, 0, sizeof(*keys));
+    return NULL;
+  }
+  return resp;
+}
@@ -0,0 +1,449 @@
+/** \file
+ *
+ * \brief Admission control.
+ *
+ * Limits on how hard a client may drive the cluster, so that bulk jobs
+ * cannot crowd out online traffic: a request rate and a number of
+ * requests in flight for the client as a whole, and the same for each
+ * server.  A request over a limit either waits for room or fails
+ * straight away with EAGAIN and RIAK_ACT_LIMIT, as riak_limit_config()
+ * chooses.
+ *
+ * Rates are token buckets kept as the generic cell rate algorithm
+ * does: as the time at which the bucket will next be full, so that
+ * taking a token is a single compare and swap and safe from several
+ * threads.
+ *
+ * A server's limit on requests in flight may also adapt to how it is
+ * coping, found from its latency much as the gradient limiters of
+ * service meshes do: raised while latency holds steady and cut back
+ * when it climbs or requests fail.
+ *
+ * Requests also travel in one of two lanes.  Bulk requests (key and
+ * bucket listings, map reduce and index queries, or anything sent by
+ * a thread that asked for the bulk lane) may hold only \c lane_bulk
+ * connections per server, leaving the rest of the pool to interactive
+ * requests, and do not count towards the latencies that server
+ * selection and hedging go by.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** \brief Lane asked for by the calling thread; see riak_lane_set(). */
+static __thread int _riak_thread_lane = RIAK_LANE_AUTO;
+
+/** \brief Take a token from a rate limit.
+ *
+ * Returns 0 if a token was taken, otherwise how long until one is due
+ * (us).
+ *
+ * \param tat When the bucket will next be full (us).
+ * \param rate Tokens per second; 0 for no limit.
+ * \param burst Size of the bucket.
+ */
+static uint64_t
+_rate_take(uint64_t *tat, int rate, int burst)
+{
+  uint64_t now, t, from, step, slack;
+
+  if (rate <= 0) {
+    return 0;
+  }
+  step = 1000000 / rate;
+  if (step == 0) {
+    step = 1;
+  }
+  slack = step * (burst > 1? burst - 1: 0);
+  now = _riak_now_us();
+  t = __atomic_load_n(tat, __ATOMIC_RELAXED);
+  do {
+    from = t > now? t: now;
+    if (from - now > slack) {
+      return from - now - slack;
+    }
+  } while (!__atomic_compare_exchange_n(tat, &t, from + step, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+/** \brief Wait for room under a limit.
+ *
+ * Fails with EAGAIN and RIAK_ACT_LIMIT if the client does not block
+ * or the room will not come, and with ETIMEDOUT and RIAK_ACT_TIMEOUT
+ * if it would come after the deadline.  Returns 0 once the wait is
+ * over, -1 on failure.
+ *
+ * \param rc RiakClient object.
+ * \param wait How long to wait (us); RIAK_LIMIT_NEVER if it is no use.
+ * \param deadline When the request times out (ms); 0 for never.
+ */
+int
+_riak_limit_wait(RiakClient *rc, uint64_t wait, uint64_t deadline)
+{
+  struct timespec ts;
+
+  if (!rc->limit_block || wait == RIAK_LIMIT_NEVER) {
+    _riak_error(rc, EAGAIN, RIAK_ACT_LIMIT, 0);
+    return -1;
+  } else if (deadline && _riak_now_ms() + wait / 1000 >= deadline) {
+    _riak_error(rc, ETIMEDOUT, RIAK_ACT_TIMEOUT, 0);
+    return -1;
+  }
+  ts.tv_sec = wait / 1000000;
+  ts.tv_nsec = (wait % 1000000) * 1000;
+  (void)nanosleep(&ts, NULL);
+  return 0;
+}
+
+/** \brief Admit a new request.
+ *
+ * Waits or fails if the client is at its rate or in flight limit.
+ * Asynchronous requests still pending count as in flight.  Returns 0
+ * if admitted, -1 on failure with the error set.  An admitted request
+ * must be let go with _riak_admit_done().
+ *
+ * \param rc RiakClient object.
+ * \param deadline When the request times out (ms); 0 for never.
+ */
+int
+_riak_admit(RiakClient *rc, uint64_t deadline)
+{
+  uint64_t wait;
+  int n, pending;
+
+  for (;;) {
+    n = __atomic_load_n(&rc->_in_flight, __ATOMIC_RELAXED);
+    pending = rc->_async? rc->_async->n_pending: 0;
+    if (rc->limit_in_flight > 0 && n + pending >= rc->limit_in_flight) {
+      /* Only another thread can finish a request meanwhile. */
+      wait = rc->_threaded? RIAK_LIMIT_WAIT_US: RIAK_LIMIT_NEVER;
+    } else if (!__atomic_compare_exchange_n(&rc->_in_flight, &n, n + 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      continue;
+    } else if ((wait = _rate_take(&rc->_limit_tat, rc->limit_rate,
+            rc->limit_burst)) == 0) {
+      return 0;
+    } else {
+      (void)__atomic_sub_fetch(&rc->_in_flight, 1, __ATOMIC_RELAXED);
+    }
+    if (_riak_limit_wait(rc, wait, deadline) < 0) {
+      return -1;
+    }
+  }
+}
+
+/** \brief Take a token from the client's rate limit.
+ *
+ * For requests counted in flight elsewhere.  Returns 0 if a token was
+ * taken, otherwise how long until one is due (us).
+ *
+ * \param rc RiakClient object.
+ */
+uint64_t
+_riak_limit_rate(RiakClient *rc)
+{
+  return _rate_take(&rc->_limit_tat, rc->limit_rate, rc->limit_burst);
+}
+
+/** \brief Let go of a request admitted by _riak_admit().
+ *
+ * \param rc RiakClient object.
+ */
+void
+_riak_admit_done(RiakClient *rc)
+{
+  (void)__atomic_sub_fetch(&rc->_in_flight, 1, __ATOMIC_RELAXED);
+}
+
+/** \brief Check that a server has room for another request.
+ *
+ * Takes a token from the server's rate limit if so.  Returns 0 if the
+ * request may go to the server, otherwise how long until it might
+ * (us), or RIAK_LIMIT_NEVER if only another thread could make room.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+uint64_t
+_riak_node_admit(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+
+  if (_riak_node_full(rc, server)) {
+    return rc->_threaded? RIAK_LIMIT_WAIT_US: RIAK_LIMIT_NEVER;
+  }
+  return _rate_take(&srv->rate_tat, rc->node_rate, rc->node_burst);
+}
+
+/** \brief Returns a server's adaptive in flight limit (1/256ths).
+ *
+ * \param rc RiakClient object.
+ * \param srv The server.
+ */
+static int64_t
+_adapt_limit(RiakClient *rc, struct _RiakServer *srv)
+{
+  int64_t limit = __atomic_load_n(&srv->adapt_limit, __ATOMIC_RELAXED);
+
+  /* Servers start from the least limit. */
+  return limit > 0? limit: (int64_t)rc->adapt_min << 8;
+}
+
+/** \brief Check whether a server is at its in flight limit.
+ *
+ * The limit is the lower of the fixed one and the adaptive one.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+int
+_riak_node_full(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int n = __atomic_load_n(&srv->in_flight, __ATOMIC_RELAXED);
+
+  if (rc->node_in_flight > 0 && n >= rc->node_in_flight) {
+    return 1;
+  }
+  return rc->adapt_max > 0 && n >= _adapt_limit(rc, srv) >> 8;
+}
+
+/** \brief Returns the integer square root of \c n.
+ *
+ * \param n The number.
+ */
+static int64_t
+_isqrt(int64_t n)
+{
+  int64_t r = 0;
+
+  while ((r + 1) * (r + 1) <= n) {
+    r++;
+  }
+  return r;
+}
+
+/** \brief Adjust a server's adaptive in flight limit to a response.
+ *
+ * Compares the server's recent latency with its long run latency.
+ * While they stay close the limit grows by about its square root, the
+ * queue a server can take without slowing; as recent latency climbs
+ * above the long run the limit shrinks in proportion, by at most half
+ * at a time.  A failed request cuts the limit by a quarter.  The new
+ * limit is blended into the old to ride out noise, and the limit only
+ * grows while requests come close to it.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param ok 1 if the server answered, 0 if the request failed.
+ */
+void
+_riak_adapt(RiakClient *rc, int server, int ok)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int64_t limit, target, recent, longrun, grad;
+
+  limit = _adapt_limit(rc, srv);
+  if (!ok) {
+    target = limit * 3 / 4;
+  } else {
+    recent = (int64_t)__atomic_load_n(&srv->lat_us, __ATOMIC_RELAXED);
+    longrun = (int64_t)__atomic_load_n(&srv->adapt_lat_us,
+        __ATOMIC_RELAXED);
+    if (longrun == 0) {
+      longrun = recent;
+    } else {
+      longrun += (recent - longrun) / (1 << RIAK_ADAPT_SHIFT);
+    }
+    if (longrun > 2 * recent) {
+      /* Let the long run come down after a slow spell has passed. */
+      longrun -= longrun / 16;
+    }
+    __atomic_store_n(&srv->adapt_lat_us, (uint64_t)(longrun > 0? longrun: 1),
+        __ATOMIC_RELAXED);
+    if (2 * (__atomic_load_n(&srv->in_flight, __ATOMIC_RELAXED) + 1)
+        < limit >> 8) {
+      /* Too little traffic to say whether a higher limit would do. */
+      return;
+    }
+    grad = recent > 0? longrun * RIAK_ADAPT_TOLERANCE * 64 / recent: 256;
+    grad = grad < 128? 128: grad > 256? 256: grad;
+    target = limit * grad / 256 + (_isqrt(limit >> 8) << 8);
+    target = limit + (target - limit) / 5;
+  }
+  if (target < (int64_t)rc->adapt_min << 8) {
+    target = (int64_t)rc->adapt_min << 8;
+  } else if (target > (int64_t)rc->adapt_max << 8) {
+    target = (int64_t)rc->adapt_max << 8;
+  }
+  /* Racing updates may lose an adjustment, which the next makes up. */
+  __atomic_store_n(&srv->adapt_limit, (uint32_t)target, __ATOMIC_RELAXED);
+}
+
+/** \brief Limit the load the client puts on the cluster.
+ *
+ * Caps the requests per second and the requests in flight across all
+ * servers; asynchronous requests count as in flight until they
+ * complete.  \c burst requests may go at once after a quiet spell.
+ * Over a limit, requests wait for room if \c block is set (never past
+ * their deadline, see riak_timeout_config()) and otherwise fail with
+ * EAGAIN and RIAK_ACT_LIMIT.  Asynchronous requests never wait for
+ * room in flight, which only riak_async_run() could make.
+ *
+ * \param rc Riak client object.
+ * \param rate Requests per second; 0 for no limit.
+ * \param burst Requests allowed at once above the rate.
+ * \param max_in_flight Requests in flight; 0 for no limit.
+ * \param block Set to wait for room rather than fail.
+ */
+void
+riak_limit_config(RiakClient *rc, int rate, int burst, int max_in_flight,
+    int block)
+{
+  rc->limit_rate = rate;
+  rc->limit_burst = burst;
+  rc->limit_in_flight = max_in_flight;
+  rc->limit_block = block;
+  /* Start with a full bucket at the new rate. */
+  __atomic_store_n(&rc->_limit_tat, 0, __ATOMIC_RELAXED);
+}
+
+/** \brief Limit the load the client puts on each server.
+ *
+ * Like riak_limit_config(), but each server has limits of its own.
+ * Requests go to another server while one is over its limits, and
+ * only wait or fail when every server is.  The asynchronous engine
+ * applies the in flight limit, holding requests back until others
+ * complete, but not the rate.
+ *
+ * \param rc Riak client object.
+ * \param rate Requests per second per server; 0 for no limit.
+ * \param burst Requests allowed at once above the rate.
+ * \param max_in_flight Requests in flight per server; 0 for no limit.
+ */
+void
+riak_node_limit_config(RiakClient *rc, int rate, int burst,
+    int max_in_flight)
+{
+  int i;
+
+  rc->node_rate = rate;
+  rc->node_burst = burst;
+  rc->node_in_flight = max_in_flight;
+  for (i = 0; i < rc->n_servers; i++) {
+    __atomic_store_n(&rc->servers[i].rate_tat, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/** \brief Let each server's in flight limit follow its latency.
+ *
+ * A server's limit starts at \c min_in_flight and grows while
+ * responses come back as fast as they usually do, up to
+ * \c max_in_flight.  When latency rises above the server's long run
+ * average, as in a garbage collection pause, or requests fail, the
+ * limit comes down again.  Requests over the limit go elsewhere, wait
+ * or fail as under riak_node_limit_config(), whose fixed limit still
+ * applies.
+ *
+ * \param rc Riak client object.
+ * \param min_in_flight Least requests in flight per server.
+ * \param max_in_flight Most requests in flight per server; 0 to turn
+ *                      adaptive limits off.
+ */
+void
+riak_node_adapt_config(RiakClient *rc, int min_in_flight, int max_in_flight)
+{
+  int i;
+
+  rc->adapt_min = min_in_flight > 0? min_in_flight: 1;
+  rc->adapt_max = max_in_flight;
+  if (rc->adapt_max > 0 && rc->adapt_max < rc->adapt_min) {
+    rc->adapt_max = rc->adapt_min;
+  }
+  for (i = 0; i < rc->n_servers; i++) {
+    __atomic_store_n(&rc->servers[i].adapt_limit, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&rc->servers[i].adapt_lat_us, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/** \brief Returns the lane a request travels in.
+ *
+ * \param mc The message code of the request.
+ */
+int
+_riak_lane(uint8_t mc)
+{
+  if (_riak_thread_lane != RIAK_LANE_AUTO) {
+    return _riak_thread_lane;
+  }
+  switch (mc) {
+    case MC_RpbListBucketsReq:
+    case MC_RpbListKeysReq:
+    case MC_RpbMapRedReq:
+    case MC_RpbIndexReq:
+      return RIAK_LANE_BULK;
+    default:
+      return RIAK_LANE_INTERACTIVE;
+  }
+}
+
+/** \brief Check that a server has a connection free for a bulk request.
+ *
+ * Returns 0 if it has, otherwise how long until it might (us), or
+ * RIAK_LIMIT_NEVER if only another thread could free one.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+uint64_t
+_riak_lane_admit(RiakClient *rc, int server)
+{
+  if (rc->lane_bulk > 0
+      && __atomic_load_n(&rc->servers[server].n_bulk, __ATOMIC_RELAXED)
+      >= rc->lane_bulk) {
+    return rc->_threaded? RIAK_LIMIT_WAIT_US: RIAK_LIMIT_NEVER;
+  }
+  return 0;
+}
+
+/** \brief Choose the lane for the calling thread's requests.
+ *
+ * RIAK_LANE_AUTO, the default, puts listings, map reduce and index
+ * queries in the bulk lane and everything else in the interactive
+ * one.  A loader can put all of its requests in the bulk lane with
+ * RIAK_LANE_BULK.  Returns the lane chosen before.
+ *
+ * \param lane RIAK_LANE_AUTO, RIAK_LANE_INTERACTIVE or RIAK_LANE_BULK.
+ */
+int
+riak_lane_set(int lane)
+{
+  int old = _riak_thread_lane;
+
+  _riak_thread_lane = lane;
+  return old;
+}
+
+/** \brief Keep connections free of bulk requests.
+ *
+ * Bulk requests may hold at most \c bulk_conns connections per
+ * server, so scans cannot take every connection from interactive
+ * requests, and interactive requests are never pipelined behind bulk
+ * ones.  Over the limit a bulk request goes to another server, or
+ * waits or fails as riak_limit_config()'s \c block says.  Queued
+ * asynchronous requests are sent interactive first, then by deadline.
+ *
+ * \param rc Riak client object.
+ * \param bulk_conns Connections per server for bulk requests; 0 for
+ *                   no limit.
+ */
+void
+riak_lane_config(RiakClient *rc, int bulk_conns)
+{
+  rc->lane_bulk = bulk_conns;
+}
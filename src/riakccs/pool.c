@@ -0,0 +1,800 @@
+/** \file
+ *
+ * \brief Per server connection pools.
+ *
+ * Every server keeps a pool of connections.  A request checks a
+ * connection out, uses it and checks it back in, so back to back and
+ * concurrent requests reuse open sockets instead of paying for a TCP
+ * handshake each.  Up to \c pool_max connections are opened as they
+ * are needed; \c pool_min are kept open even when idle.  Connections
+ * idle for longer than \c pool_idle_ms beyond the minimum are closed,
+ * and any older than \c pool_life_ms are replaced when next checked
+ * in or out.
+ *
+ * A pool is a fixed array of connection slots.  Idle slots form a
+ * stack threaded through \c idle_next whose top packs the slot index
+ * with a tag bumped on every change, so checkout and checkin are a
+ * compare and swap each and safe to use from several threads without
+ * a lock (see riak_client_threadsafe()).
+ *
+ * Idle connections can be kept warm: after riak_keepalive_config()
+ * each one left quiet for a while is pinged, by riak_pool_maintain()
+ * or by a thread of its own, so dead sockets are closed before a
+ * request finds them.
+ *
+ * Connects are non-blocking so the asynchronous engine need not wait
+ * for them.  Once connected a socket is put in blocking mode for the
+ * synchronous path; the asynchronous engine passes MSG_DONTWAIT.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif /* S_SPLINT_S */
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** \brief The thread started by riak_keepalive_config(). */
+struct _RiakKeepalive {
+  pthread_t thread;         ///< The pinging thread.
+  int efd;                  ///< Eventfd written to stop the thread.
+};
+
+/** \brief Returns a monotonic timestamp in milliseconds. */
+uint64_t
+_riak_now_ms(void)
+{
+  struct timespec ts;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** \brief Returns a monotonic timestamp in microseconds. */
+uint64_t
+_riak_now_us(void)
+{
+  struct timespec ts;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** \brief Finish a non-blocking connect.
+ *
+ * Checks the outcome of the connect and puts the socket in blocking
+ * mode.  Returns 0 on success, otherwise the socket error.
+ *
+ * \param conn Connection whose socket has become writable.
+ */
+int
+_riak_conn_connected(struct _RiakConn *conn)
+{
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  if (getsockopt(conn->sd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+    return errno;
+  } else if (err) {
+    return err;
+  }
+  (void)fcntl(conn->sd, F_SETFL, fcntl(conn->sd, F_GETFL) & ~O_NONBLOCK);
+  conn->connecting = 0;
+  return 0;
+}
+
+/** \brief Pop the most recently used idle connection.
+ *
+ * Returns NULL if there is none.
+ *
+ * \param srv Server whose pool to use.
+ */
+static struct _RiakConn *
+_idle_pop(struct _RiakServer *srv)
+{
+  struct _RiakConn *conn;
+  uint64_t top, next;
+
+  top = __atomic_load_n(&srv->idle, __ATOMIC_ACQUIRE);
+  do {
+    if (!(uint32_t)top) {
+      return NULL;
+    }
+    conn = &srv->conns[(uint32_t)top - 1];
+    next = ((top >> 32) + 1) << 32
+      | __atomic_load_n(&conn->idle_next, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&srv->idle, &top, next, 1,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  (void)__atomic_sub_fetch(&srv->n_idle, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&conn->state, RIAK_CONN_BUSY, __ATOMIC_RELAXED);
+  return conn;
+}
+
+/** \brief Push a connection on to the idle stack.
+ *
+ * \param srv Server whose pool to use.
+ * \param conn Connection to push.
+ */
+static void
+_idle_push(struct _RiakServer *srv, struct _RiakConn *conn)
+{
+  uint64_t top, next;
+  uint32_t slot = conn - srv->conns + 1;
+
+  __atomic_store_n(&conn->state, RIAK_CONN_IDLE, __ATOMIC_RELAXED);
+  (void)__atomic_add_fetch(&srv->n_idle, 1, __ATOMIC_RELAXED);
+  top = __atomic_load_n(&srv->idle, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&conn->idle_next, (uint32_t)top, __ATOMIC_RELAXED);
+    next = ((top >> 32) + 1) << 32 | slot;
+  } while (!__atomic_compare_exchange_n(&srv->idle, &top, next, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/** \brief Close a checked out connection and free its slot.
+ *
+ * The slot's buffers are kept for the next connection.
+ *
+ * \param srv Server whose pool to use.
+ * \param conn Connection to close.
+ */
+static void
+_slot_close(struct _RiakServer *srv, struct _RiakConn *conn)
+{
+  if (conn->sd >= 0) {
+    close(conn->sd);
+    conn->sd = -1;
+  }
+  conn->connecting = 0;
+  _riak_buf_empty(&conn->rbuf);
+  conn->wbuf.head = conn->wbuf.tail = 0;
+  __atomic_store_n(&conn->state, RIAK_CONN_FREE, __ATOMIC_RELEASE);
+  (void)__atomic_sub_fetch(&srv->n_conns, 1, __ATOMIC_RELAXED);
+}
+
+/** \brief Check whether a connection should be retired.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection to check.
+ * \param now Current time from _riak_now_ms().
+ */
+static int
+_pool_expired(RiakClient *rc, struct _RiakConn *conn, uint64_t now)
+{
+  return rc->pool_life_ms > 0
+    && now - conn->created >= (uint64_t)rc->pool_life_ms;
+}
+
+/** \brief Check whether an idle connection has been idle too long.
+ *
+ * \param rc RiakClient object.
+ * \param srv Server the connection belongs to.
+ * \param conn Connection to check.
+ * \param now Current time from _riak_now_ms().
+ */
+static int
+_pool_stale(RiakClient *rc, struct _RiakServer *srv, struct _RiakConn *conn,
+    uint64_t now)
+{
+  return _pool_expired(rc, conn, now)
+    || (rc->pool_idle_ms > 0
+        && __atomic_load_n(&srv->n_conns, __ATOMIC_RELAXED) > rc->pool_min
+        && now - conn->used >= (uint64_t)rc->pool_idle_ms);
+}
+
+/** \brief Claim a free slot for a new connection.
+ *
+ * The slot is checked out with no socket; hand it back with
+ * _riak_pool_put().  Returns NULL if the pool is full.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+struct _RiakConn *
+_riak_pool_claim(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int i, n, limit, state;
+
+  /* Claim a place under the limit, then a free slot. */
+  limit = rc->pool_max < srv->n_slots? rc->pool_max: srv->n_slots;
+  n = __atomic_load_n(&srv->n_conns, __ATOMIC_RELAXED);
+  do {
+    if (n >= limit) {
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&srv->n_conns, &n, n + 1, 1,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  for (i = 0; ; i = (i + 1) % srv->n_slots) {
+    state = RIAK_CONN_FREE;
+    if (__atomic_compare_exchange_n(&srv->conns[i].state, &state,
+          RIAK_CONN_BUSY, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return &srv->conns[i];
+    }
+  }
+}
+
+/** \brief Hold off reconnecting to a server after a failed connect.
+ *
+ * The wait doubles with each failure in a row, from
+ * RIAK_BACKOFF_MIN_MS up to \c rc->backoff_ms, and a random half of
+ * it is added so clients do not reconnect in step.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+void
+_riak_backoff(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int wait;
+
+  wait = __atomic_load_n(&srv->backoff_ms, __ATOMIC_RELAXED) * 2;
+  if (wait < RIAK_BACKOFF_MIN_MS) {
+    wait = RIAK_BACKOFF_MIN_MS;
+  }
+  if (wait > rc->backoff_ms) {
+    wait = rc->backoff_ms;
+  }
+  __atomic_store_n(&srv->backoff_ms, wait, __ATOMIC_RELAXED);
+  if (wait > 0) {
+    __atomic_store_n(&srv->retry_time,
+        _riak_now_ms() + wait / 2 + _riak_random() % (wait / 2 + 1),
+        __ATOMIC_RELAXED);
+  }
+}
+
+/** \brief Open a new connection in a free slot.
+ *
+ * With \c wait set the connect is completed before returning,
+ * otherwise it may still be in progress.  Returns NULL if the pool is
+ * full, the server is being backed off from or the connect fails.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param wait Set to wait for the connect to complete.
+ * \param deadline When to stop waiting (ms); 0 to never.
+ */
+static struct _RiakConn *
+_pool_open(RiakClient *rc, int server, int wait, uint64_t deadline)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakConn *conn;
+  uint64_t now = _riak_now_ms();
+
+  if (deadline && now >= deadline) {
+    _riak_error(rc, ETIMEDOUT, RIAK_ACT_TIMEOUT, 0);
+    return NULL;
+  } else if (now < __atomic_load_n(&srv->retry_time, __ATOMIC_RELAXED)) {
+    _riak_error(rc, ECONNREFUSED, RIAK_ACT_CONNECT, 0);
+    return NULL;
+  }
+  conn = _riak_pool_claim(rc, server);
+  if (!conn) {
+    return NULL;
+  }
+  conn->sd = _riak_connect_server(rc, server, wait, deadline);
+  if (conn->sd < 0) {
+    _riak_error(rc, errno,
+        errno == ETIMEDOUT? RIAK_ACT_TIMEOUT: RIAK_ACT_CONNECT, 0);
+    _slot_close(srv, conn);
+    _riak_backoff(rc, server);
+    _riak_breaker_fail(rc, server);
+    return NULL;
+  }
+  if (wait && __atomic_load_n(&srv->backoff_ms, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&srv->backoff_ms, 0, __ATOMIC_RELAXED);
+  }
+  conn->connecting = !wait;
+  conn->deadline = 0;
+  conn->created = conn->used = _riak_now_ms();
+  return conn;
+}
+
+/** \brief Check a connection out of a server's pool.
+ *
+ * The most recently used idle connection is preferred; stale ones
+ * found on the way are closed.  If there is none and \c open is set,
+ * a connection is opened unless the server already has \c pool_max.
+ * Connections opened here are connected on return when \c open is 1
+ * and may still be connecting when it is 2.  Returns NULL if no
+ * connection is available.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param open 0 for idle connections only, 1 to open and wait for a
+ *             new connection, 2 to open without waiting.
+ * \param deadline When to stop waiting for a connect (ms); 0 to never.
+ */
+struct _RiakConn *
+_riak_pool_get(RiakClient *rc, int server, int open, uint64_t deadline)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakConn *conn;
+  uint64_t now = 0;
+
+  if (!srv->host) {
+    return NULL;
+  }
+  while ((conn = _idle_pop(srv))) {
+    if (!now) {
+      now = _riak_now_ms();
+    }
+    if (!_pool_stale(rc, srv, conn, now)) {
+      return conn;
+    }
+    _slot_close(srv, conn);
+  }
+  if (!open) {
+    return NULL;
+  }
+  return _pool_open(rc, server, open == 1, deadline);
+}
+
+/** \brief Check a connection back in to its server's pool.
+ *
+ * Connections that are closed, past their lifetime, left with unread
+ * data or whose server has been removed are closed instead.
+ *
+ * \param rc RiakClient object.
+ * \param conn Connection to check in.
+ */
+void
+_riak_pool_put(RiakClient *rc, struct _RiakConn *conn)
+{
+  struct _RiakServer *srv = &rc->servers[conn->server];
+  uint64_t now = _riak_now_ms();
+
+  assert(__atomic_load_n(&conn->state, __ATOMIC_RELAXED) == RIAK_CONN_BUSY
+      && !conn->async
+      && conn->n_ops == 0);
+
+  if (conn->sd < 0 || !srv->host || _pool_expired(rc, conn, now)
+      || conn->rbuf.head != conn->rbuf.tail) {
+    _slot_close(srv, conn);
+  } else {
+    _riak_buf_empty(&conn->rbuf);
+    conn->wbuf.head = conn->wbuf.tail = 0;
+    conn->deadline = 0;
+    conn->used = now;
+    _idle_push(srv, conn);
+  }
+}
+
+/** \brief Set up the connection slots for a newly added server.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+int
+_riak_pool_init(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  int i;
+
+  _riak_pool_close(rc, server, 1);
+  srv->conns = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(struct _RiakConn) * rc->pool_max);
+  if (!srv->conns) {
+    _riak_error(rc, ENOMEM, RIAK_ACT_CONNECT, 0);
+    return -1;
+  }
+  memset(srv->conns, 0, sizeof(struct _RiakConn) * rc->pool_max);
+  for (i = 0; i < rc->pool_max; i++) {
+    srv->conns[i].sd = -1;
+    srv->conns[i].server = server;
+  }
+  srv->n_slots = rc->pool_max;
+  srv->idle = 0;
+  srv->backoff_ms = 0;
+  srv->retry_time = 0;
+  srv->n_conns = srv->n_idle = 0;
+  return 0;
+}
+
+/** \brief Close a server's connections.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param all Set to close every connection and free the slots;
+ *            otherwise only idle connections are closed and those
+ *            checked out are closed when checked in.
+ */
+void
+_riak_pool_close(RiakClient *rc, int server, int all)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakConn *conn;
+  int i;
+
+  if (!srv->conns) {
+    return;
+  }
+  while ((conn = _idle_pop(srv))) {
+    _slot_close(srv, conn);
+  }
+  if (all) {
+    for (i = 0; i < srv->n_slots; i++) {
+      conn = &srv->conns[i];
+      if (conn->sd >= 0) {
+        close(conn->sd);
+      }
+      _riak_buf_free(rc, &conn->wbuf);
+      _riak_buf_free(rc, &conn->rbuf);
+    }
+    rc->allocator->free(rc->allocator->allocator_data, srv->conns);
+    srv->conns = NULL;
+    srv->n_slots = 0;
+    srv->n_conns = 0;
+  }
+}
+
+/** \brief Configure the connection pools.
+ *
+ * Takes effect as connections are next checked in or out; call
+ * riak_pool_maintain() to apply a new minimum straight away.  A
+ * maximum above the one in force when a server was added applies only
+ * to servers added afterwards.
+ *
+ * \param rc Riak client object.
+ * \param min_conns Connections to keep open per server, even if idle.
+ * \param max_conns Maximum connections per server.
+ * \param idle_ms Close connections beyond \c min_conns after this many
+ *                milliseconds idle; 0 to keep them.
+ * \param life_ms Replace connections this many milliseconds old; 0 to
+ *                keep them indefinitely.
+ */
+void
+riak_pool_config(RiakClient *rc, int min_conns, int max_conns, int idle_ms,
+    int life_ms)
+{
+  assert(min_conns >= 0 && max_conns > 0 && min_conns <= max_conns);
+  assert(idle_ms >= 0 && life_ms >= 0);
+
+  rc->pool_min = min_conns;
+  rc->pool_max = max_conns;
+  rc->pool_idle_ms = idle_ms;
+  rc->pool_life_ms = life_ms;
+}
+
+/** \brief Defer connecting to servers until they are first used.
+ *
+ * With \c lazy set riak_server_add() only records the server; its
+ * connections are opened by the first request sent to it, by
+ * riak_servers_warmup() or by riak_pool_maintain().
+ *
+ * \param rc Riak client object.
+ * \param lazy Set to connect lazily.
+ */
+void
+riak_pool_lazy(RiakClient *rc, int lazy)
+{
+  rc->pool_lazy = lazy;
+}
+
+/** \brief Open connections until a server has its minimum.
+ *
+ * Returns 0 on success, -1 if a connection could not be opened.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ */
+int
+_riak_pool_fill(RiakClient *rc, int server)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakConn *conn;
+
+  while (__atomic_load_n(&srv->n_conns, __ATOMIC_RELAXED) < rc->pool_min) {
+    conn = _pool_open(rc, server, 1, 0);
+    if (!conn) {
+      return -1;
+    }
+    _idle_push(srv, conn);
+  }
+  return 0;
+}
+
+/** \brief Close stale idle connections.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param now Current time from _riak_now_ms().
+ */
+static void
+_pool_reap(RiakClient *rc, int server, uint64_t now)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakConn *conn, *keep = NULL;
+
+  /* Take every idle connection, most recent first, and put back the
+   * ones worth keeping in the same order. */
+  while ((conn = _idle_pop(srv))) {
+    if (_pool_stale(rc, srv, conn, now)) {
+      _slot_close(srv, conn);
+    } else {
+      conn->link = keep;
+      keep = conn;
+    }
+  }
+  while ((conn = keep)) {
+    keep = conn->link;
+    conn->link = NULL;
+    _idle_push(srv, conn);
+  }
+}
+
+/** \brief Ping a server's idle connections that have been quiet.
+ *
+ * Connections idle for \c keepalive_ms since their last use or ping
+ * are taken off the idle stack, pinged and put back; the rest go back
+ * straight away.  Round trips feed the server's latency.  Connections
+ * that do not answer are closed and count against the server's
+ * breaker.
+ *
+ * \param rc RiakClient object.
+ * \param server Index of the server.
+ * \param now Current time from _riak_now_ms().
+ */
+static void
+_pool_ping(RiakClient *rc, int server, uint64_t now)
+{
+  struct _RiakServer *srv = &rc->servers[server];
+  struct _RiakConn *conn, *keep = NULL, *due = NULL;
+  uint64_t quiet = (uint64_t)rc->keepalive_ms, start;
+
+  while ((conn = _idle_pop(srv))) {
+    if (now - (conn->pinged > conn->used? conn->pinged: conn->used)
+        >= quiet) {
+      conn->link = due;
+      due = conn;
+    } else {
+      conn->link = keep;
+      keep = conn;
+    }
+  }
+  while ((conn = keep)) {
+    keep = conn->link;
+    conn->link = NULL;
+    _idle_push(srv, conn);
+  }
+  while ((conn = due)) {
+    due = conn->link;
+    conn->link = NULL;
+    start = _riak_now_us();
+    if (_riak_ping_fd(conn->sd, RIAK_PROBE_TIMEOUT_MS) < 0) {
+      /* Half open or gone; better found now than by a request. */
+      _slot_close(srv, conn);
+      _riak_breaker_fail(rc, server);
+      continue;
+    }
+    _riak_lb_rtt(rc, server, _riak_now_us() - start);
+    conn->pinged = _riak_now_ms();
+    _idle_push(srv, conn);
+  }
+}
+
+/** \brief Close stale idle connections without opening any.
+ *
+ * Unlike riak_pool_maintain() this never blocks.
+ *
+ * \param rc RiakClient object.
+ */
+void
+_riak_pool_reap(RiakClient *rc)
+{
+  uint64_t now = _riak_now_ms();
+  int i;
+
+  for (i = 0; i < rc->n_servers; i++) {
+    if (rc->servers[i].host) {
+      _pool_reap(rc, i, now);
+    }
+  }
+}
+
+/** \brief Milliseconds until an idle connection goes stale.
+ *
+ * Returns -1 if none will.  Not safe against concurrent checkouts.
+ *
+ * \param rc RiakClient object.
+ */
+int
+_riak_pool_timeout(RiakClient *rc)
+{
+  struct _RiakServer *srv;
+  struct _RiakConn *conn;
+  uint64_t now = _riak_now_ms(), when, next = 0;
+  int i, j;
+
+  for (i = 0; i < rc->n_servers; i++) {
+    srv = &rc->servers[i];
+    for (j = 0; srv->host && j < srv->n_slots; j++) {
+      conn = &srv->conns[j];
+      if (conn->state != RIAK_CONN_IDLE) {
+        continue;
+      }
+      if (rc->pool_life_ms > 0) {
+        when = conn->created + rc->pool_life_ms;
+        if (!next || when < next) {
+          next = when;
+        }
+      }
+      if (rc->pool_idle_ms > 0 && srv->n_conns > rc->pool_min) {
+        when = conn->used + rc->pool_idle_ms;
+        if (!next || when < next) {
+          next = when;
+        }
+      }
+    }
+  }
+  if (!next) {
+    return -1;
+  }
+  return next > now? (int)(next - now): 0;
+}
+
+/** \brief Reap idle connections and top pools up to their minimum.
+ *
+ * Stale idle connections are otherwise only noticed when checked out,
+ * so long running clients should call this now and then while idle.
+ * With keep-warm pings configured, quiet connections are pinged too.
+ * Returns 0 on success, -1 if a connection could not be opened.
+ *
+ * \param rc Riak client object.
+ */
+int
+riak_pool_maintain(RiakClient *rc)
+{
+  uint64_t now = _riak_now_ms();
+  int i, ret = 0;
+
+  for (i = 0; i < rc->n_servers; i++) {
+    if (!rc->servers[i].host) {
+      continue;
+    }
+    _pool_reap(rc, i, now);
+    if (rc->keepalive_ms > 0) {
+      _pool_ping(rc, i, now);
+    }
+    if (_riak_pool_fill(rc, i) < 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/** \brief Thread body for the keep-warm pinger.
+ *
+ * Wakes every half interval to reap and ping idle connections.  It
+ * leaves opening connections to riak_pool_maintain() so that it never
+ * has an error to report.
+ *
+ * \param arg The client.
+ */
+static void *
+_keepalive_main(void *arg)
+{
+  RiakClient *rc = arg;
+  struct pollfd pfd;
+  uint64_t now;
+  int i, n, wait;
+
+  pfd.fd = rc->_keepalive->efd;
+  pfd.events = POLLIN;
+  wait = rc->keepalive_ms / 2 > 0? rc->keepalive_ms / 2: 1;
+  for (;;) {
+    n = poll(&pfd, 1, wait);
+    if (n > 0 || (n < 0 && errno != EINTR)) {
+      break;
+    }
+    now = _riak_now_ms();
+    for (i = 0; i < rc->n_servers; i++) {
+      if (rc->servers[i].host) {
+        _pool_reap(rc, i, now);
+        _pool_ping(rc, i, now);
+      }
+    }
+  }
+  return NULL;
+}
+
+/** \brief Start the keep-warm thread.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object.
+ */
+int
+_riak_keepalive_start(RiakClient *rc)
+{
+  struct _RiakKeepalive *ka;
+
+  ka = rc->allocator->alloc(rc->allocator->allocator_data, sizeof(*ka));
+  if (!ka) {
+    return -1;
+  }
+  ka->efd = eventfd(0, EFD_CLOEXEC);
+  if (ka->efd < 0) {
+    rc->allocator->free(rc->allocator->allocator_data, ka);
+    return -1;
+  }
+  rc->_keepalive = ka;
+  if (pthread_create(&ka->thread, NULL, _keepalive_main, rc) != 0) {
+    close(ka->efd);
+    rc->allocator->free(rc->allocator->allocator_data, ka);
+    rc->_keepalive = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** \brief Stop the keep-warm thread, if it is running.
+ *
+ * Returns 1 if it was running, 0 otherwise.
+ *
+ * \param rc RiakClient object.
+ */
+int
+_riak_keepalive_stop(RiakClient *rc)
+{
+  struct _RiakKeepalive *ka = rc->_keepalive;
+  uint64_t one = 1;
+
+  if (!ka) {
+    return 0;
+  }
+  if (write(ka->efd, &one, sizeof(one)) < 0) {
+    /* The counter cannot overflow from one write. */
+  }
+  (void)pthread_join(ka->thread, NULL);
+  close(ka->efd);
+  rc->allocator->free(rc->allocator->allocator_data, ka);
+  rc->_keepalive = NULL;
+  return 1;
+}
+
+/** \brief Keep idle connections warm with pings.
+ *
+ * Each pooled connection left idle for \c interval_ms is sent a ping,
+ * as riak_ping() sends.  That finds half-open sockets before a request
+ * does, so riak_servers_active() stays honest, keeps NAT and firewall
+ * state alive, and times the round trip so that quiet servers keep an
+ * up to date latency for server selection.  A connection that does not
+ * answer is closed and counts against its server's breaker.
+ *
+ * Pings are sent by riak_pool_maintain(), or with \c background set by
+ * a thread of the client's own that runs until riak_servers_disconnect()
+ * or until this is called again without it.  Returns 0 on success, -1
+ * if the thread could not be started.
+ *
+ * \param rc Riak client object.
+ * \param interval_ms Idle time before a connection is pinged; 0 to stop.
+ * \param background Set to ping from a background thread.
+ */
+int
+riak_keepalive_config(RiakClient *rc, int interval_ms, int background)
+{
+  assert(interval_ms >= 0);
+
+  (void)_riak_keepalive_stop(rc);
+  rc->keepalive_ms = interval_ms;
+  if (interval_ms > 0 && background) {
+    return _riak_keepalive_start(rc);
+  }
+  return 0;
+}
@@ -0,0 +1,520 @@
+/** \file
+ *
+ * \brief Thread-per-core sharded runtime.
+ *
+ * riak_shards_init() turns a configured client into a set of shards.
+ * Each shard is a private RiakClient, with its own slice of every
+ * server's connection pool, its own sessions and buffers, driven by a
+ * worker thread pinned to one CPU.  Nothing on a shard's hot path is
+ * shared with another thread, so no locks or atomics are needed
+ * there.
+ *
+ * Work reaches a shard as a task posted to it.  Every shard has one
+ * single producer, single consumer ring per sender: one for each
+ * other shard and one for the application thread.  A ring has one
+ * writer and one reader, so posting takes no lock.  The
+ * worker sleeps in poll() on an eventfd and its asynchronous engine's
+ * epoll descriptor; senders only write the eventfd if it is asleep.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif /* S_SPLINT_S */
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** Tasks each ring can hold; a power of two. */
+#define RIAK_SHARD_QUEUE 1024
+/** How often a worker maintains its pools (ms). */
+#define RIAK_SHARD_TICK_MS 1000
+/** Assumed cache line size, to keep ring ends apart. */
+#define RIAK_CACHE_LINE 64
+
+/** \brief A task posted to a shard. */
+struct _RiakTaskEnt {
+  RiakTask fn;   ///< Function to run on the shard.
+  void *data;    ///< Passed to \c fn.
+};
+
+/** \brief Single producer, single consumer ring of tasks. */
+struct _RiakRing {
+  unsigned head __attribute__((aligned(RIAK_CACHE_LINE)));  ///< Reader.
+  unsigned tail __attribute__((aligned(RIAK_CACHE_LINE)));  ///< Writer.
+  struct _RiakTaskEnt ents[RIAK_SHARD_QUEUE];  ///< Posted tasks.
+};
+
+/** \brief One shard: a private client and the thread that drives it. */
+struct _RiakShard {
+  RiakClient *rc;           ///< The shard's client.
+  struct _RiakShards *rs;   ///< Owning runtime.
+  int index;                ///< Shard number.
+  int cpu;                  ///< CPU the worker is pinned to; or -1.
+  int efd;                  ///< eventfd to wake the worker.
+  int sleeping;             ///< Set while the worker waits in poll().
+  int started;              ///< Set once the worker thread exists.
+  pthread_t thread;         ///< The worker.
+  struct _RiakRing *rings;  ///< Inbound rings, one per sender.
+};
+
+/** \brief Sharded runtime. */
+struct _RiakShards {
+  ProtobufCAllocator *allocator;  ///< Allocator for the runtime itself.
+  struct _RiakShard *shards;      ///< The shards.
+  int n_shards;                   ///< Number of shards.
+  int stop;                       ///< Set to stop the workers.
+};
+
+/** \brief Shard the calling thread is the worker for; or NULL. */
+static __thread struct _RiakShard *_riak_shard_self;
+
+/** \brief Index of the ring \c sh reads for tasks from the caller.
+ *
+ * Workers of the same runtime use their own ring; any other thread
+ * uses the last one.
+ *
+ * \param sh Destination shard.
+ */
+static int
+_ring_for_caller(struct _RiakShard *sh)
+{
+  struct _RiakShard *self = _riak_shard_self;
+
+  if (self && self->rs == sh->rs) {
+    return self->index;
+  }
+  return sh->rs->n_shards;
+}
+
+/** \brief Run the tasks waiting in a shard's rings.
+ *
+ * Returns the number of tasks run.
+ *
+ * \param sh Shard, which must be the caller's.
+ */
+static int
+_shard_drain(struct _RiakShard *sh)
+{
+  struct _RiakRing *ring;
+  struct _RiakTaskEnt ent;
+  unsigned head, tail;
+  int i, done = 0;
+
+  for (i = 0; i <= sh->rs->n_shards; i++) {
+    ring = &sh->rings[i];
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      ent = ring->ents[head & (RIAK_SHARD_QUEUE - 1)];
+      head++;
+      __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+      ent.fn(sh->rc, ent.data);
+      done++;
+    }
+  }
+  return done;
+}
+
+/** \brief Whether a shard has tasks waiting.
+ *
+ * \param sh Shard.
+ */
+static int
+_shard_waiting(struct _RiakShard *sh)
+{
+  struct _RiakRing *ring;
+  int i;
+
+  for (i = 0; i <= sh->rs->n_shards; i++) {
+    ring = &sh->rings[i];
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+        != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** \brief Wait for tasks, I/O or the next maintenance tick.
+ *
+ * \param sh Shard, which must be the caller's.
+ * \param timeout_ms Longest to wait.
+ */
+static void
+_shard_sleep(struct _RiakShard *sh, int timeout_ms)
+{
+  struct pollfd pfd[2];
+  uint64_t count;
+  int n = 1;
+
+  pfd[0].fd = sh->efd;
+  pfd[0].events = POLLIN;
+  if (riak_async_pending(sh->rc) > 0) {
+    pfd[1].fd = sh->rc->_async->epfd;
+    pfd[1].events = POLLIN;
+    n++;
+  }
+  /* Posters check this after queueing, so either they see it set and
+   * wake us or we see their task here. */
+  __atomic_store_n(&sh->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (!_shard_waiting(sh)
+      && !__atomic_load_n(&sh->rs->stop, __ATOMIC_SEQ_CST)) {
+    (void)poll(pfd, n, timeout_ms);
+  }
+  __atomic_store_n(&sh->sleeping, 0, __ATOMIC_SEQ_CST);
+  if (read(sh->efd, &count, sizeof(count)) < 0) {
+    /* Nothing to clear. */
+  }
+}
+
+/** \brief Worker thread for a shard.
+ *
+ * \param arg The shard.
+ */
+static void *
+_shard_main(void *arg)
+{
+  struct _RiakShard *sh = arg;
+  cpu_set_t cpus;
+  uint64_t now, tick;
+  int done, wait, due;
+
+  if (sh->cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(sh->cpu, &cpus);
+    /* Pinning is best effort; an unpinned shard still works. */
+    (void)pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+  _riak_shard_self = sh;
+  tick = _riak_now_ms() + RIAK_SHARD_TICK_MS;
+
+  while (!__atomic_load_n(&sh->rs->stop, __ATOMIC_ACQUIRE)) {
+    done = _shard_drain(sh);
+    if (riak_async_pending(sh->rc) > 0) {
+      done += riak_async_run(sh->rc, 0) > 0;
+    }
+    now = _riak_now_ms();
+    if (now >= tick) {
+      (void)riak_pool_maintain(sh->rc);
+      tick = now + RIAK_SHARD_TICK_MS;
+    }
+    if (!done) {
+      /* Wake in time to fail requests that run out of time. */
+      wait = (int)(tick - now);
+      due = _riak_async_due(sh->rc);
+      _shard_sleep(sh, due >= 0 && due < wait? due: wait);
+    }
+  }
+  /* Let outstanding requests finish before the client goes away. */
+  while (riak_async_pending(sh->rc) > 0
+      && riak_async_run(sh->rc, -1) >= 0) {
+  }
+  _riak_shard_self = NULL;
+  return NULL;
+}
+
+/** \brief Returns a shard's share of a limit; 0 stays no limit.
+ *
+ * Rounded up so that every shard may send something.
+ *
+ * \param limit The client's limit.
+ * \param n_shards Number of shards.
+ */
+static int
+_shard_share(int limit, int n_shards)
+{
+  return limit > 0? (limit + n_shards - 1) / n_shards: 0;
+}
+
+/** \brief Find the CPUs a shard's worker may be pinned to.
+ *
+ * Returns the number of CPUs put in \c cpus.
+ *
+ * \param cpus Filled with the CPUs the process may run on.
+ * \param max Size of \c cpus.
+ */
+static int
+_allowed_cpus(int *cpus, int max)
+{
+  cpu_set_t set;
+  int i, n = 0;
+
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+    return 0;
+  }
+  for (i = 0; i < CPU_SETSIZE && n < max; i++) {
+    if (CPU_ISSET(i, &set)) {
+      cpus[n++] = i;
+    }
+  }
+  return n;
+}
+
+/** \brief Make a shard's client from the template client.
+ *
+ * The shard gets the template's servers, transport and asynchronous
+ * settings, and a 1/n_shards slice of its pool limits.  Returns NULL
+ * on failure.
+ *
+ * \param rc Template client.
+ * \param n_shards Number of shards the pools are split between.
+ */
+static RiakClient *
+_shard_client(RiakClient *rc, int n_shards)
+{
+  RiakClient *sc;
+  int i, min_conns, max_conns;
+
+  sc = riak_client_init_transport(rc->allocator, rc->n_servers,
+      rc->_uring? RIAK_TRANSPORT_URING: RIAK_TRANSPORT_SOCKET);
+  if (!sc) {
+    return NULL;
+  }
+  max_conns = rc->pool_max / n_shards;
+  if (max_conns < 1) {
+    max_conns = 1;
+  }
+  min_conns = (rc->pool_min + n_shards - 1) / n_shards;
+  if (min_conns > max_conns) {
+    min_conns = max_conns;
+  }
+  riak_pool_config(sc, min_conns, max_conns, rc->pool_idle_ms,
+      rc->pool_life_ms);
+  riak_pool_lazy(sc, rc->pool_lazy);
+  riak_dns_config(sc, rc->dns_ttl_ms);
+  riak_breaker_config(sc, rc->breaker_fails, rc->breaker_ms);
+  riak_timeout_config(sc, rc->timeout_ms);
+  riak_retry_config(sc, rc->retries, rc->backoff_ms);
+  riak_hedge_config(sc, rc->hedge_pct);
+  /* The worker's pool maintenance sends the pings. */
+  (void)riak_keepalive_config(sc, rc->keepalive_ms, 0);
+  /* Shards share the client's limits out as they do the pools. */
+  riak_limit_config(sc, _shard_share(rc->limit_rate, n_shards),
+      _shard_share(rc->limit_burst, n_shards),
+      _shard_share(rc->limit_in_flight, n_shards),
+      rc->limit_block);
+  riak_node_limit_config(sc, _shard_share(rc->node_rate, n_shards),
+      _shard_share(rc->node_burst, n_shards),
+      _shard_share(rc->node_in_flight, n_shards));
+  riak_node_adapt_config(sc, _shard_share(rc->adapt_min, n_shards),
+      _shard_share(rc->adapt_max, n_shards));
+  riak_lane_config(sc, _shard_share(rc->lane_bulk, n_shards));
+  riak_arena_config(sc, rc->arena_size, rc->arena_keep);
+  riak_view_config(sc, rc->view_min);
+  if (rc->_async) {
+    if (riak_async_init(sc, rc->_async->max_conns) < 0
+        || riak_async_pipeline(sc, rc->_async->depth) < 0) {
+      riak_servers_disconnect(sc);
+      return NULL;
+    }
+  }
+  for (i = 0; i < rc->n_servers; i++) {
+    if (rc->servers[i].host) {
+      (void)riak_server_add(sc, rc->servers[i].host, rc->servers[i].port);
+    }
+  }
+  return sc;
+}
+
+/** \brief Create a sharded runtime.
+ *
+ * \c rc is used as a template: each of the \c n_shards shards gets a
+ * client with the same servers, transport and asynchronous settings,
+ * and an even share of its pool limits (at least one connection per
+ * server).  Each shard is driven by its own thread, pinned to one of
+ * the CPUs the process may use.  The template is not used by the
+ * runtime and may be disconnected afterwards.  Returns NULL on
+ * failure.
+ *
+ * \param rc Configured client to copy.
+ * \param n_shards Number of shards; 0 for one per CPU.
+ */
+RiakShards *
+riak_shards_init(RiakClient *rc, int n_shards)
+{
+  struct _RiakShards *rs;
+  struct _RiakShard *sh;
+  int *cpus, n_cpus, i, ok = 1;
+
+  cpus = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(int) * CPU_SETSIZE);
+  if (!cpus) {
+    _riak_error(rc, ENOMEM, RIAK_ACT_CONNECT, 0);
+    return NULL;
+  }
+  n_cpus = _allowed_cpus(cpus, CPU_SETSIZE);
+  if (n_shards <= 0) {
+    n_shards = n_cpus > 0? n_cpus: 1;
+  }
+
+  rs = rc->allocator->alloc(rc->allocator->allocator_data, sizeof(*rs));
+  if (!rs) {
+    rc->allocator->free(rc->allocator->allocator_data, cpus);
+    _riak_error(rc, ENOMEM, RIAK_ACT_CONNECT, 0);
+    return NULL;
+  }
+  memset(rs, 0, sizeof(*rs));
+  rs->allocator = rc->allocator;
+  rs->shards = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(struct _RiakShard) * n_shards);
+  if (!rs->shards) {
+    rc->allocator->free(rc->allocator->allocator_data, cpus);
+    rc->allocator->free(rc->allocator->allocator_data, rs);
+    _riak_error(rc, ENOMEM, RIAK_ACT_CONNECT, 0);
+    return NULL;
+  }
+  memset(rs->shards, 0, sizeof(struct _RiakShard) * n_shards);
+  rs->n_shards = n_shards;
+  for (i = 0; i < n_shards; i++) {
+    rs->shards[i].efd = -1;
+  }
+
+  for (i = 0; i < n_shards && ok; i++) {
+    sh = &rs->shards[i];
+    sh->rs = rs;
+    sh->index = i;
+    sh->cpu = n_cpus > 0? cpus[i % n_cpus]: -1;
+    sh->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    /* Aligned for the rings' cache line padding. */
+    if (posix_memalign((void **)&sh->rings, RIAK_CACHE_LINE,
+          sizeof(struct _RiakRing) * (n_shards + 1)) != 0) {
+      sh->rings = NULL;
+    }
+    sh->rc = _shard_client(rc, n_shards);
+    if (sh->efd < 0 || !sh->rings || !sh->rc) {
+      _riak_error(rc, sh->efd < 0? errno: ENOMEM, RIAK_ACT_CONNECT, 0);
+      ok = 0;
+      break;
+    }
+    memset(sh->rings, 0, sizeof(struct _RiakRing) * (n_shards + 1));
+  }
+  rc->allocator->free(rc->allocator->allocator_data, cpus);
+
+  for (i = 0; i < n_shards && ok; i++) {
+    sh = &rs->shards[i];
+    if (pthread_create(&sh->thread, NULL, _shard_main, sh) != 0) {
+      _riak_error(rc, EAGAIN, RIAK_ACT_CONNECT, 0);
+      ok = 0;
+      break;
+    }
+    sh->started = 1;
+  }
+  if (!ok) {
+    riak_shards_free(rs);
+    return NULL;
+  }
+  return rs;
+}
+
+/** \brief Returns the number of shards.
+ *
+ * \param rs Sharded runtime.
+ */
+int
+riak_shards_count(RiakShards *rs)
+{
+  return rs->n_shards;
+}
+
+/** \brief Returns the shard the calling thread drives; -1 if none.
+ *
+ * \param rs Sharded runtime.
+ */
+int
+riak_shard_current(RiakShards *rs)
+{
+  struct _RiakShard *self = _riak_shard_self;
+
+  return self && self->rs == rs? self->index: -1;
+}
+
+/** \brief Run a task on a shard.
+ *
+ * \c fn is called on the shard's thread with the shard's client, which
+ * it may use freely, synchronously or asynchronously; completions of
+ * asynchronous requests are driven by the shard.  Tasks from one
+ * sender run in the order they were posted.  Shards may post to each
+ * other; outside the runtime only one thread may post.  Returns 0 on
+ * success, -1 if the shard's queue from this sender is full.
+ *
+ * \param rs Sharded runtime.
+ * \param shard Shard to run the task on.
+ * \param fn The task.
+ * \param data Passed to \c fn.
+ */
+int
+riak_shards_post(RiakShards *rs, int shard, RiakTask fn, void *data)
+{
+  struct _RiakShard *sh = &rs->shards[shard];
+  struct _RiakRing *ring = &sh->rings[_ring_for_caller(sh)];
+  unsigned tail = ring->tail;
+  uint64_t one = 1;
+
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+      >= RIAK_SHARD_QUEUE) {
+    return -1;
+  }
+  ring->ents[tail & (RIAK_SHARD_QUEUE - 1)].fn = fn;
+  ring->ents[tail & (RIAK_SHARD_QUEUE - 1)].data = data;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&sh->sleeping, __ATOMIC_SEQ_CST)) {
+    if (write(sh->efd, &one, sizeof(one)) < 0) {
+      /* The counter is already non-zero. */
+    }
+  }
+  return 0;
+}
+
+/** \brief Stop and free a sharded runtime.
+ *
+ * Tasks already posted are run and outstanding asynchronous requests
+ * are completed before each shard's client is disconnected.  Must not
+ * be called from a shard.
+ *
+ * \param rs Sharded runtime.
+ */
+void
+riak_shards_free(RiakShards *rs)
+{
+  struct _RiakShard *sh;
+  uint64_t one = 1;
+  int i;
+
+  for (i = 0; i < rs->n_shards; i++) {
+    sh = &rs->shards[i];
+    if (sh->started) {
+      while (_shard_waiting(sh)) {
+        sched_yield();
+      }
+    }
+  }
+  __atomic_store_n(&rs->stop, 1, __ATOMIC_SEQ_CST);
+  for (i = 0; i < rs->n_shards; i++) {
+    sh = &rs->shards[i];
+    if (sh->started) {
+      if (write(sh->efd, &one, sizeof(one)) < 0) {
+        /* The counter is already non-zero. */
+      }
+      pthread_join(sh->thread, NULL);
+    }
+    if (sh->rc) {
+      riak_servers_disconnect(sh->rc);
+    }
+    if (sh->efd >= 0) {
+      close(sh->efd);
+    }
+    free(sh->rings);
+  }
+  rs->allocator->free(rs->allocator->allocator_data, rs->shards);
+  rs->allocator->free(rs->allocator->allocator_data, rs);
+}
@@ -0,0 +1,276 @@
+/** \file
+ *
+ * \brief Size class allocator.
+ *
+ * riak_slab_allocator is a ProtobufCAllocator for riak_client_init()
+ * tuned to what the library allocates: responses, sessions, unpacked
+ * messages and their fields, which are small, and frame buffers,
+ * which are powers of two from 256 bytes.  Each request is rounded up
+ * to one of a few size classes and served from a free list of blocks
+ * of that class.
+ *
+ * Every thread keeps its own free lists, so most allocations and
+ * frees take no lock.  A thread trades blocks with a shared list per
+ * class in batches when its own list runs dry or grows too long, and
+ * returns them all there when it exits.  New blocks are carved from
+ * slabs of RIAK_SLAB_SIZE bytes, which are never given back to the
+ * system.  Requests above the largest class go to malloc().
+ *
+ * Each block starts with a header naming its class, so that free can
+ * tell where it belongs.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "riakccs/api.h"
+
+/** Bytes carved into blocks at a time. */
+#define RIAK_SLAB_SIZE 65536
+/** Bytes in front of each block, keeping blocks 16 byte aligned. */
+#define RIAK_SLAB_HDR 16
+/** Number of size classes. */
+#define RIAK_SLAB_CLASSES 17
+/** Class of blocks that came from malloc(). */
+#define RIAK_SLAB_LARGE RIAK_SLAB_CLASSES
+
+/** \brief Bytes usable in a block of each class. */
+static const size_t _slab_sizes[RIAK_SLAB_CLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+  3072, 4096, 8192
+};
+
+/** \brief Free blocks of one class. */
+struct _SlabList {
+  void *head;                ///< First free block; or NULL.
+  int n;                     ///< Number of blocks in the list.
+};
+
+/** \brief Blocks shared between threads, by class. */
+static struct {
+  struct _SlabList list;     ///< The blocks.
+  char lock;                 ///< Guards \c list.
+} _slab_shared[RIAK_SLAB_CLASSES];
+
+/** \brief The calling thread's free blocks, by class. */
+static __thread struct _SlabList _slab_cache[RIAK_SLAB_CLASSES];
+
+/** \brief Set once the calling thread's cache will be flushed at exit. */
+static __thread int _slab_registered;
+
+static pthread_key_t _slab_key;
+static pthread_once_t _slab_once = PTHREAD_ONCE_INIT;
+
+/** \brief Returns the most blocks a thread keeps of a class.
+ *
+ * About a slab's worth, and never fewer than four.
+ *
+ * \param c The class.
+ */
+static int
+_slab_cache_max(int c)
+{
+  int n = RIAK_SLAB_SIZE / (int)(_slab_sizes[c] + RIAK_SLAB_HDR);
+
+  return n < 4? 4: n;
+}
+
+/** \brief Returns the block header's class field.
+ *
+ * \param p The block, as handed out.
+ */
+static uint32_t *
+_slab_class(void *p)
+{
+  return (uint32_t *)((uint8_t *)p - RIAK_SLAB_HDR);
+}
+
+/** \brief Move up to \c n blocks from one list to another.
+ *
+ * \param to List to move blocks to.
+ * \param from List to move blocks from.
+ * \param n Number of blocks to move.
+ */
+static void
+_slab_move(struct _SlabList *to, struct _SlabList *from, int n)
+{
+  void *p;
+
+  while (n-- > 0 && from->head) {
+    p = from->head;
+    from->head = *(void **)p;
+    from->n--;
+    *(void **)p = to->head;
+    to->head = p;
+    to->n++;
+  }
+}
+
+/** \brief Take the shared list lock of a class.
+ *
+ * \param c The class.
+ */
+static void
+_slab_lock(int c)
+{
+  while (__atomic_test_and_set(&_slab_shared[c].lock, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+/** \brief Release the shared list lock of a class.
+ *
+ * \param c The class.
+ */
+static void
+_slab_unlock(int c)
+{
+  __atomic_clear(&_slab_shared[c].lock, __ATOMIC_RELEASE);
+}
+
+/** \brief Give a thread's cached blocks to the shared lists.
+ *
+ * The thread exit destructor of \c _slab_key.
+ *
+ * \param data Unused.
+ */
+static void
+_slab_flush(void *data)
+{
+  int c;
+
+  (void)data;
+  for (c = 0; c < RIAK_SLAB_CLASSES; c++) {
+    if (_slab_cache[c].n > 0) {
+      _slab_lock(c);
+      _slab_move(&_slab_shared[c].list, &_slab_cache[c], _slab_cache[c].n);
+      _slab_unlock(c);
+    }
+  }
+}
+
+/** \brief Create the key whose destructor flushes thread caches. */
+static void
+_slab_init(void)
+{
+  (void)pthread_key_create(&_slab_key, _slab_flush);
+}
+
+/** \brief Have the calling thread's cache flushed when it exits. */
+static void
+_slab_register(void)
+{
+  if (!_slab_registered) {
+    (void)pthread_once(&_slab_once, _slab_init);
+    /* Any value but NULL has the destructor called. */
+    (void)pthread_setspecific(_slab_key, _slab_cache);
+    _slab_registered = 1;
+  }
+}
+
+/** \brief Fill the calling thread's list of a class.
+ *
+ * Takes half a cache's worth from the shared list, or carves a new
+ * slab if that is empty.  Returns -1 if memory runs out.
+ *
+ * \param c The class.
+ */
+static int
+_slab_refill(int c)
+{
+  struct _SlabList *cache = &_slab_cache[c];
+  size_t size = _slab_sizes[c] + RIAK_SLAB_HDR, off;
+  uint8_t *slab;
+
+  _slab_register();
+  _slab_lock(c);
+  _slab_move(cache, &_slab_shared[c].list, _slab_cache_max(c) / 2);
+  _slab_unlock(c);
+  if (cache->head) {
+    return 0;
+  }
+  slab = malloc(RIAK_SLAB_SIZE);
+  if (!slab) {
+    return -1;
+  }
+  for (off = 0; off + size <= RIAK_SLAB_SIZE; off += size) {
+    *(uint32_t *)(slab + off) = c;
+    *(void **)(slab + off + RIAK_SLAB_HDR) = cache->head;
+    cache->head = slab + off + RIAK_SLAB_HDR;
+    cache->n++;
+  }
+  return 0;
+}
+
+/** \brief Allocate memory; the ProtobufCAllocator alloc hook.
+ *
+ * \param allocator_data Unused.
+ * \param size Bytes wanted.
+ */
+static void *
+_slab_alloc(void *allocator_data, size_t size)
+{
+  struct _SlabList *cache;
+  uint8_t *p;
+  int c;
+
+  (void)allocator_data;
+  for (c = 0; c < RIAK_SLAB_CLASSES && _slab_sizes[c] < size; c++)
+    ;
+  if (c == RIAK_SLAB_CLASSES) {
+    p = malloc(RIAK_SLAB_HDR + size);
+    if (!p) {
+      return NULL;
+    }
+    *(uint32_t *)p = RIAK_SLAB_LARGE;
+    return p + RIAK_SLAB_HDR;
+  }
+  cache = &_slab_cache[c];
+  if (!cache->head && _slab_refill(c) < 0) {
+    return NULL;
+  }
+  p = cache->head;
+  cache->head = *(void **)p;
+  cache->n--;
+  return p;
+}
+
+/** \brief Free memory; the ProtobufCAllocator free hook.
+ *
+ * A thread holding more than a cache's worth of a class passes half
+ * of them to the shared list.
+ *
+ * \param allocator_data Unused.
+ * \param p Memory from _slab_alloc(); or NULL.
+ */
+static void
+_slab_free(void *allocator_data, void *p)
+{
+  struct _SlabList *cache;
+  uint32_t c;
+
+  (void)allocator_data;
+  if (!p) {
+    return;
+  }
+  c = *_slab_class(p);
+  if (c == RIAK_SLAB_LARGE) {
+    free(_slab_class(p));
+    return;
+  }
+  _slab_register();
+  cache = &_slab_cache[c];
+  *(void **)p = cache->head;
+  cache->head = p;
+  if (++cache->n > _slab_cache_max(c)) {
+    _slab_lock(c);
+    _slab_move(&_slab_shared[c].list, cache, cache->n / 2);
+    _slab_unlock(c);
+  }
+}
+
+ProtobufCAllocator riak_slab_allocator = {
+  .alloc = &_slab_alloc,
+  .free = &_slab_free,
+  .allocator_data = NULL,
+};
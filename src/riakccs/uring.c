@@ -0,0 +1,443 @@
+/** \file
+ *
+ * \brief io_uring transport.
+ *
+ * An alternative to the plain socket calls behind \c rc->_write and
+ * \c rc->_read, selected with riak_client_init_transport().  Writing a
+ * request makes no system call: the frame waits in the connection's
+ * send buffer until the response is read.  The send and the receive
+ * are then submitted to the ring together as a linked pair, so a
+ * request costs one io_uring_enter() instead of a write() and a read().
+ *
+ * Receive buffers are carved out of memory registered with the ring,
+ * which saves the kernel mapping the pages on every read.  If the
+ * registration is refused (RLIMIT_MEMLOCK on older kernels) or every
+ * registered buffer is taken, ordinary buffers and receives are used.
+ *
+ * liburing is not needed; the ring is driven with the raw system
+ * calls.  Where the system headers lack io_uring the transport is
+ * reported as unavailable.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifndef S_SPLINT_S
+#include <unistd.h>
+#endif /* S_SPLINT_S */
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif /* __NR_io_uring_setup */
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+#ifdef __NR_io_uring_setup
+
+/** Submission queue entries; a request needs at most two. */
+#define RIAK_URING_ENTRIES 8
+/** Number of registered receive buffers. */
+#define RIAK_URING_BUFS 8
+/** Size of each registered receive buffer. */
+#define RIAK_URING_BUF_SIZE (4 * RIAK_RBUF_MIN)
+
+/** user_data tags for completions. */
+#define RIAK_URING_SEND 0
+#define RIAK_URING_RECV 1
+#define RIAK_URING_TIMEOUT 2
+
+/** \brief State of the io_uring transport. */
+struct _RiakUring {
+  int fd;                     ///< The ring descriptor.
+  unsigned *sq_tail;          ///< Submission queue tail.
+  unsigned *sq_mask;          ///< Submission queue index mask.
+  unsigned *sq_array;         ///< Submission queue index array.
+  unsigned *cq_head;          ///< Completion queue head.
+  unsigned *cq_tail;          ///< Completion queue tail.
+  unsigned *cq_mask;          ///< Completion queue index mask.
+  struct io_uring_sqe *sqes;  ///< Submission queue entries.
+  struct io_uring_cqe *cqes;  ///< Completion queue entries.
+  void *sq_ring;              ///< Mapping of the submission ring.
+  void *cq_ring;              ///< Mapping of the completion ring.
+  size_t sq_ring_len;         ///< Length of \c sq_ring.
+  size_t cq_ring_len;         ///< Length of \c cq_ring.
+  size_t sqes_len;            ///< Length of \c sqes.
+  uint8_t *bufs;              ///< Registered receive buffers; or NULL.
+  int free_bufs[RIAK_URING_BUFS];  ///< Indexes of unused buffers.
+  int n_free;                 ///< Number of entries in \c free_bufs.
+};
+
+/** \brief Queue a submission.
+ *
+ * \param ru Ring state.
+ * \param op IORING_OP_* code.
+ * \param fd Socket to operate on.
+ * \param addr Buffer address.
+ * \param len Buffer length.
+ * \param flags IOSQE_* flags.
+ * \param tag RIAK_URING_SEND, RIAK_URING_RECV or RIAK_URING_TIMEOUT.
+ */
+static struct io_uring_sqe *
+_uring_prep(struct _RiakUring *ru, uint8_t op, int fd, void *addr,
+    size_t len, uint8_t flags, int tag)
+{
+  unsigned tail = *ru->sq_tail, idx = tail & *ru->sq_mask;
+  struct io_uring_sqe *sqe = &ru->sqes[idx];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = op;
+  sqe->flags = flags;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)addr;
+  sqe->len = len;
+  sqe->user_data = tag;
+  ru->sq_array[idx] = idx;
+  __atomic_store_n(ru->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+/** \brief Submit queued entries and wait for their completions.
+ *
+ * Results are stored in \c res by tag.  Returns 0 on success, -1 on
+ * failure with errno set.
+ *
+ * \param ru Ring state.
+ * \param n Number of entries queued.
+ * \param res Results, indexed by tag.
+ */
+static int
+_uring_submit(struct _RiakUring *ru, unsigned n, int *res)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head, tail, done = 0, submit = n;
+  int ret;
+
+  while (done < n) {
+    ret = syscall(__NR_io_uring_enter, ru->fd, submit, n - done,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR) {
+      return -1;
+    } else if (ret > 0) {
+      submit -= ret;
+    }
+    head = *ru->cq_head;
+    tail = __atomic_load_n(ru->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      cqe = &ru->cqes[head & *ru->cq_mask];
+      res[cqe->user_data] = cqe->res;
+      done++;
+    }
+    __atomic_store_n(ru->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/** \brief Send what is pending and read until \c want bytes are buffered.
+ *
+ * Takes a registered buffer for the connection's receive buffer if it
+ * has none yet.  With a deadline set the receive is linked to a
+ * timeout for the time left.  Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object - for the ring and error reporting.
+ * \param conn Connection to use.
+ * \param want Number of unconsumed bytes needed in the receive buffer.
+ * \param act Error action to report on a failed receive.
+ */
+static int
+_uring_fill(RiakClient *rc, struct _RiakConn *conn, size_t want, int act)
+{
+  struct _RiakUring *ru = rc->_uring;
+  struct _RiakBuf *rbuf = &conn->rbuf, *wbuf = &conn->wbuf;
+  struct io_uring_sqe *sqe;
+  struct __kernel_timespec ts;
+  int res[3], idx, sent;
+  int64_t left;
+  unsigned n;
+
+  if (!rbuf->data && ru->n_free > 0) {
+    idx = ru->free_bufs[--ru->n_free];
+    rbuf->data = ru->bufs + (size_t)idx * RIAK_URING_BUF_SIZE;
+    rbuf->size = RIAK_URING_BUF_SIZE;
+    rbuf->head = rbuf->tail = 0;
+    rbuf->fixed = 1;
+  }
+  if (rbuf->head + want > rbuf->size
+      && _riak_buf_reserve(rc, rbuf,
+        want < RIAK_RBUF_MIN? RIAK_RBUF_MIN: want) < 0) {
+    _riak_error(rc, ENOMEM, act, 0);
+    return -1;
+  }
+
+  while (rbuf->tail - rbuf->head < want || wbuf->head < wbuf->tail) {
+    n = 0;
+    sent = 0;
+    res[RIAK_URING_SEND] = res[RIAK_URING_RECV] = -ECANCELED;
+    res[RIAK_URING_TIMEOUT] = -ECANCELED;
+    if (wbuf->head < wbuf->tail) {
+      (void)_uring_prep(ru, IORING_OP_SEND, conn->sd,
+          wbuf->data + wbuf->head, wbuf->tail - wbuf->head,
+          rbuf->tail - rbuf->head < want? IOSQE_IO_LINK: 0,
+          RIAK_URING_SEND);
+      n++;
+      sent = 1;
+    }
+    if (rbuf->tail - rbuf->head < want) {
+      left = conn->deadline? (int64_t)(conn->deadline - _riak_now_ms()): 0;
+      if (conn->deadline && left <= 0) {
+        /* Nothing is queued unless a send is; let it go first. */
+        if (!sent) {
+          _riak_error(rc, ETIMEDOUT, RIAK_ACT_TIMEOUT, 0);
+          return -1;
+        }
+        left = 1;
+      }
+      sqe = _uring_prep(ru, rbuf->fixed? IORING_OP_READ_FIXED: IORING_OP_RECV,
+          conn->sd, rbuf->data + rbuf->tail, rbuf->size - rbuf->tail,
+          conn->deadline? IOSQE_IO_LINK: 0, RIAK_URING_RECV);
+      if (rbuf->fixed) {
+        sqe->buf_index = (rbuf->data - ru->bufs) / RIAK_URING_BUF_SIZE;
+      }
+      n++;
+      if (conn->deadline) {
+        ts.tv_sec = left / 1000;
+        ts.tv_nsec = (left % 1000) * 1000000;
+        (void)_uring_prep(ru, IORING_OP_LINK_TIMEOUT, -1, &ts, 1, 0,
+            RIAK_URING_TIMEOUT);
+        n++;
+      }
+    }
+    if (_uring_submit(ru, n, res) < 0) {
+      _riak_error(rc, errno, act, 0);
+      return -1;
+    }
+
+    if (wbuf->head < wbuf->tail) {
+      if (res[RIAK_URING_SEND] <= 0) {
+        _riak_error(rc, -res[RIAK_URING_SEND], RIAK_ACT_WRITE,
+            res[RIAK_URING_SEND]);
+        return -1;
+      }
+      wbuf->head += res[RIAK_URING_SEND];
+      if (wbuf->head == wbuf->tail) {
+        wbuf->head = wbuf->tail = 0;
+      }
+    }
+    if (res[RIAK_URING_TIMEOUT] == -ETIME) {
+      _riak_error(rc, ETIMEDOUT, RIAK_ACT_TIMEOUT, 0);
+      return -1;
+    } else if (sent && res[RIAK_URING_RECV] == -ECANCELED) {
+      /* A short send broke the link; send the rest first. */
+      continue;
+    } else if (rbuf->tail - rbuf->head < want) {
+      if (res[RIAK_URING_RECV] <= 0) {
+        _riak_error(rc, -res[RIAK_URING_RECV], act,
+            res[RIAK_URING_RECV]);
+        return -1;
+      }
+      rbuf->tail += res[RIAK_URING_RECV];
+    }
+  }
+  return 0;
+}
+
+/** \brief Start a request; it is sent along with the first read.
+ *
+ * Returns RiakSession on success or NULL on failure.
+ *
+ * \param rc RiakClient object.
+ * \param rv Previous response for streaming requests; NULL otherwise.
+ * \param mc The message code to send.
+ * \param msg The protobuf to send; NULL if there is no body.
+ */
+static RiakSession *
+_uring_write(RiakClient *rc, RiakResponse *rv, uint8_t mc,
+    const ProtobufCMessage *msg)
+{
+  return _riak_session_open(rc, rv, mc, msg);
+}
+
+/** \brief Read a response from the Riak server.
+ *
+ * Returns a RiakResponse object on success or NULL on failure.
+ *
+ * \param rs RiakSession object.
+ */
+static RiakResponse *
+_uring_read(RiakSession *rs)
+{
+  return _riak_read_resp(rs, &_uring_fill);
+}
+
+/** \brief Switch a client to the io_uring transport.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param rc RiakClient object.
+ */
+int
+_riak_uring_init(RiakClient *rc)
+{
+  struct _RiakUring *ru;
+  struct io_uring_params p;
+  struct iovec iov[RIAK_URING_BUFS];
+  uint8_t *sq, *cq;
+  int i;
+
+  ru = rc->allocator->alloc(rc->allocator->allocator_data,
+      sizeof(struct _RiakUring));
+  if (!ru) {
+    _riak_error(rc, ENOMEM, RIAK_ACT_CONNECT, 0);
+    return -1;
+  }
+  memset(ru, 0, sizeof(struct _RiakUring));
+  memset(&p, 0, sizeof(p));
+  ru->fd = syscall(__NR_io_uring_setup, RIAK_URING_ENTRIES, &p);
+  if (ru->fd < 0) {
+    _riak_error(rc, errno, RIAK_ACT_CONNECT, 0);
+    rc->allocator->free(rc->allocator->allocator_data, ru);
+    return -1;
+  }
+  rc->_uring = ru;
+
+  /* Map the rings. */
+  ru->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ru->cq_ring_len = p.cq_off.cqes
+    + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP)
+      && ru->cq_ring_len > ru->sq_ring_len) {
+    ru->sq_ring_len = ru->cq_ring_len;
+  }
+  ru->sq_ring = mmap(NULL, ru->sq_ring_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ru->fd, IORING_OFF_SQ_RING);
+  if (ru->sq_ring == MAP_FAILED) {
+    ru->sq_ring = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ru->cq_ring = ru->sq_ring;
+  } else {
+    ru->cq_ring = mmap(NULL, ru->cq_ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ru->fd, IORING_OFF_CQ_RING);
+    if (ru->cq_ring == MAP_FAILED) {
+      ru->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  ru->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ru->sqes = mmap(NULL, ru->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ru->fd, IORING_OFF_SQES);
+  if (ru->sqes == MAP_FAILED) {
+    ru->sqes = NULL;
+    goto fail;
+  }
+  sq = ru->sq_ring;
+  cq = ru->cq_ring;
+  ru->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ru->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ru->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ru->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ru->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ru->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ru->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* Register the receive buffers; carry on without them if refused. */
+  ru->bufs = mmap(NULL, RIAK_URING_BUFS * RIAK_URING_BUF_SIZE,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ru->bufs == MAP_FAILED) {
+    ru->bufs = NULL;
+  } else {
+    for (i = 0; i < RIAK_URING_BUFS; i++) {
+      iov[i].iov_base = ru->bufs + (size_t)i * RIAK_URING_BUF_SIZE;
+      iov[i].iov_len = RIAK_URING_BUF_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ru->fd, IORING_REGISTER_BUFFERS,
+          iov, RIAK_URING_BUFS) < 0) {
+      (void)munmap(ru->bufs, RIAK_URING_BUFS * RIAK_URING_BUF_SIZE);
+      ru->bufs = NULL;
+    } else {
+      for (i = 0; i < RIAK_URING_BUFS; i++) {
+        ru->free_bufs[ru->n_free++] = RIAK_URING_BUFS - 1 - i;
+      }
+    }
+  }
+
+  rc->_write = &_uring_write;
+  rc->_read = &_uring_read;
+  return 0;
+
+fail:
+  _riak_error(rc, errno, RIAK_ACT_CONNECT, 0);
+  _riak_uring_free(rc);
+  return -1;
+}
+
+/** \brief Return a registered buffer to the ring.
+ *
+ * \param rc RiakClient object.
+ * \param buf Buffer whose memory is a registered buffer.
+ */
+void
+_riak_uring_put_buf(RiakClient *rc, struct _RiakBuf *buf)
+{
+  struct _RiakUring *ru = rc->_uring;
+
+  ru->free_bufs[ru->n_free++] = (buf->data - ru->bufs) / RIAK_URING_BUF_SIZE;
+  memset(buf, 0, sizeof(struct _RiakBuf));
+}
+
+/** \brief Release the io_uring transport state.
+ *
+ * Every registered buffer must have been returned.
+ *
+ * \param rc RiakClient object.
+ */
+void
+_riak_uring_free(RiakClient *rc)
+{
+  struct _RiakUring *ru = rc->_uring;
+
+  if (ru->bufs) {
+    (void)munmap(ru->bufs, RIAK_URING_BUFS * RIAK_URING_BUF_SIZE);
+  }
+  if (ru->sqes) {
+    (void)munmap(ru->sqes, ru->sqes_len);
+  }
+  if (ru->cq_ring && ru->cq_ring != ru->sq_ring) {
+    (void)munmap(ru->cq_ring, ru->cq_ring_len);
+  }
+  if (ru->sq_ring) {
+    (void)munmap(ru->sq_ring, ru->sq_ring_len);
+  }
+  close(ru->fd);
+  rc->allocator->free(rc->allocator->allocator_data, ru);
+  rc->_uring = NULL;
+}
+
+#else /* !__NR_io_uring_setup */
+
+int
+_riak_uring_init(RiakClient *rc)
+{
+  _riak_error(rc, ENOSYS, RIAK_ACT_CONNECT, 0);
+  return -1;
+}
+
+void
+_riak_uring_put_buf(RiakClient *rc, struct _RiakBuf *buf)
+{
+  (void)rc;
+  memset(buf, 0, sizeof(struct _RiakBuf));
+}
+
+void
+_riak_uring_free(RiakClient *rc)
+{
+  rc->_uring = NULL;
+}
+
+#endif /* __NR_io_uring_setup */
@@ -0,0 +1,509 @@
+/** \file
+ *
+ * \brief Get responses viewed in place.
+ *
+ * Unpacking a get response copies the value, the vclock and every
+ * other byte field out of the receive buffer.  After
+ * riak_view_config() a large enough get response is decoded here
+ * instead: the messages are allocated as usual, but their byte fields
+ * point into the frame, which stays in the receive buffer until the
+ * response is freed.
+ *
+ * A buffer with frames still viewed carries a hold counting the
+ * responses using it, plus one for the connection.  While it is held
+ * the connection never moves or reuses the bytes behind \c head; when
+ * it needs more room it reads into a fresh buffer and leaves the old
+ * one to whichever response lets it go last.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "riakccs/api.h"
+#include "riakccs/comms.h"
+
+/** \brief Read a varint.
+ *
+ * Returns 0 on success, -1 if it runs past \c end or is too long.
+ *
+ * \param p Where to read; advanced past the varint.
+ * \param end End of the message.
+ * \param v Set to the value.
+ */
+static int
+_view_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+  int shift;
+
+  *v = 0;
+  for (shift = 0; shift < 64 && *p < end; shift += 7) {
+    *v |= (uint64_t)(**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** \brief Read the next field of a message.
+ *
+ * Fixed width fields are skipped over; nothing here needs them.
+ * Returns 0 on success, -1 if the message is malformed.
+ *
+ * \param p Where to read; advanced past the field.
+ * \param end End of the message.
+ * \param f Set to the field.
+ */
+int
+_riak_wire_field(const uint8_t **p, const uint8_t *end, struct _RiakField *f)
+{
+  uint64_t tag;
+
+  if (_view_varint(p, end, &tag) < 0 || tag >> 3 == 0
+      || tag >> 3 > UINT32_MAX) {
+    return -1;
+  }
+  f->id = (uint32_t)(tag >> 3);
+  f->type = tag & 7;
+  switch (f->type) {
+    case RIAK_WIRE_VARINT:
+      return _view_varint(p, end, &f->v);
+    case RIAK_WIRE_64BIT:
+      if (end - *p < 8) {
+        return -1;
+      }
+      *p += 8;
+      return 0;
+    case RIAK_WIRE_BYTES:
+      if (_view_varint(p, end, &f->v) < 0 || f->v > (uint64_t)(end - *p)) {
+        return -1;
+      }
+      f->bytes.len = f->v;
+      f->bytes.data = (uint8_t *)*p;
+      *p += f->v;
+      return 0;
+    case RIAK_WIRE_32BIT:
+      if (end - *p < 4) {
+        return -1;
+      }
+      *p += 4;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/** \brief Count the length delimited fields of a message with each id.
+ *
+ * Returns 0 on success, -1 if the message is malformed.
+ *
+ * \param msg The message.
+ * \param n Set to the count for each id below \c max.
+ * \param max Number of entries in \c n.
+ */
+static int
+_view_count(ProtobufCBinaryData *msg, size_t *n, uint32_t max)
+{
+  const uint8_t *p = msg->data, *end = msg->data + msg->len;
+  struct _RiakField f;
+
+  memset(n, 0, max * sizeof(*n));
+  while (p < end) {
+    if (_riak_wire_field(&p, end, &f) < 0) {
+      return -1;
+    }
+    if (f.id < max && f.type == RIAK_WIRE_BYTES) {
+      n[f.id]++;
+    }
+  }
+  return 0;
+}
+
+/** \brief Allocate an array of pointers to \c n messages of \c size.
+ *
+ * The messages follow the pointers in the same allocation.  Returns
+ * NULL on failure.
+ *
+ * \param pa Allocator.
+ * \param n Number of messages.
+ * \param size Size of each message.
+ */
+static void **
+_view_array(ProtobufCAllocator *pa, size_t n, size_t size)
+{
+  void **a;
+  size_t i;
+
+  a = pa->alloc(pa->allocator_data, n * (sizeof(void *) + size));
+  if (!a) {
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    a[i] = (uint8_t *)(a + n) + i * size;
+  }
+  return a;
+}
+
+/** \brief Fill in a link from its serialised form.
+ *
+ * Returns 0 on success, -1 if it is malformed.
+ *
+ * \param msg The serialised link.
+ * \param link Link to fill in.
+ */
+static int
+_view_link(ProtobufCBinaryData *msg, RpbLink *link)
+{
+  static const RpbLink init = RPB_LINK__INIT;
+  const uint8_t *p = msg->data, *end = msg->data + msg->len;
+  struct _RiakField f;
+
+  *link = init;
+  while (p < end) {
+    if (_riak_wire_field(&p, end, &f) < 0) {
+      return -1;
+    }
+    if (f.id > 3) {
+      continue;
+    }
+    if (f.type != RIAK_WIRE_BYTES) {
+      return -1;
+    }
+    switch (f.id) {
+      case 1:
+        link->has_bucket = 1;
+        link->bucket = f.bytes;
+        break;
+      case 2:
+        link->has_key = 1;
+        link->key = f.bytes;
+        break;
+      case 3:
+        link->has_tag = 1;
+        link->tag = f.bytes;
+        break;
+    }
+  }
+  return 0;
+}
+
+/** \brief Fill in a pair from its serialised form.
+ *
+ * Returns 0 on success, -1 if it is malformed.
+ *
+ * \param msg The serialised pair.
+ * \param pair Pair to fill in.
+ */
+int
+_riak_wire_pair(ProtobufCBinaryData *msg, RpbPair *pair)
+{
+  static const RpbPair init = RPB_PAIR__INIT;
+  const uint8_t *p = msg->data, *end = msg->data + msg->len;
+  struct _RiakField f;
+  int has_key = 0;
+
+  *pair = init;
+  while (p < end) {
+    if (_riak_wire_field(&p, end, &f) < 0) {
+      return -1;
+    }
+    if (f.id > 2) {
+      continue;
+    }
+    if (f.type != RIAK_WIRE_BYTES) {
+      return -1;
+    }
+    if (f.id == 1) {
+      has_key = 1;
+      pair->key = f.bytes;
+    } else {
+      pair->has_value = 1;
+      pair->value = f.bytes;
+    }
+  }
+  return has_key? 0: -1;
+}
+
+/** \brief Fill in a pair array of a content.
+ *
+ * Returns 0 on success, -1 on failure.
+ *
+ * \param pa Allocator.
+ * \param msg The serialised content.
+ * \param id Field number of the pairs.
+ * \param n Number of pairs.
+ * \param pairs Set to the array.
+ * \param n_pairs Set to \c n once the array is made.
+ */
+static int
+_view_pairs(ProtobufCAllocator *pa, ProtobufCBinaryData *msg, uint32_t id,
+    size_t n, RpbPair ***pairs, size_t *n_pairs)
+{
+  const uint8_t *p = msg->data, *end = msg->data + msg->len;
+  struct _RiakField f;
+  size_t i = 0;
+
+  if (n == 0) {
+    return 0;
+  }
+  *pairs = (RpbPair **)_view_array(pa, n, sizeof(RpbPair));
+  if (!*pairs) {
+    return -1;
+  }
+  *n_pairs = n;
+  while (p < end) {
+    (void)_riak_wire_field(&p, end, &f);
+    if (f.id == id && (f.type != RIAK_WIRE_BYTES
+          || _riak_wire_pair(&f.bytes, (*pairs)[i++]) < 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** \brief Fill in a content from its serialised form.
+ *
+ * Returns 0 on success, -1 on failure.  On failure \c content holds
+ * what was allocated so far, for _riak_view_free().
+ *
+ * \param pa Allocator.
+ * \param msg The serialised content.
+ * \param content Content to fill in.
+ */
+static int
+_view_content(ProtobufCAllocator *pa, ProtobufCBinaryData *msg,
+    RpbContent *content)
+{
+  static const RpbContent init = RPB_CONTENT__INIT;
+  const uint8_t *p = msg->data, *end = msg->data + msg->len;
+  struct _RiakField f;
+  size_t n[11], i = 0;
+  int has_value = 0;
+
+  *content = init;
+  if (_view_count(msg, n, 11) < 0) {
+    return -1;
+  }
+  if (n[6] > 0) {
+    content->links = (RpbLink **)_view_array(pa, n[6], sizeof(RpbLink));
+    if (!content->links) {
+      return -1;
+    }
+    content->n_links = n[6];
+  }
+  if (_view_pairs(pa, msg, 9, n[9], &content->usermeta,
+        &content->n_usermeta) < 0
+      || _view_pairs(pa, msg, 10, n[10], &content->indexes,
+        &content->n_indexes) < 0) {
+    return -1;
+  }
+  while (p < end) {
+    (void)_riak_wire_field(&p, end, &f);
+    if (f.id > 11 || f.id == 9 || f.id == 10) {
+      continue;
+    }
+    if (f.type != (f.id < 7? RIAK_WIRE_BYTES: RIAK_WIRE_VARINT)) {
+      return -1;
+    }
+    switch (f.id) {
+      case 1:
+        has_value = 1;
+        content->value = f.bytes;
+        break;
+      case 2:
+        content->has_content_type = 1;
+        content->content_type = f.bytes;
+        break;
+      case 3:
+        content->has_charset = 1;
+        content->charset = f.bytes;
+        break;
+      case 4:
+        content->has_content_encoding = 1;
+        content->content_encoding = f.bytes;
+        break;
+      case 5:
+        content->has_vtag = 1;
+        content->vtag = f.bytes;
+        break;
+      case 6:
+        if (_view_link(&f.bytes, content->links[i++]) < 0) {
+          return -1;
+        }
+        break;
+      case 7:
+        content->has_last_mod = 1;
+        content->last_mod = (uint32_t)f.v;
+        break;
+      case 8:
+        content->has_last_mod_usecs = 1;
+        content->last_mod_usecs = (uint32_t)f.v;
+        break;
+      case 11:
+        content->has_deleted = 1;
+        content->deleted = f.v != 0;
+        break;
+    }
+  }
+  return has_value? 0: -1;
+}
+
+/** \brief Free a get response from _riak_view_get_resp().
+ *
+ * Frees the messages; the bytes they point at belong to the receive
+ * buffer.
+ *
+ * \param pa Allocator the response was made with.
+ * \param resp The response; or NULL.
+ */
+void
+_riak_view_free(ProtobufCAllocator *pa, RpbGetResp *resp)
+{
+  RpbContent *content;
+  size_t i;
+
+  if (!resp) {
+    return;
+  }
+  for (i = 0; i < resp->n_content; i++) {
+    content = resp->content[i];
+    if (content->links) {
+      pa->free(pa->allocator_data, content->links);
+    }
+    if (content->usermeta) {
+      pa->free(pa->allocator_data, content->usermeta);
+    }
+    if (content->indexes) {
+      pa->free(pa->allocator_data, content->indexes);
+    }
+  }
+  pa->free(pa->allocator_data, resp);
+}
+
+/** \brief Decode a get response, pointing into its frame.
+ *
+ * Each message and its repeated fields take one allocation.  Returns
+ * NULL if the response is malformed or memory runs out, for the caller
+ * to unpack it the usual way.
+ *
+ * \param pa Allocator for the messages.
+ * \param len Length of the protobuf.
+ * \param pb The serialised protobuf.
+ */
+RpbGetResp *
+_riak_view_get_resp(ProtobufCAllocator *pa, size_t len, uint8_t *pb)
+{
+  static const RpbGetResp init = RPB_GET_RESP__INIT;
+  ProtobufCBinaryData msg = { len, pb };
+  const uint8_t *p = pb, *end = pb + len;
+  struct _RiakField f;
+  RpbGetResp *resp;
+  size_t n[2], i = 0, c;
+  void **a;
+
+  if (_view_count(&msg, n, 2) < 0) {
+    return NULL;
+  }
+  /* The response, then the content pointers, then the contents. */
+  resp = pa->alloc(pa->allocator_data, sizeof(RpbGetResp)
+      + n[1] * (sizeof(RpbContent *) + sizeof(RpbContent)));
+  if (!resp) {
+    return NULL;
+  }
+  *resp = init;
+  if (n[1] > 0) {
+    a = (void **)(resp + 1);
+    for (c = 0; c < n[1]; c++) {
+      a[c] = (uint8_t *)(a + n[1]) + c * sizeof(RpbContent);
+    }
+    resp->content = (RpbContent **)a;
+  }
+  while (p < end) {
+    (void)_riak_wire_field(&p, end, &f);
+    if (f.id > 3) {
+      continue;
+    }
+    if (f.type != (f.id < 3? RIAK_WIRE_BYTES: RIAK_WIRE_VARINT)) {
+      _riak_view_free(pa, resp);
+      return NULL;
+    }
+    switch (f.id) {
+      case 1:
+        resp->n_content = ++i;
+        if (_view_content(pa, &f.bytes, resp->content[i - 1]) < 0) {
+          _riak_view_free(pa, resp);
+          return NULL;
+        }
+        break;
+      case 2:
+        resp->has_vclock = 1;
+        resp->vclock = f.bytes;
+        break;
+      case 3:
+        resp->has_unchanged = 1;
+        resp->unchanged = f.v != 0;
+        break;
+    }
+  }
+  return resp;
+}
+
+/** \brief Add a hold on a receive buffer for a response viewing it.
+ *
+ * The buffer gets a hold of its own the first time.  Returns the hold
+ * or NULL on failure.
+ *
+ * \param rc RiakClient object - for the allocator.
+ * \param buf The receive buffer.
+ */
+struct _RiakHold *
+_riak_hold_get(RiakClient *rc, struct _RiakBuf *buf)
+{
+  struct _RiakHold *hold = buf->hold;
+
+  if (!hold) {
+    hold = rc->allocator->alloc(rc->allocator->allocator_data,
+        sizeof(*hold));
+    if (!hold) {
+      return NULL;
+    }
+    hold->refs = 1;
+    hold->data = buf->data;
+    hold->allocator = rc->allocator;
+    buf->hold = hold;
+  }
+  (void)__atomic_add_fetch(&hold->refs, 1, __ATOMIC_RELAXED);
+  return hold;
+}
+
+/** \brief Release a hold on a receive buffer.
+ *
+ * The last one out frees the buffer.  Safe to call from any thread.
+ *
+ * \param hold The hold.
+ */
+void
+_riak_hold_put(struct _RiakHold *hold)
+{
+  ProtobufCAllocator *pa = hold->allocator;
+
+  if (__atomic_sub_fetch(&hold->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pa->free(pa->allocator_data, hold->data);
+    pa->free(pa->allocator_data, hold);
+  }
+}
+
+/** \brief Decode large get responses in place.
+ *
+ * A get response of at least \c min_bytes is decoded without copying
+ * its byte fields, which point into the receive buffer until the
+ * response is freed.  Has no effect on io_uring fixed buffers.
+ *
+ * \param rc Riak client object.
+ * \param min_bytes Smallest response to view; 0 to copy every one.
+ */
+void
+riak_view_config(RiakClient *rc, size_t min_bytes)
+{
+  rc->view_min = min_bytes;
+}
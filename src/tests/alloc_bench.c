@@ -0,0 +1,110 @@
+/** \file
+ *
+ * \brief Compare riak_slab_allocator with pbc_sys_allocator.
+ *
+ * Each thread repeatedly allocates what reading a get response does (a
+ * session, a response, the unpacked message with its content, vclock
+ * and value, and a frame buffer) and then frees it all, keeping a few
+ * responses live at a time as a pipelined client would.  Prints the
+ * time per allocation for each allocator.
+ *
+ * Usage: alloc_bench [threads [rounds]]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "riak_kv.pb-c.h"
+#include "riak.pb-c.h"
+#include "riakccs/api.h"
+#include "riakccs/pb.h"
+
+/** Responses each thread keeps live at once. */
+#define BENCH_LIVE 16
+/** Allocations made per response. */
+#define BENCH_PARTS 7
+
+struct bench {
+  ProtobufCAllocator *a;
+  long rounds;
+};
+
+static void *
+bench_thread(void *data)
+{
+  struct bench *b = data;
+  ProtobufCAllocator *a = b->a;
+  void *live[BENCH_LIVE][BENCH_PARTS];
+  unsigned int seed = (unsigned int)(uintptr_t)&seed;
+  long r;
+  int i, slot;
+
+  for (slot = 0; slot < BENCH_LIVE; slot++) {
+    for (i = 0; i < BENCH_PARTS; i++) {
+      live[slot][i] = NULL;
+    }
+  }
+  for (r = 0; r < b->rounds; r++) {
+    slot = r % BENCH_LIVE;
+    for (i = BENCH_PARTS - 1; i >= 0; i--) {
+      a->free(a->allocator_data, live[slot][i]);
+    }
+    live[slot][0] = a->alloc(a->allocator_data, sizeof(RiakSession));
+    live[slot][1] = a->alloc(a->allocator_data, sizeof(RiakResponse));
+    live[slot][2] = a->alloc(a->allocator_data, sizeof(RpbGetResp));
+    live[slot][3] = a->alloc(a->allocator_data, sizeof(RpbContent *));
+    live[slot][4] = a->alloc(a->allocator_data, sizeof(RpbContent));
+    live[slot][5] = a->alloc(a->allocator_data, 16 + rand_r(&seed) % 1024);
+    live[slot][6] = a->alloc(a->allocator_data,
+        256 << (rand_r(&seed) % 5));
+  }
+  for (slot = 0; slot < BENCH_LIVE; slot++) {
+    for (i = BENCH_PARTS - 1; i >= 0; i--) {
+      a->free(a->allocator_data, live[slot][i]);
+    }
+  }
+  return NULL;
+}
+
+static double
+bench_run(ProtobufCAllocator *a, int n_threads, long rounds)
+{
+  struct bench b = { a, rounds };
+  struct timespec t0, t1;
+  pthread_t *threads;
+  int i;
+
+  threads = malloc(n_threads * sizeof(*threads));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < n_threads; i++) {
+    pthread_create(&threads[i], NULL, bench_thread, &b);
+  }
+  for (i = 0; i < n_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  free(threads);
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec))
+    / ((double)rounds * n_threads * BENCH_PARTS);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n_threads = argc > 1? atoi(argv[1]): 4;
+  long rounds = argc > 2? atol(argv[2]): 1000000;
+
+  /* Once each untimed, to warm the caches and the slabs. */
+  (void)bench_run(&pbc_sys_allocator, n_threads, rounds / 10);
+  (void)bench_run(&riak_slab_allocator, n_threads, rounds / 10);
+  printf("%d threads, %ld rounds each of %d allocations\n", n_threads,
+      rounds, BENCH_PARTS);
+  printf("pbc_sys_allocator:   %6.1f ns per allocation\n",
+      bench_run(&pbc_sys_allocator, n_threads, rounds));
+  printf("riak_slab_allocator: %6.1f ns per allocation\n",
+      bench_run(&riak_slab_allocator, n_threads, rounds));
+  return 0;
+}
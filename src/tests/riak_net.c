@@ -1,8 +1,10 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -21,6 +23,7 @@
 #include "riak_yokozuna.pb-c.h"
 #include "riakccs/api.h"
 #include "riakccs/pb.h"
+#include "riakccs/comms.h"
 #include "riakccs/debug.h"
 
 #include <check.h>
@@ -102,6 +105,749 @@ START_TEST(test_riak_bad_initial_connect)
 }
 END_TEST
 
+START_TEST(test_riak_pool)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int count, i;
+
+  rc = riak_client_init(NULL, 1);
+  riak_pool_config(rc, 2, 2, 0, 0);
+  count = riak_server_add(rc, riak_host, riak_port);
+  ck_assert_int_eq(count, 1);
+  ck_assert_int_eq(rc->servers[0].n_conns, 2);
+
+  /* Requests reuse the pooled connections. */
+  for (i = 0; i < 10; i++) {
+    rv = riak_ping(rc);
+    ck_assert_int_eq(rv->mc, MC_RpbPingResp);
+    riak_response_free(rc, rv);
+  }
+  ck_assert_int_eq(rc->servers[0].n_conns, 2);
+  ck_assert_int_eq(rc->servers[0].n_idle, 2);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_uring)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+
+  rc = riak_client_init_transport(NULL, 1, RIAK_TRANSPORT_URING);
+  if (!rc) {
+    /* No io_uring on this kernel. */
+    return;
+  }
+  riak_server_add(rc, riak_host, riak_port);
+
+  rv = riak_ping(rc);
+  ck_assert_int_eq(rv->success, 1);
+  ck_assert_int_eq(rv->mc, MC_RpbPingResp);
+  riak_response_free(rc, rv);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_warmup)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+
+  rc = riak_client_init(NULL, 2);
+  riak_pool_lazy(rc, 1);
+  riak_server_add(rc, riak_host, riak_port);
+  riak_server_add(rc, "127.0.0.1", "1");
+  ck_assert_int_eq(riak_servers_active(rc), 0);
+
+  /* The closed port is refused; the real server is connected. */
+  ck_assert_int_eq(riak_servers_warmup(rc, 1000), 1);
+  ck_assert_int_eq(riak_servers_active(rc), 1);
+  riak_server_del(rc, "127.0.0.1", "1");
+
+  rv = riak_ping(rc);
+  ck_assert_int_eq(rv->success, 1);
+  riak_response_free(rc, rv);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_dns)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i;
+
+  rc = riak_client_init(NULL, 1);
+  /* Replace connections after 1ms so each ping reconnects from the
+   * cached addresses. */
+  riak_pool_config(rc, 1, 2, 0, 1);
+  riak_dns_config(rc, 60000);
+  riak_server_add(rc, riak_host, riak_port);
+
+  for (i = 0; i < 3; i++) {
+    usleep(2000);
+    rv = riak_ping(rc);
+    ck_assert_int_eq(rv->success, 1);
+    riak_response_free(rc, rv);
+  }
+  ck_assert(rc->servers[0].dns != NULL);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_balance)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i;
+
+  rc = riak_client_init(NULL, 2);
+  riak_server_add(rc, riak_host, riak_port);
+  riak_server_add(rc, riak_host, riak_port);
+
+  for (i = 0; i < 20; i++) {
+    rv = riak_ping(rc);
+    ck_assert_int_eq(rv->success, 1);
+    riak_response_free(rc, rv);
+  }
+  /* Both servers are sampled and nothing is left in flight. */
+  ck_assert(rc->servers[0].lat_us > 0);
+  ck_assert(rc->servers[1].lat_us > 0);
+  ck_assert_int_eq(rc->servers[0].in_flight, 0);
+  ck_assert_int_eq(rc->servers[1].in_flight, 0);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_breaker)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i;
+
+  rc = riak_client_init(NULL, 2);
+  riak_pool_lazy(rc, 1);
+  riak_breaker_config(rc, 2, 60000);
+  /* Don't back off, so every ping tries the dead server. */
+  riak_retry_config(rc, 2, 0);
+  riak_server_add(rc, riak_host, riak_port);
+  /* Nothing listens on port 1. */
+  riak_server_add(rc, riak_host, "1");
+
+  for (i = 0; i < 10; i++) {
+    rv = riak_ping(rc);
+    ck_assert_int_eq(rv->success, 1);
+    riak_response_free(rc, rv);
+  }
+  ck_assert_int_eq(rc->servers[0].ejected, 0);
+  ck_assert_int_eq(rc->servers[1].ejected, 1);
+  ck_assert_int_eq(rc->servers[0].n_ejects, 0);
+  ck_assert_int_eq(rc->servers[1].n_ejects, 1);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_retry)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i, fd;
+
+  rc = riak_client_init(NULL, 1);
+  riak_pool_config(rc, 2, 2, 60000, 0);
+  riak_server_add(rc, riak_host, riak_port);
+
+  /* Break the pooled connections; reads from them now fail. */
+  fd = open("/dev/null", O_WRONLY);
+  ck_assert(fd >= 0);
+  for (i = 0; i < rc->servers[0].n_slots; i++) {
+    if (rc->servers[0].conns[i].sd >= 0) {
+      dup2(fd, rc->servers[0].conns[i].sd);
+    }
+  }
+  close(fd);
+
+  rv = riak_ping(rc);
+  ck_assert(rv != NULL);
+  ck_assert_int_eq(rv->success, 1);
+  riak_response_free(rc, rv);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_timeout)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  RpbGetReq get_req = RPB_GET_REQ__INIT, *sent;
+  RiakResponse *rvs[4];
+  ProtobufCBinaryData keys[4];
+  struct _RiakBuf buf;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  char port[8];
+  int i, sd;
+
+  /* A server that accepts connections but never answers. */
+  sd = socket(AF_INET, SOCK_STREAM, 0);
+  ck_assert(sd >= 0);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ck_assert_int_eq(bind(sd, (struct sockaddr *)&sin, sizeof(sin)), 0);
+  ck_assert_int_eq(listen(sd, 4), 0);
+  ck_assert_int_eq(getsockname(sd, (struct sockaddr *)&sin, &len), 0);
+  snprintf(port, sizeof(port), "%d", ntohs(sin.sin_port));
+
+  rc = riak_client_init(NULL, 1);
+  riak_timeout_config(rc, 100);
+  riak_server_add(rc, "127.0.0.1", port);
+
+  rv = riak_ping(rc);
+  ck_assert(rv == NULL);
+  ck_assert_int_eq(rc->last_errno, ETIMEDOUT);
+  ck_assert_int_eq(rc->last_erract, RIAK_ACT_TIMEOUT);
+
+  /* So do asynchronous requests, queued or in flight. */
+  riak_async_pipeline(rc, 2);
+  for (i = 0; i < 4; i++) {
+    str2pbbd(&keys[i], "key");
+  }
+  ck_assert_int_eq(riak_fetch_objects(rc, "bucket", keys, 4, &get_req, rvs),
+      0);
+  ck_assert_int_eq(rc->last_errno, ETIMEDOUT);
+  ck_assert_int_eq(rc->last_erract, RIAK_ACT_TIMEOUT);
+  ck_assert_int_eq(riak_async_pending(rc), 0);
+
+  /* The default goes to the server without touching the request. */
+  memset(&buf, 0, sizeof(buf));
+  str2pbbd(&get_req.bucket, "bucket");
+  str2pbbd(&get_req.key, "key");
+  ck_assert(_riak_frame(rc, &buf, MC_RpbGetReq, &get_req.base) > 5);
+  ck_assert(!get_req.has_timeout);
+  sent = rpb_get_req__unpack(NULL, buf.tail - 5, buf.data + 5);
+  ck_assert(sent != NULL);
+  ck_assert(sent->has_timeout);
+  ck_assert_int_eq(sent->timeout, 100);
+  rpb_get_req__free_unpacked(sent, NULL);
+  _riak_buf_free(rc, &buf);
+
+  riak_servers_disconnect(rc);
+  close(sd);
+}
+END_TEST
+
+START_TEST(test_riak_keepalive)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i, fd;
+
+  rc = riak_client_init(NULL, 1);
+  riak_pool_config(rc, 2, 2, 60000, 0);
+  /* Only the pings may notice the broken connections. */
+  riak_retry_config(rc, 0, 0);
+  riak_server_add(rc, riak_host, riak_port);
+  ck_assert_int_eq(riak_keepalive_config(rc, 10, 0), 0);
+
+  usleep(20000);
+  ck_assert_int_eq(riak_pool_maintain(rc), 0);
+  ck_assert(rc->servers[0].lat_us > 0);
+
+  fd = open("/dev/null", O_WRONLY);
+  ck_assert(fd >= 0);
+  for (i = 0; i < rc->servers[0].n_slots; i++) {
+    if (rc->servers[0].conns[i].sd >= 0) {
+      dup2(fd, rc->servers[0].conns[i].sd);
+    }
+  }
+  close(fd);
+
+  usleep(20000);
+  ck_assert_int_eq(riak_pool_maintain(rc), 0);
+  rv = riak_ping(rc);
+  ck_assert(rv != NULL);
+  ck_assert_int_eq(rv->success, 1);
+  riak_response_free(rc, rv);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_limit)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  struct timespec t0, t1;
+  long ms;
+  int i;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+
+  /* Fail fast: a burst of two, then nothing for a 10th of a second. */
+  riak_limit_config(rc, 10, 2, 0, 0);
+  for (i = 0; i < 2; i++) {
+    rv = riak_ping(rc);
+    ck_assert(rv != NULL);
+    riak_response_free(rc, rv);
+  }
+  rv = riak_ping(rc);
+  ck_assert(rv == NULL);
+  ck_assert_int_eq(rc->last_errno, EAGAIN);
+  ck_assert_int_eq(rc->last_erract, RIAK_ACT_LIMIT);
+
+  /* Blocking: five more pings at 100/s take about 50ms. */
+  riak_limit_config(rc, 100, 1, 0, 1);
+  usleep(10000);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < 6; i++) {
+    rv = riak_ping(rc);
+    ck_assert(rv != NULL);
+    riak_response_free(rc, rv);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  ck_assert(ms >= 40);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+static void
+_count_ping(RiakClient *rc, RiakResponse *rv, void *data)
+{
+  if (rv && rv->mc == MC_RpbPingResp) {
+    (*(int *)data)++;
+  }
+  if (rv) {
+    riak_response_free(rc, rv);
+  }
+}
+
+START_TEST(test_riak_lanes)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int ok = 0;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+  riak_lane_config(rc, 1);
+
+  /* A bulk request in flight takes the one bulk connection... */
+  ck_assert_int_eq(riak_lane_set(RIAK_LANE_BULK), RIAK_LANE_AUTO);
+  ck_assert_int_eq(riak_async_ping(rc, _count_ping, &ok), 0);
+  rv = riak_ping(rc);
+  ck_assert(rv == NULL);
+  ck_assert_int_eq(rc->last_errno, EAGAIN);
+  ck_assert_int_eq(rc->last_erract, RIAK_ACT_LIMIT);
+
+  /* ...but leaves the rest to interactive ones. */
+  ck_assert_int_eq(riak_lane_set(RIAK_LANE_AUTO), RIAK_LANE_BULK);
+  rv = riak_ping(rc);
+  ck_assert(rv != NULL);
+  riak_response_free(rc, rv);
+
+  while (riak_async_pending(rc) > 0) {
+    ck_assert(riak_async_run(rc, 1000) >= 0);
+  }
+  ck_assert_int_eq(ok, 1);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_adapt)
+{
+  RiakClient *rc;
+  int i, ok = 0;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+  ck_assert_int_eq(riak_async_init(rc, 16), 0);
+  riak_node_adapt_config(rc, 2, 8);
+
+  /* Requests over the limit wait their turn; none fail. */
+  for (i = 0; i < 50; i++) {
+    ck_assert_int_eq(riak_async_ping(rc, _count_ping, &ok), 0);
+  }
+  while (riak_async_pending(rc) > 0) {
+    ck_assert(riak_async_run(rc, 1000) >= 0);
+    ck_assert(rc->servers[0].in_flight <= 8);
+  }
+  ck_assert_int_eq(ok, 50);
+  ck_assert(rc->servers[0].adapt_limit >= 2 << 8);
+  ck_assert(rc->servers[0].adapt_limit <= 8 << 8);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_arena)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+  /* Small enough that server info needs more than one block. */
+  riak_arena_config(rc, 64, 2);
+
+  for (i = 0; i < 4; i++) {
+    rv = riak_get_server_info(rc);
+    ck_assert(rv != NULL);
+    ck_assert_int_eq(rv->mc, MC_RpbGetServerInfoResp);
+    ck_assert(rv->si.resp->has_node);
+    riak_response_free(rc, rv);
+  }
+  ck_assert(rc->_n_arenas <= 2);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_slab)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i;
+
+  rc = riak_client_init(&riak_slab_allocator, 1);
+  riak_server_add(rc, riak_host, riak_port);
+
+  for (i = 0; i < 100; i++) {
+    rv = riak_get_server_info(rc);
+    ck_assert(rv != NULL);
+    ck_assert_int_eq(rv->mc, MC_RpbGetServerInfoResp);
+    riak_response_free(rc, rv);
+  }
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+START_TEST(test_riak_view)
+{
+  RiakClient *rc;
+  RiakResponse *rv, *rv2;
+  RpbPutReq put_req = RPB_PUT_REQ__INIT;
+  RpbContent content = RPB_CONTENT__INIT;
+  RpbGetReq get_req = RPB_GET_REQ__INIT;
+  RpbDelReq del_req = RPB_DEL_REQ__INIT;
+  char *bucket = "test",
+       *value = "Viewed in place.";
+  ProtobufCBinaryData key = { 9, "view_test" };
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+  riak_view_config(rc, 1);
+
+  str2pbbd(&put_req.bucket, bucket);
+  put_req.has_key = 1;
+  put_req.key = key;
+  put_req.content = &content;
+  str2pbbd(&content.value, value);
+  rv = riak_store_object_full(rc, &put_req);
+  ck_assert_int_eq(rv->success, 1);
+  riak_response_free(rc, rv);
+
+  /* Both views stay good while the buffer is read on. */
+  rv = riak_fetch_object_full(rc, bucket, &key, &get_req);
+  rv2 = riak_fetch_object_full(rc, bucket, &key, &get_req);
+  ck_assert_int_eq(rv->mc, MC_RpbGetResp);
+  ck_assert_int_eq(rv2->mc, MC_RpbGetResp);
+  ck_assert(rv->_hold != NULL);
+  ck_assert_int_eq(rv->g.resp->n_content, 1);
+  ck_assert_int_eq(rv->g.resp->content[0]->value.len, strlen(value));
+  ck_assert(memcmp(rv->g.resp->content[0]->value.data, value,
+        strlen(value)) == 0);
+  ck_assert(memcmp(rv2->g.resp->content[0]->value.data, value,
+        strlen(value)) == 0);
+  riak_response_free(rc, rv);
+  riak_response_free(rc, rv2);
+
+  del_req.bucket = put_req.bucket;
+  del_req.key = key;
+  rv = riak_delete_object_full(rc, &del_req);
+  riak_response_free(rc, rv);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+/* Pack with the library's encoder and with protobuf-c and compare. */
+static void
+_check_pack(uint8_t mc, const ProtobufCMessage *msg)
+{
+  uint8_t ours[512], theirs[512];
+  size_t aux = 0, len;
+
+  len = _riak_pack_size(mc, msg, &aux);
+  ck_assert_int_eq(len, protobuf_c_message_get_packed_size(msg));
+  ck_assert(len <= sizeof(ours));
+  ck_assert_int_eq(_riak_pack(mc, msg, aux, ours), len);
+  ck_assert_int_eq(protobuf_c_message_pack(msg, theirs), len);
+  ck_assert(memcmp(ours, theirs, len) == 0);
+}
+
+START_TEST(test_riak_encode)
+{
+  RpbGetReq get_req = RPB_GET_REQ__INIT;
+  RpbPutReq put_req = RPB_PUT_REQ__INIT;
+  RpbDelReq del_req = RPB_DEL_REQ__INIT;
+  RpbContent content = RPB_CONTENT__INIT;
+  RpbLink link = RPB_LINK__INIT, *links[2] = { &link, &link };
+  RpbPair meta = RPB_PAIR__INIT, index = RPB_PAIR__INIT,
+          *metas[1] = { &meta }, *indexes[2] = { &index, &meta };
+  ProtobufCMessageUnknownField unknown;
+  ProtobufCMessage *nested[3] = { &content.base, &link.base, &meta.base };
+  char value[200];
+  int i;
+
+  memset(value, 'v', sizeof(value));
+  str2pbbd(&get_req.bucket, "bucket");
+  str2pbbd(&get_req.key, "key");
+  _check_pack(MC_RpbGetReq, &get_req.base);
+  get_req.has_r = 1;
+  get_req.r = 3;
+  get_req.has_head = 1;
+  get_req.has_timeout = 1;
+  get_req.timeout = 300000;
+  get_req.has_type = 1;
+  str2pbbd(&get_req.type, "maps");
+  _check_pack(MC_RpbGetReq, &get_req.base);
+
+  del_req.bucket = get_req.bucket;
+  del_req.key = get_req.key;
+  del_req.has_vclock = 1;
+  str2pbbd(&del_req.vclock, "a85hYGBgzGDKBVIcR4M2cgczH7HPYEpkzGNlsP");
+  del_req.has_dw = 1;
+  del_req.dw = 0xffffffff;
+  del_req.has_sloppy_quorum = 1;
+  del_req.sloppy_quorum = 1;
+  _check_pack(MC_RpbDelReq, &del_req.base);
+
+  put_req.bucket = get_req.bucket;
+  put_req.content = &content;
+  content.value.data = value;
+  content.value.len = sizeof(value);
+  _check_pack(MC_RpbPutReq, &put_req.base);
+  put_req.has_key = 1;
+  put_req.key = get_req.key;
+  put_req.has_return_body = 1;
+  put_req.return_body = 1;
+  put_req.has_n_val = 1;
+  put_req.n_val = 5;
+  put_req.has_type = 1;
+  put_req.type = get_req.type;
+  content.has_content_type = 1;
+  str2pbbd(&content.content_type, "text/plain");
+  link.has_bucket = 1;
+  str2pbbd(&link.bucket, "other");
+  link.has_tag = 1;
+  str2pbbd(&link.tag, "friend");
+  content.n_links = 2;
+  content.links = links;
+  content.has_last_mod = 1;
+  content.last_mod = 1400000000;
+  str2pbbd(&meta.key, "colour");
+  meta.has_value = 1;
+  str2pbbd(&meta.value, "blue");
+  content.n_usermeta = 1;
+  content.usermeta = metas;
+  str2pbbd(&index.key, "age_int");
+  content.n_indexes = 2;
+  content.indexes = indexes;
+  content.has_deleted = 1;
+  _check_pack(MC_RpbPutReq, &put_req.base);
+
+  /* Content from a newer server may carry fields we do not know. */
+  unknown.tag = 99;
+  unknown.wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+  unknown.len = 3;
+  unknown.data = (uint8_t *)"new";
+  for (i = 0; i < 3; i++) {
+    nested[i]->n_unknown_fields = 1;
+    nested[i]->unknown_fields = &unknown;
+    _check_pack(MC_RpbPutReq, &put_req.base);
+    nested[i]->n_unknown_fields = 0;
+    nested[i]->unknown_fields = NULL;
+  }
+}
+END_TEST
+
+START_TEST(test_riak_keys)
+{
+  RiakClient *rc;
+  RiakResponse *rv = NULL;
+  RpbPutReq put_req = RPB_PUT_REQ__INIT;
+  RpbContent content = RPB_CONTENT__INIT;
+  RpbDelReq del_req = RPB_DEL_REQ__INIT;
+  char *bucket = "keys_test", *names[3] = { "k1", "key_two", "three" };
+  size_t i, j, found = 0;
+  RiakKeys *keys;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+
+  str2pbbd(&put_req.bucket, bucket);
+  put_req.has_key = 1;
+  put_req.content = &content;
+  str2pbbd(&content.value, "v");
+  for (i = 0; i < 3; i++) {
+    str2pbbd(&put_req.key, names[i]);
+    rv = riak_store_object_full(rc, &put_req);
+    ck_assert_int_eq(rv->success, 1);
+    riak_response_free(rc, rv);
+  }
+
+  /* The keys end to end match the message's keys. */
+  rv = NULL;
+  do {
+    rv = riak_list_keys(rc, rv, bucket);
+    ck_assert_int_eq(rv->mc, MC_RpbListKeysResp);
+    keys = &rv->kl.keys;
+    ck_assert_int_eq(keys->n, rv->kl.resp->n_keys);
+    for (j = 0; j < keys->n; j++) {
+      ck_assert_int_eq(keys->off[j + 1] - keys->off[j],
+          rv->kl.resp->keys[j].len);
+      ck_assert(memcmp(keys->data + keys->off[j], rv->kl.resp->keys[j].data,
+            rv->kl.resp->keys[j].len) == 0);
+      for (i = 0; i < 3; i++) {
+        if (rv->kl.resp->keys[j].len == strlen(names[i])
+            && memcmp(rv->kl.resp->keys[j].data, names[i],
+              strlen(names[i])) == 0) {
+          found++;
+        }
+      }
+    }
+  } while (!rv->kl.resp->has_done && !rv->kl.resp->done);
+  riak_response_free(rc, rv);
+  ck_assert_int_eq(found, 3);
+
+  del_req.bucket = put_req.bucket;
+  for (i = 0; i < 3; i++) {
+    str2pbbd(&del_req.key, names[i]);
+    rv = riak_delete_object_full(rc, &del_req);
+    riak_response_free(rc, rv);
+  }
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+static void *
+_ping_thread(void *data)
+{
+  RiakClient *rc = data;
+  RiakResponse *rv;
+  int i, fails = 0;
+
+  for (i = 0; i < 100; i++) {
+    rv = riak_ping(rc);
+    if (!rv) {
+      fails++;
+      continue;
+    }
+    if (rv->mc != MC_RpbPingResp) {
+      fails++;
+    }
+    riak_response_free(rc, rv);
+  }
+  return (void *)(intptr_t)fails;
+}
+
+START_TEST(test_riak_threadsafe)
+{
+  RiakClient *rc;
+  pthread_t threads[4];
+  void *fails;
+  int i, err;
+
+  rc = riak_client_init(NULL, 1);
+  riak_pool_config(rc, 1, 4, 0, 0);
+  riak_server_add(rc, riak_host, riak_port);
+  ck_assert_int_eq(riak_client_threadsafe(rc), 0);
+
+  for (i = 0; i < 4; i++) {
+    ck_assert_int_eq(pthread_create(&threads[i], NULL, _ping_thread, rc), 0);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], &fails);
+    ck_assert_int_eq((intptr_t)fails, 0);
+  }
+  ck_assert(rc->servers[0].n_conns <= 4);
+  riak_last_error(rc, &err, NULL, NULL);
+  ck_assert_int_eq(err, 0);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
+static void
+_shard_ping(RiakClient *rc, void *data)
+{
+  RiakResponse *rv;
+
+  rv = riak_ping(rc);
+  if (rv && rv->mc == MC_RpbPingResp) {
+    __atomic_add_fetch((int *)data, 1, __ATOMIC_RELAXED);
+  }
+  if (rv) {
+    riak_response_free(rc, rv);
+  }
+}
+
+static void
+_shard_settings(RiakClient *rc, void *data)
+{
+  if (rc->timeout_ms == 250 && rc->retries == 5 && rc->backoff_ms == 750
+      && rc->hedge_pct == 95) {
+    __atomic_add_fetch((int *)data, 1, __ATOMIC_RELAXED);
+  }
+}
+
+START_TEST(test_riak_shards)
+{
+  RiakClient *rc;
+  RiakShards *rs;
+  int i, ok = 0, same = 0;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+  riak_timeout_config(rc, 250);
+  riak_retry_config(rc, 5, 750);
+  riak_hedge_config(rc, 95);
+  rs = riak_shards_init(rc, 2);
+  riak_servers_disconnect(rc);
+  ck_assert(rs != NULL);
+  ck_assert_int_eq(riak_shards_count(rs), 2);
+  ck_assert_int_eq(riak_shard_current(rs), -1);
+
+  for (i = 0; i < 100; i++) {
+    ck_assert_int_eq(riak_shards_post(rs, i % 2, _shard_ping, &ok), 0);
+  }
+  /* Shards take the template's settings. */
+  for (i = 0; i < 2; i++) {
+    ck_assert_int_eq(riak_shards_post(rs, i, _shard_settings, &same), 0);
+  }
+  /* Waits for posted tasks to run. */
+  riak_shards_free(rs);
+  ck_assert_int_eq(ok, 100);
+  ck_assert_int_eq(same, 2);
+}
+END_TEST
+
 Suite *
 test_suite_riak_conn(void)
 {
@@ -111,6 +857,25 @@ test_suite_riak_conn(void)
   /* Networked tests */
   tcase_add_test(tc, test_riak_connect);
   tcase_add_test(tc, test_riak_bad_initial_connect);
+  tcase_add_test(tc, test_riak_pool);
+  tcase_add_test(tc, test_riak_uring);
+  tcase_add_test(tc, test_riak_warmup);
+  tcase_add_test(tc, test_riak_dns);
+  tcase_add_test(tc, test_riak_balance);
+  tcase_add_test(tc, test_riak_breaker);
+  tcase_add_test(tc, test_riak_retry);
+  tcase_add_test(tc, test_riak_timeout);
+  tcase_add_test(tc, test_riak_keepalive);
+  tcase_add_test(tc, test_riak_limit);
+  tcase_add_test(tc, test_riak_lanes);
+  tcase_add_test(tc, test_riak_adapt);
+  tcase_add_test(tc, test_riak_arena);
+  tcase_add_test(tc, test_riak_slab);
+  tcase_add_test(tc, test_riak_view);
+  tcase_add_test(tc, test_riak_encode);
+  tcase_add_test(tc, test_riak_keys);
+  tcase_add_test(tc, test_riak_threadsafe);
+  tcase_add_test(tc, test_riak_shards);
   suite_add_tcase(s, tc);
 
   return s;
@@ -287,6 +1052,34 @@ START_TEST(test_riak_bucket_props)
 }
 END_TEST
 
+START_TEST(test_riak_hedge)
+{
+  RiakClient *rc;
+  RiakResponse *rv;
+  int i;
+  ProtobufCBinaryData key = { 14, "hedge_test_key" };
+
+  rc = riak_client_init(NULL, 2);
+  riak_server_add(rc, riak_host, riak_port);
+  riak_server_add(rc, riak_host, riak_port);
+  /* Hedge half the gets once the servers have been timed. */
+  riak_hedge_config(rc, 50);
+
+  for (i = 0; i < 100; i++) {
+    RpbGetReq get_req = RPB_GET_REQ__INIT;
+
+    rv = riak_fetch_object_full(rc, "test", &key, &get_req);
+    ck_assert_int_eq(rv->success, 1);
+    ck_assert_int_eq(rv->mc, MC_RpbGetResp);
+    riak_response_free(rc, rv);
+  }
+  ck_assert_int_eq(rc->servers[0].in_flight, 0);
+  ck_assert_int_eq(rc->servers[1].in_flight, 0);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
 START_TEST(test_riak_get_put)
 {
   RiakClient *rc;
@@ -357,6 +1150,38 @@ START_TEST(test_riak_get_put)
 }
 END_TEST
 
+START_TEST(test_riak_event_loop)
+{
+  RiakClient *rc;
+  struct pollfd fds[8];
+  int i, n, ok = 0;
+
+  rc = riak_client_init(NULL, 1);
+  riak_server_add(rc, riak_host, riak_port);
+
+  for (i = 0; i < 10; i++) {
+    ck_assert_int_eq(riak_async_ping(rc, _count_ping, &ok), 0);
+  }
+  /* Drive the requests from a poll() loop of our own. */
+  while (riak_async_pending(rc) > 0) {
+    n = riak_async_fds(rc, fds, 8);
+    ck_assert(n <= 8);
+    if (poll(fds, n, riak_async_timeout(rc)) == 0) {
+      riak_async_process(rc, -1, 0);
+    }
+    for (i = 0; i < n; i++) {
+      if (fds[i].revents) {
+        riak_async_process(rc, fds[i].fd, fds[i].revents);
+      }
+    }
+  }
+  ck_assert_int_eq(ok, 10);
+  ck_assert_int_eq(riak_async_fds(rc, fds, 8), 0);
+
+  riak_servers_disconnect(rc);
+}
+END_TEST
+
 Suite *
 test_suite_riak_net(void)
 {
@@ -371,6 +1196,8 @@ test_suite_riak_net(void)
   tcase_add_test(tc, test_riak_list_keys);
   tcase_add_test(tc, test_riak_bucket_props);
   tcase_add_test(tc, test_riak_get_put);
+  tcase_add_test(tc, test_riak_hedge);
+  tcase_add_test(tc, test_riak_event_loop);
   suite_add_tcase(s, tc);
 
   return s;